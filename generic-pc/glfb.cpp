@@ -168,10 +168,10 @@ void GLFramebuffer::run()
 	GLenum err = glewInit();
 	if(err == GLEW_OK)
 	{
-		if((!GLEW_VERSION_1_5)||(!GLEW_EXT_pixel_buffer_object)||(!GLEW_ARB_texture_non_power_of_two))
+		if((!GLEW_VERSION_2_0)||(!GLEW_EXT_pixel_buffer_object)||(!GLEW_ARB_texture_non_power_of_two))
 		{
 			lt_info("GLFB: Sorry, your graphics card is not supported. "
-				"Needs at least OpenGL 1.5, pixel buffer objects and NPOT textures.\n");
+				"Needs at least OpenGL 2.0, pixel buffer objects and NPOT textures.\n");
 			lt_info("incompatible graphics card: %m");
 			_exit(1); /* Life is hard */
 		}
@@ -223,38 +223,169 @@ void GLFramebuffer::setupOSDBuffer()
 
 void GLFramebuffer::setupGLObjects()
 {
-	unsigned char buf[4] = { 0, 0, 0, 0 }; /* 1 black pixel */
 	glGenTextures(1, &mState.osdtex);
-	glGenTextures(1, &mState.displaytex);
+	glGenTextures(3, mState.displaytex);
 	glBindTexture(GL_TEXTURE_2D, mState.osdtex);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, mState.width, mState.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
 
-	glBindTexture(GL_TEXTURE_2D, mState.displaytex); /* we do not yet know the size so will set that inline */
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	/* we do not yet know the video size, the textures are sized with
+	 * the first frame. Nothing is drawn until then, so it starts black */
+	for (int i = 0; i < 3; i++) {
+		glBindTexture(GL_TEXTURE_2D, mState.displaytex[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	mState.displayw = mState.displayh = 0;
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); /* the video planes are not padded */
 
 	glGenBuffers(1, &mState.pbo);
-	glGenBuffers(1, &mState.displaypbo);
 
-	/* hack to start with black video buffer instead of white */
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, sizeof(buf), buf, GL_STREAM_DRAW_ARB);
-	glBindTexture(GL_TEXTURE_2D, mState.displaytex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	/* persistently mapped PBOs save mapping them for every frame */
+	mState.persistent = GLEW_ARB_buffer_storage && GLEW_ARB_sync;
+	for (int i = 0; i < DISPLAY_PBOS; i++) {
+		mState.displaymap[i] = NULL;
+		mState.displayfence[i] = 0;
+	}
+	mState.displaypbosize = 0;
+	mState.displaypbonext = 0;
+
+	if (!setupShader()) {
+		lt_info("GLFB: Sorry, could not set up the YUV shader\n");
+		_exit(1);
+	}
+	lt_info("GLFB: video through YUV shader, %s PBOs\n", mState.persistent ? "persistent" : "streamed");
+}
+
+static const char *yuv_shader =
+	"uniform sampler2D ytex;\n"
+	"uniform sampler2D utex;\n"
+	"uniform sampler2D vtex;\n"
+	"uniform mat3 yuv2rgb;\n"
+	"uniform vec3 yuvoffset;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 yuv = vec3(texture2D(ytex, gl_TexCoord[0].st).r,\n"
+	"			texture2D(utex, gl_TexCoord[0].st).r,\n"
+	"			texture2D(vtex, gl_TexCoord[0].st).r);\n"
+	"	gl_FragColor = vec4(yuv2rgb * (yuv - yuvoffset), 1.0);\n"
+	"}\n";
+
+/* only a fragment shader, the vertices still go the fixed function way */
+bool GLFramebuffer::setupShader()
+{
+	GLint ok = 0;
+	char log[1024];
+	GLuint shader = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(shader, 1, &yuv_shader, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		lt_info("GLFB::%s: compile: %s\n", __func__, log);
+		glDeleteShader(shader);
+		return false;
+	}
+	mState.program = glCreateProgram();
+	glAttachShader(mState.program, shader);
+	glLinkProgram(mState.program);
+	glDeleteShader(shader); /* goes with the program */
+	glGetProgramiv(mState.program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		glGetProgramInfoLog(mState.program, sizeof(log), NULL, log);
+		lt_info("GLFB::%s: link: %s\n", __func__, log);
+		glDeleteProgram(mState.program);
+		return false;
+	}
+	glUseProgram(mState.program);
+	glUniform1i(glGetUniformLocation(mState.program, "ytex"), 0);
+	glUniform1i(glGetUniformLocation(mState.program, "utex"), 1);
+	glUniform1i(glGetUniformLocation(mState.program, "vtex"), 2);
+	glUseProgram(0);
+	mState.yuv2rgb = glGetUniformLocation(mState.program, "yuv2rgb");
+	mState.yuvoffset = glGetUniformLocation(mState.program, "yuvoffset");
+	setColorMatrix(false, false);
+	return true;
+}
+
+/* BT.601 or BT.709 colors, 16..235 or full range */
+void GLFramebuffer::setColorMatrix(bool bt709, bool fullrange)
+{
+	float kr = bt709 ? 0.2126f : 0.299f;
+	float kb = bt709 ? 0.0722f : 0.114f;
+	float kg = 1.0f - kr - kb;
+	float ys = fullrange ? 1.0f : 255.0f / 219.0f;
+	float cs = fullrange ? 1.0f : 255.0f / 224.0f;
+	GLfloat m[9] = { /* row by row, GL transposes it */
+		ys, 0.0f,				cs * 2 * (1 - kr),
+		ys, -cs * 2 * (1 - kb) * kb / kg,	-cs * 2 * (1 - kr) * kr / kg,
+		ys, cs * 2 * (1 - kb),			0.0f
+	};
+	GLfloat o[3] = { fullrange ? 0.0f : 16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f };
+	glUseProgram(mState.program);
+	glUniformMatrix3fv(mState.yuv2rgb, 1, GL_TRUE, m);
+	glUniform3fv(mState.yuvoffset, 1, o);
+	glUseProgram(0);
+	mState.bt709 = bt709;
+	mState.fullrange = fullrange;
+}
+
+void GLFramebuffer::setupDisplayPBOs(int size)
+{
+	releaseDisplayPBOs();
+	glGenBuffers(DISPLAY_PBOS, mState.displaypbo);
+	bool mapped = true;
+	for (int i = 0; i < DISPLAY_PBOS; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo[i]);
+		if (mState.persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+			mState.displaymap[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+			if (!mState.displaymap[i])
+				mapped = false;
+		} else
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	}
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	mState.displaypbosize = size;
+	mState.displaypbonext = 0;
+	if (!mapped) {
+		lt_info("GLFB::%s: mapping PBOs failed, streaming instead\n", __func__);
+		mState.persistent = false;
+		setupDisplayPBOs(size);
+	}
 }
 
+void GLFramebuffer::releaseDisplayPBOs()
+{
+	if (!mState.displaypbosize)
+		return;
+	for (int i = 0; i < DISPLAY_PBOS; i++) {
+		if (mState.displayfence[i])
+			glDeleteSync(mState.displayfence[i]);
+		mState.displayfence[i] = 0;
+		if (mState.displaymap[i]) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo[i]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			mState.displaymap[i] = NULL;
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(DISPLAY_PBOS, mState.displaypbo);
+	mState.displaypbosize = 0;
+}
 
 void GLFramebuffer::releaseGLObjects()
 {
+	releaseDisplayPBOs();
+	glDeleteProgram(mState.program);
 	glDeleteBuffers(1, &mState.pbo);
-	glDeleteBuffers(1, &mState.displaypbo);
 	glDeleteTextures(1, &mState.osdtex);
-	glDeleteTextures(1, &mState.displaytex);
+	glDeleteTextures(3, mState.displaytex);
 }
 
 
@@ -419,8 +550,16 @@ void GLFramebuffer::render()
 				break;
 		}
 	}
-	glBindTexture(GL_TEXTURE_2D, mState.displaytex);
-	drawSquare(zoom, xscale);
+	if (mState.displayw > 0) {
+		/* Y last, on unit 0 with the texture coordinates */
+		for (int i = 2; i >= 0; i--) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, mState.displaytex[i]);
+		}
+		glUseProgram(mState.program);
+		drawSquare(zoom, xscale);
+		glUseProgram(0);
+	}
 	glBindTexture(GL_TEXTURE_2D, mState.osdtex);
 	drawSquare(1.0, -100);
 
@@ -553,14 +692,55 @@ void GLFramebuffer::bltDisplayBuffer()
 		mVAchanged = true;
 	}
 
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, buf->size(), &(*buf)[0], GL_STREAM_DRAW_ARB);
-
-	glBindTexture(GL_TEXTURE_2D, mState.displaytex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	/* the planes as laid out by avpicture_fill() */
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	int ysize = w * h, csize = cw * ch;
+	int size = ysize + 2 * csize;
+	if ((int)buf->size() < size)
+		return;
+	if (size > mState.displaypbosize)
+		setupDisplayPBOs(size);
+
+	int i = mState.displaypbonext;
+	mState.displaypbonext = (i + 1) % DISPLAY_PBOS;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo[i]);
+	if (mState.persistent) {
+		/* wait until the GL has uploaded the frame before last from it */
+		if (mState.displayfence[i]) {
+			glClientWaitSync(mState.displayfence[i], GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+			glDeleteSync(mState.displayfence[i]);
+			mState.displayfence[i] = 0;
+		}
+		memcpy(mState.displaymap[i], &(*buf)[0], size);
+	} else {
+		/* orphan the old storage instead of waiting for it */
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, mState.displaypbosize, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, size, &(*buf)[0]);
+	}
 
+	/* the textures are only reallocated if the video size changes */
+	bool resize = (w != mState.displayw || h != mState.displayh);
+	const int pw[3] = { w, cw, cw };
+	const int ph[3] = { h, ch, ch };
+	const intptr_t offset[3] = { 0, ysize, ysize + csize };
+	for (int p = 0; p < 3; p++) {
+		glBindTexture(GL_TEXTURE_2D, mState.displaytex[p]);
+		if (resize)
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, pw[p], ph[p], 0,
+					GL_LUMINANCE, GL_UNSIGNED_BYTE, (GLvoid *)offset[p]);
+		else
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pw[p], ph[p],
+					GL_LUMINANCE, GL_UNSIGNED_BYTE, (GLvoid *)offset[p]);
+	}
+	mState.displayw = w;
+	mState.displayh = h;
+	if (mState.persistent)
+		mState.displayfence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
+	if (buf->bt709() != mState.bt709 || buf->fullrange() != mState.fullrange)
+		setColorMatrix(buf->bt709(), buf->fullrange());
+
 	/* "rate control" mechanism starts here...
 	 * this implementation is pretty naive and not working too well, but
 	 * better this than nothing... :-) */
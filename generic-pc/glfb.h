@@ -30,6 +30,10 @@ extern "C" {
 #include <libavutil/rational.h>
 }
 
+/* video frames are uploaded through a ring of PBOs, so that writing one does
+   not wait for the GL still reading the last */
+#define DISPLAY_PBOS 3
+
 class GLFramebuffer : public OpenThreads::Thread
 {
 public:
@@ -88,6 +92,9 @@ private:
 	void setupCtx();		/* create the window and make the context current */
 	void setupOSDBuffer();		/* create the OSD buffer */
 	void setupGLObjects();		/* PBOs, textures and stuff */
+	bool setupShader();		/* YUV -> RGB conversion */
+	void setupDisplayPBOs(int size);	/* (re)allocate the video PBOs */
+	void releaseDisplayPBOs();
 	void releaseGLObjects();
 	void drawSquare(float size, float x_factor = 1);	/* do not be square */
 
@@ -96,12 +103,25 @@ private:
 		int height;
 		GLuint osdtex;		/* holds the OSD texture */
 		GLuint pbo;		/* PBO we use for transfer to texture */
-		GLuint displaytex;	/* holds the display texture */
-		GLuint displaypbo;
+		GLuint displaytex[3];	/* Y, U and V plane of the video */
+		int displayw;		/* size of displaytex[0], 0 = no video yet */
+		int displayh;
+		GLuint displaypbo[DISPLAY_PBOS];	/* ring of video upload PBOs */
+		void *displaymap[DISPLAY_PBOS];		/* persistent mappings, or NULL */
+		GLsync displayfence[DISPLAY_PBOS];	/* set when the GL is done with a PBO */
+		int displaypbosize;
+		int displaypbonext;
+		bool persistent;	/* ARB_buffer_storage: map the PBOs once */
+		GLuint program;		/* YUV -> RGB fragment shader */
+		GLint yuv2rgb;		/* its uniforms */
+		GLint yuvoffset;
+		bool bt709;		/* colors of the last uploaded frame */
+		bool fullrange;
 		bool blit;
 	} mState;
 
 	void bltOSDBuffer();
 	void bltDisplayBuffer();
+	void setColorMatrix(bool bt709, bool fullrange);
 };
 #endif
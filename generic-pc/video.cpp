@@ -18,7 +18,7 @@
  *
  * cVideo implementation with decoder.
  * uses ffmpeg <http://ffmpeg.org> for demuxing / decoding
- * decoded frames are stored in SWFramebuffer class
+ * decoded frames are stored as YUV420P in SWFramebuffer class
  *
  * TODO: buffer handling surely needs some locking...
  */
@@ -224,7 +224,7 @@ void cVideo::ShowPicture(const char *fname, const char *)
 	AVFormatContext *avfc = NULL;
 	AVCodecContext *c = NULL;
 	AVCodec *codec;
-	AVFrame *frame, *rgbframe;
+	AVFrame *frame;
 	AVPacket avpkt;
 
 	if (avformat_open_input(&avfc, fname, NULL, NULL) < 0) {
@@ -251,8 +251,7 @@ void cVideo::ShowPicture(const char *fname, const char *)
 		goto out_close;
 	}
 	frame = avcodec_alloc_frame();
-	rgbframe = avcodec_alloc_frame();
-	if (!frame || !rgbframe) {
+	if (!frame) {
 		lt_info("%s: Could not allocate video frame\n", __func__);
 		goto out_free;
 	}
@@ -270,24 +269,10 @@ void cVideo::ShowPicture(const char *fname, const char *)
 	if (avpkt.size > len)
 		lt_info("%s: WARN: pkt->size %d != len %d\n", __func__, avpkt.size, len);
 	if (got_frame) {
-		unsigned int need = avpicture_get_size(PIX_FMT_RGB32, c->width, c->height);
-		struct SwsContext *convert = sws_getContext(c->width, c->height, c->pix_fmt,
-							    c->width, c->height, PIX_FMT_RGB32,
-							    SWS_BICUBIC, 0, 0, 0);
-		if (!convert)
-			lt_info("%s: ERROR setting up SWS context\n", __func__);
-		else {
-			buf_m.lock();
-			SWFramebuffer *f = &buffers[buf_in];
-			if (f->size() < need)
-				f->resize(need);
-			avpicture_fill((AVPicture *)rgbframe, &(*f)[0], PIX_FMT_RGB32,
-					c->width, c->height);
-			sws_scale(convert, frame->data, frame->linesize, 0, c->height,
-					rgbframe->data, rgbframe->linesize);
-			sws_freeContext(convert);
-			f->width(c->width);
-			f->height(c->height);
+		struct SwsContext *convert = NULL;
+		buf_m.lock();
+		SWFramebuffer *f = &buffers[buf_in];
+		if (storeFrame(f, frame, c, &convert)) {
 			f->pts(AV_NOPTS_VALUE);
 			AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[stream_id], frame);
 			f->AR(a);
@@ -300,14 +285,14 @@ void cVideo::ShowPicture(const char *fname, const char *)
 				buf_out %= VDEC_MAXBUFS;
 				buf_num--;
 			}
-			buf_m.unlock();
 		}
+		buf_m.unlock();
+		sws_freeContext(convert);
 	}
 	av_free_packet(&avpkt);
  out_free:
 	avcodec_close(c);
 	avcodec_free_frame(&frame);
-	avcodec_free_frame(&rgbframe);
  out_close:
 	avformat_close_input(&avfc);
 	lt_debug("%s(%s) end\n", __func__, fname);
@@ -351,6 +336,39 @@ int cVideo::SetStreamType(VIDEO_FORMAT v)
 	return 0;
 }
 
+/* copies a decoded picture to f, called with buf_m held. Pictures that are
+ * not YUV420P already are converted to it, the conversion to RGB and the
+ * scaling are left to the GL thread */
+bool cVideo::storeFrame(SWFramebuffer *f, AVFrame *frame, AVCodecContext *c, struct SwsContext **convert)
+{
+	AVPicture pic;
+	unsigned int need = avpicture_get_size(PIX_FMT_YUV420P, c->width, c->height);
+	if (f->size() < need)
+		f->resize(need);
+	avpicture_fill(&pic, &(*f)[0], PIX_FMT_YUV420P, c->width, c->height);
+	if (c->pix_fmt == PIX_FMT_YUV420P || c->pix_fmt == PIX_FMT_YUVJ420P)
+		av_picture_copy(&pic, (AVPicture *)frame, PIX_FMT_YUV420P, c->width, c->height);
+	else {
+		*convert = sws_getCachedContext(*convert,
+						c->width, c->height, c->pix_fmt,
+						c->width, c->height, PIX_FMT_YUV420P,
+						SWS_BICUBIC, 0, 0, 0);
+		if (!*convert) {
+			lt_info("%s: ERROR setting up SWS context\n", __func__);
+			return false;
+		}
+		sws_scale(*convert, frame->data, frame->linesize, 0, c->height,
+				pic.data, pic.linesize);
+	}
+	f->width(c->width);
+	f->height(c->height);
+	/* untagged HD streams are BT.709 nearly always */
+	f->bt709(c->colorspace == AVCOL_SPC_BT709 ||
+		 (c->colorspace == AVCOL_SPC_UNSPECIFIED && c->height > 576));
+	f->fullrange(c->color_range == AVCOL_RANGE_JPEG || c->pix_fmt == PIX_FMT_YUVJ420P);
+	return true;
+}
+
 cVideo::SWFramebuffer *cVideo::getDecBuf(void)
 {
 	buf_m.lock();
@@ -397,7 +415,7 @@ void cVideo::run(void)
 	AVCodecContext *c= NULL;
 	AVFormatContext *avfc = NULL;
 	AVInputFormat *inp;
-	AVFrame *frame, *rgbframe;
+	AVFrame *frame;
 	uint8_t *inbuf = (uint8_t *)av_malloc(INBUF_SIZE);
 	AVPacket avpkt;
 	struct SwsContext *convert = NULL;
@@ -453,8 +471,7 @@ void cVideo::run(void)
 		goto out;
 	}
 	frame = avcodec_alloc_frame();
-	rgbframe = avcodec_alloc_frame();
-	if (!frame || !rgbframe) {
+	if (!frame) {
 		lt_info("%s: Could not allocate video frame\n", __func__);
 		goto out2;
 	}
@@ -481,22 +498,9 @@ void cVideo::run(void)
 		if (avpkt.size > len)
 			lt_info("%s: WARN: pkt->size %d != len %d\n", __func__, avpkt.size, len);
 		if (got_frame) {
-			unsigned int need = avpicture_get_size(PIX_FMT_RGB32, c->width, c->height);
-			convert = sws_getCachedContext(convert,
-						       c->width, c->height, c->pix_fmt,
-						       c->width, c->height, PIX_FMT_RGB32,
-						       SWS_BICUBIC, 0, 0, 0);
-			if (!convert)
-				lt_info("%s: ERROR setting up SWS context\n", __func__);
-			else {
-				buf_m.lock();
-				SWFramebuffer *f = &buffers[buf_in];
-				if (f->size() < need)
-					f->resize(need);
-				avpicture_fill((AVPicture *)rgbframe, &(*f)[0], PIX_FMT_RGB32,
-						c->width, c->height);
-				sws_scale(convert, frame->data, frame->linesize, 0, c->height,
-						rgbframe->data, rgbframe->linesize);
+			buf_m.lock();
+			SWFramebuffer *f = &buffers[buf_in];
+			if (storeFrame(f, frame, c, &convert)) {
 				if (dec_w != c->width || dec_h != c->height) {
 					lt_info("%s: pic changed %dx%d -> %dx%d\n", __func__,
 							dec_w, dec_h, c->width, c->height);
@@ -504,8 +508,6 @@ void cVideo::run(void)
 					dec_h = c->height;
 					w_h_changed = true;
 				}
-				f->width(c->width);
-				f->height(c->height);
 				int64_t vpts = av_frame_get_best_effort_timestamp(frame);
 				if (v_format == VIDEO_FORMAT_MPEG2)
 					vpts += 90000*3/10; /* 300ms */
@@ -522,8 +524,8 @@ void cVideo::run(void)
 					buf_num--;
 				}
 				dec_r = c->time_base.den/(c->time_base.num * c->ticks_per_frame);
-				buf_m.unlock();
 			}
+			buf_m.unlock();
 			lt_debug("%s: time_base: %d/%d, ticks: %d rate: %d pts 0x%" PRIx64 "\n", __func__,
 					c->time_base.num, c->time_base.den, c->ticks_per_frame, dec_r,
 					av_frame_get_best_effort_timestamp(frame));
@@ -534,7 +536,6 @@ void cVideo::run(void)
  out2:
 	avcodec_close(c);
 	avcodec_free_frame(&frame);
-	avcodec_free_frame(&rgbframe);
  out:
 	avformat_close_input(&avfc);
 	av_free(pIOCtx->buffer);
@@ -547,12 +548,14 @@ void cVideo::run(void)
 	lt_info("======================== end decoder thread ================================\n");
 }
 
-static bool swscale(unsigned char *src, unsigned char *dst, int sw, int sh, int dw, int dh)
+/* src_yuv: src is a YUV420P video buffer, else RGB32 like dst */
+static bool swscale(unsigned char *src, unsigned char *dst, int sw, int sh, int dw, int dh, bool src_yuv)
 {
 	bool ret = false;
 	struct SwsContext *scale = NULL;
 	AVFrame *sframe, *dframe;
-	scale = sws_getCachedContext(scale, sw, sh, PIX_FMT_RGB32, dw, dh, PIX_FMT_RGB32, SWS_BICUBIC, 0, 0, 0);
+	scale = sws_getCachedContext(scale, sw, sh, src_yuv ? PIX_FMT_YUV420P : PIX_FMT_RGB32,
+				     dw, dh, PIX_FMT_RGB32, SWS_BICUBIC, 0, 0, 0);
 	if (!scale) {
 		lt_info_c("%s: ERROR setting up SWS context\n", __func__);
 		return false;
@@ -563,7 +566,7 @@ static bool swscale(unsigned char *src, unsigned char *dst, int sw, int sh, int
 		lt_info_c("%s: could not alloc sframe (%p) or dframe (%p)\n", __func__, sframe, dframe);
 		goto out;
 	}
-	avpicture_fill((AVPicture *)sframe, &(src[0]), PIX_FMT_RGB32, sw, sh);
+	avpicture_fill((AVPicture *)sframe, &(src[0]), src_yuv ? PIX_FMT_YUV420P : PIX_FMT_RGB32, sw, sh);
 	avpicture_fill((AVPicture *)dframe, &(dst[0]), PIX_FMT_RGB32, dw, dh);
 	sws_scale(scale, sframe->data, sframe->linesize, 0, sh, dframe->data, dframe->linesize);
  out:
@@ -607,17 +610,13 @@ bool cVideo::GetScreenImage(unsigned char * &data, int &xres, int &yres, bool ge
 	if (data == NULL)	/* out of memory? */
 		return false;
 
-	if (get_video) {
-		if (vid_w != xres || vid_h != yres) /* scale video into data... */
-			swscale(&video[0], data, vid_w, vid_h, xres, yres);
-		else /* get_video and no fancy scaling needed */
-			memcpy(data, &video[0], xres * yres * sizeof(uint32_t));
-	}
+	if (get_video) /* convert (and scale) video into data... */
+		swscale(&video[0], data, vid_w, vid_h, xres, yres, true);
 
 	if (get_osd && (osd_w != xres || osd_h != yres)) {
 		/* rescale osd */
 		s_osd.resize(need);
-		swscale(&(*osd)[0], &s_osd[0], osd_w, osd_h, xres, yres);
+		swscale(&(*osd)[0], &s_osd[0], osd_w, osd_h, xres, yres, false);
 		osd = &s_osd;
 	}
 
@@ -11,6 +11,10 @@ extern "C" {
 #include <libavutil/rational.h>
 }
 
+struct AVFrame;
+struct AVCodecContext;
+struct SwsContext;
+
 typedef enum {
 	ANALOG_SD_RGB_CINCH = 0x00,
 	ANALOG_SD_YPRPB_CINCH,
@@ -125,24 +129,32 @@ class cVideo : public OpenThreads::Thread
 	friend class GLFramebuffer;
 	friend class cDemux;
 	private:
-		/* called from GL thread */
+		/* called from GL thread. Holds a decoded picture as YUV420P, the
+		 * planes one after the other (avpicture_fill() layout), the GL
+		 * thread converts it to RGB */
 		class SWFramebuffer : public std::vector<unsigned char>
 		{
 		public:
-			SWFramebuffer() : mWidth(0), mHeight(0) {}
+			SWFramebuffer() : mWidth(0), mHeight(0), mBT709(false), mFullRange(false) {}
 			void width(int w) { mWidth = w; }
 			void height(int h) { mHeight = h; }
 			void pts(uint64_t p) { mPts = p; }
 			void AR(AVRational a) { mAR = a; }
+			void bt709(bool b) { mBT709 = b; }
+			void fullrange(bool f) { mFullRange = f; }
 			int width() const { return mWidth; }
 			int height() const { return mHeight; }
 			int64_t pts() const { return mPts; }
 			AVRational AR() const { return mAR; }
+			bool bt709() const { return mBT709; }
+			bool fullrange() const { return mFullRange; }
 		private:
 			int mWidth;
 			int mHeight;
 			int64_t mPts;
 			AVRational mAR;
+			bool mBT709;		/* else BT.601 colors */
+			bool mFullRange;	/* 0..255, else 16..235 */
 		};
 		int buf_in, buf_out, buf_num;
 		int64_t GetPTS(void);
@@ -200,6 +212,7 @@ class cVideo : public OpenThreads::Thread
 		SWFramebuffer *getDecBuf(void);
 	private:
 		void run();
+		bool storeFrame(SWFramebuffer *f, struct AVFrame *frame, struct AVCodecContext *c, struct SwsContext **convert);
 		SWFramebuffer buffers[VDEC_MAXBUFS];
 		int dec_w, dec_h;
 		int dec_r;
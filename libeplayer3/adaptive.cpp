@@ -0,0 +1,170 @@
+/*
+ * bandwidth based variant selection for adaptive http streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+#include "adaptive.h"
+
+bool VariantSelector::by_bitrate(const Variant &a, const Variant &b)
+{
+	return a.bitrate < b.bitrate;
+}
+
+VariantSelector::VariantSelector()
+{
+	pending = -1;
+	pendingTime = 0;
+	switchTime = 0;
+	fixed = false;
+	sampleBytes = 0;
+	sampleUs = 0;
+	totalUs = 0;
+	fast = slow = 0;
+}
+
+bool VariantSelector::Init(std::vector<Program> &programs)
+{
+	variants.clear();
+	fixed = false;
+	for (std::vector<Program>::iterator it = programs.begin(); it != programs.end(); ++it)
+		if (it->bitrate > 0) {
+			Variant v;
+			v.id = it->id;
+			v.bitrate = it->bitrate;
+			v.streams = it->streams;
+			variants.push_back(v);
+		}
+	std::sort(variants.begin(), variants.end(), by_bitrate);
+
+	pending = -1;
+	switchTime = 0;
+	sampleBytes = 0;
+	sampleUs = 0;
+	totalUs = 0;
+	fast = slow = 0;
+	return Active();
+}
+
+VariantSelector::Variant *VariantSelector::find(int id)
+{
+	for (std::vector<Variant>::iterator it = variants.begin(); it != variants.end(); ++it)
+		if (it->id == id)
+			return &*it;
+	return NULL;
+}
+
+void VariantSelector::Sample(int bytes, int64_t us)
+{
+	sampleBytes += bytes;
+	sampleUs += us;
+	if (sampleUs < ADAPTIVE_SAMPLE)
+		return;
+
+	double rate = sampleBytes * 8 * 1000000.0 / sampleUs;
+	double a = pow(0.5, (double) sampleUs / ADAPTIVE_FAST);
+	fast = a * fast + (1 - a) * rate;
+	a = pow(0.5, (double) sampleUs / ADAPTIVE_SLOW);
+	slow = a * slow + (1 - a) * rate;
+	totalUs += sampleUs;
+	sampleBytes = 0;
+	sampleUs = 0;
+}
+
+/* both averages start at zero, the correction removes that bias */
+int64_t VariantSelector::Estimate()
+{
+	if (!totalUs)
+		return 0;
+	double f = fast / (1 - pow(0.5, (double) totalUs / ADAPTIVE_FAST));
+	double s = slow / (1 - pow(0.5, (double) totalUs / ADAPTIVE_SLOW));
+	return (int64_t) (f < s ? f : s);
+}
+
+/* called about once a second by the play thread. Returns the id of the
+   variant to switch to, whose streams are then enabled, or -1 */
+int VariantSelector::Select(AVStream *current, int64_t now)
+{
+	if (pending > -1 && now - pendingTime > ADAPTIVE_PENDING) {
+		fprintf(stderr, "%s: no keyframe of variant %d, switch abandoned\n", __func__, pending);
+		Abandon();
+	}
+	if (pending > -1 || totalUs < ADAPTIVE_WARMUP)
+		return -1;
+
+	Variant *cur = NULL;
+	for (std::vector<Variant>::iterator it = variants.begin(); !cur && it != variants.end(); ++it)
+		if (std::find(it->streams.begin(), it->streams.end(), current) != it->streams.end())
+			cur = &*it;
+	if (!cur)
+		return -1;
+
+	int64_t estimate = Estimate();
+	Variant *to = NULL;
+	if (cur->bitrate * 100 > estimate * ADAPTIVE_DOWN) {
+		if (now - switchTime < ADAPTIVE_DOWN_HOLD)
+			return -1;
+		to = &variants.front();
+		for (std::vector<Variant>::iterator it = variants.begin(); it != variants.end(); ++it)
+			if (it->bitrate * 100 <= estimate * ADAPTIVE_DOWN)
+				to = &*it;
+	} else {
+		if (now - switchTime < ADAPTIVE_UP_HOLD)
+			return -1;
+		for (std::vector<Variant>::iterator it = variants.begin(); it != variants.end(); ++it)
+			if (it->bitrate > cur->bitrate && it->bitrate * 100 <= estimate * ADAPTIVE_UP)
+				to = &*it;
+	}
+	if (!to || to == cur)
+		return -1;
+
+	fprintf(stderr, "%s: estimate %lld kbit/s, variant %d (%lld kbit/s) -> %d (%lld kbit/s)\n", __func__,
+		(long long) estimate / 1000, cur->id, (long long) cur->bitrate / 1000, to->id, (long long) to->bitrate / 1000);
+	for (std::vector<AVStream *>::iterator it = to->streams.begin(); it != to->streams.end(); ++it)
+		(*it)->discard = AVDISCARD_DEFAULT;
+	pending = to->id;
+	pendingTime = now;
+	return pending;
+}
+
+/* the id of the pending variant if stream belongs to it, -1 otherwise */
+int VariantSelector::Pending(AVStream *stream)
+{
+	if (pending < 0)
+		return -1;
+	Variant *v = find(pending);
+	if (v && std::find(v->streams.begin(), v->streams.end(), stream) != v->streams.end())
+		return pending;
+	return -1;
+}
+
+void VariantSelector::Switched(int64_t now)
+{
+	pending = -1;
+	switchTime = now;
+}
+
+void VariantSelector::Abandon()
+{
+	Variant *v = find(pending);
+	if (v)
+		for (std::vector<AVStream *>::iterator it = v->streams.begin(); it != v->streams.end(); ++it)
+			(*it)->discard = AVDISCARD_ALL;
+	pending = -1;
+}
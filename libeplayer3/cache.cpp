@@ -0,0 +1,331 @@
+/*
+ * read-ahead cache for network streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+#include "cache.h"
+
+Cache::Cache()
+{
+	upstream = NULL;
+	avio = NULL;
+	ring = NULL;
+	size = 0;
+	prebuffer = 0;
+	start = end = pos = 0;
+	seekTo = -1;
+	streamSize = -1;
+	generation = 0;
+	error = 0;
+	running = false;
+	rateUs = 0;
+	rateBytes = 0;
+	throughput = 0;
+	interrupt.callback = NULL;
+	interrupt.opaque = NULL;
+}
+
+Cache::~Cache()
+{
+	Close();
+}
+
+bool Cache::Open(const char *url, AVIOInterruptCB *cb)
+{
+	Close();
+
+	interrupt = *cb;
+	size = CACHE_SIZE;
+	prebuffer = CACHE_PREBUFFER;
+	const char *tmp = getenv("EPLAYER3_CACHE_SIZE");
+	if (tmp && atoi(tmp) > 0)
+		size = atoi(tmp) * 1024;
+	tmp = getenv("EPLAYER3_PREBUFFER");
+	if (tmp)
+		prebuffer = atoi(tmp) * 1024;
+	if (size < 4 * CACHE_CHUNK)
+		size = 4 * CACHE_CHUNK;
+	if (prebuffer > size / 2)
+		prebuffer = size / 2;
+
+	/* the upstream context gets its own interrupt callback, so that Close() does not hang */
+	AVIOInterruptCB upstream_cb = { upstream_interrupt_cb, this };
+	running = true;
+	int err = avio_open2(&upstream, url, AVIO_FLAG_READ, &upstream_cb, NULL);
+	if (err < 0) {
+		char e[512];
+		av_strerror(err, e, sizeof(e));
+		fprintf(stderr, "%s: avio_open2: %d (%s)\n", __func__, err, e);
+		upstream = NULL;
+		running = false;
+		return false;
+	}
+
+	ring = (uint8_t *) malloc(size);
+	unsigned char *buffer = (unsigned char *) av_malloc(CACHE_CHUNK);
+	if (ring)
+		avio = avio_alloc_context(buffer, CACHE_CHUNK, 0, this, read_cb, NULL, seek_cb);
+	if (!avio) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		av_free(buffer);
+		running = false;
+		Close();
+		return false;
+	}
+	avio->seekable = upstream->seekable;
+	streamSize = avio_size(upstream);
+	if (streamSize < 0)
+		streamSize = -1;
+
+	start = end = pos = 0;
+	seekTo = -1;
+	generation = 0;
+	error = 0;
+	rateUs = 0;
+	rateBytes = 0;
+	throughput = 0;
+
+	int r = pthread_create(&thread, NULL, fetchthread, this);
+	if (r) {
+		fprintf(stderr, "%s %s %d: pthread_create: %d (%s)\n", __FILE__, __func__, __LINE__, r, strerror(r));
+		running = false;
+		Close();
+		return false;
+	}
+
+	int64_t t = av_gettime();
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	while (end - pos < (int64_t) prebuffer && !error && !Interrupted())
+		cond.wait(&mutex, 100);
+	fprintf(stderr, "%s: %lld bytes prebuffered in %lld ms, size %lld%s\n", __func__, (long long) (end - pos),
+		(long long) (av_gettime() - t) / 1000, (long long) streamSize, avio->seekable ? ", seekable" : "");
+	return true;
+}
+
+void Cache::Close()
+{
+	bool join;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		join = running && ring && avio;
+		running = false;
+		cond.broadcast();
+	}
+	if (join)
+		pthread_join(thread, NULL);
+
+	if (avio) {
+		av_freep(&avio->buffer);
+		av_freep(&avio);
+	}
+	if (upstream) {
+		avio_close(upstream);
+		upstream = NULL;
+	}
+	free(ring);
+	ring = NULL;
+}
+
+/* for a preloaded stream that is handed over to the player */
+void Cache::SetInterruptCallback(AVIOInterruptCB *cb)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	interrupt = *cb;
+}
+
+bool Cache::GetStatus(size_t &level, int64_t &bytesPerSecond)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	level = running ? end - pos : 0;
+	bytesPerSecond = throughput;
+	return running;
+}
+
+bool Cache::Interrupted()
+{
+	return !running || (interrupt.callback && interrupt.callback(interrupt.opaque));
+}
+
+int Cache::upstream_interrupt_cb(void *opaque)
+{
+	Cache *cache = (Cache *) opaque;
+	return !cache->running;
+}
+
+void *Cache::fetchthread(void *arg)
+{
+	char threadname[17];
+	strncpy(threadname, __func__, sizeof(threadname));
+	threadname[16] = 0;
+	prctl(PR_SET_NAME, (unsigned long) threadname);
+
+	Cache *cache = (Cache *) arg;
+	cache->Fetch();
+	return NULL;
+}
+
+void Cache::Fetch()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	while (running) {
+		if (seekTo > -1) {
+			int64_t target = seekTo;
+			unsigned int gen = generation;
+			seekTo = -1;
+			mutex.unlock();
+			int64_t r = avio_seek(upstream, target, SEEK_SET);
+			mutex.lock();
+			if (gen != generation)	/* seeked again in the meantime */
+				continue;
+			error = (r < 0) ? (int) r : 0;
+			if (error)
+				fprintf(stderr, "%s: seek to %lld failed: %d\n", __func__, (long long) target, error);
+			cond.broadcast();
+			continue;
+		}
+
+		/* a quarter of the ring keeps data that was already read */
+		int64_t ahead = end - pos;
+		int64_t space = (int64_t) (size - size / 4) - ahead;
+		if (error || space <= 0) {
+			cond.wait(&mutex);
+			continue;
+		}
+		size_t off = end % size;
+		int n = CACHE_CHUNK;
+		if ((size_t) n > size - off)
+			n = size - off;
+		if (n > space)
+			n = space;
+		/* the oldest data is overwritten, it is at least size / 4 behind pos */
+		if (end + n - start > (int64_t) size)
+			start = end + n - size;
+
+		unsigned int gen = generation;
+		mutex.unlock();
+		int64_t t = av_gettime();
+		int r = avio_read(upstream, ring + off, n);
+		t = av_gettime() - t;
+		mutex.lock();
+		if (gen != generation)	/* seeked in the meantime, the data is of no use */
+			continue;
+		if (r <= 0) {
+			error = r ? r : AVERROR_EOF;
+			if (error != AVERROR_EOF)
+				fprintf(stderr, "%s: read failed at %lld: %d\n", __func__, (long long) end, error);
+			cond.broadcast();
+			continue;
+		}
+		end += r;
+
+		/* only the time spent reading counts, not the time the ring was full */
+		rateBytes += r;
+		rateUs += t;
+		if (rateUs >= 1000000) {
+			throughput = rateBytes * 1000000 / rateUs;
+			rateBytes = 0;
+			rateUs = 0;
+		}
+		cond.broadcast();
+	}
+}
+
+int Cache::read_cb(void *opaque, uint8_t *buf, int buf_size)
+{
+	return ((Cache *) opaque)->Read(buf, buf_size);
+}
+
+int64_t Cache::seek_cb(void *opaque, int64_t offset, int whence)
+{
+	return ((Cache *) opaque)->Seek(offset, whence);
+}
+
+int Cache::Read(uint8_t *buf, int buf_size)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	while (pos >= end && !error) {
+		if (Interrupted())
+			return AVERROR_EXIT;
+		cond.wait(&mutex, 100);
+	}
+	if (pos >= end)
+		return error;
+
+	int n = 0;
+	while (n < buf_size && pos < end) {
+		size_t off = pos % size;
+		int64_t len = buf_size - n;
+		if (len > end - pos)
+			len = end - pos;
+		if (len > (int64_t) (size - off))
+			len = size - off;
+		memcpy(buf + n, ring + off, len);
+		n += len;
+		pos += len;
+	}
+	cond.broadcast();	/* there's space for the fetch thread again */
+	return n;
+}
+
+int64_t Cache::Seek(int64_t offset, int whence)
+{
+	if (whence == AVSEEK_SIZE)
+		return streamSize;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	int64_t target;
+	switch (whence & ~AVSEEK_FORCE) {
+		case SEEK_SET:
+			target = offset;
+			break;
+		case SEEK_CUR:
+			target = pos + offset;
+			break;
+		case SEEK_END:
+			if (streamSize < 0)
+				return AVERROR(ENOSYS);
+			target = streamSize + offset;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+	if (target < 0)
+		return AVERROR(EINVAL);
+
+	if (target >= start && target <= end) {
+		pos = target;
+		cond.broadcast();
+		return target;
+	}
+
+	if (!upstream->seekable)
+		return AVERROR(ESPIPE);
+
+	/* empty the ring and let the fetch thread continue at target */
+	generation++;
+	start = end = pos = target;
+	seekTo = target;
+	error = 0;
+	cond.broadcast();
+	return target;
+}
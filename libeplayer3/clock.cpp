@@ -0,0 +1,161 @@
+/*
+ * playback clock, extrapolated from occasional device PTS samples
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "clock.h"
+
+#define PTS_MASK 0x1ffffffffLL
+
+PlaybackClock::PlaybackClock()
+{
+	seq = 0;
+	pts = 0;
+	frameCount = -1;
+	time = 0;
+	rate = CLOCK_RATE_NORMAL;
+	valid = false;
+	sample = NULL;
+	opaque = NULL;
+}
+
+void PlaybackClock::Init(SampleFunc _sample, void *_opaque)
+{
+	sample = _sample;
+	opaque = _opaque;
+}
+
+int64_t PlaybackClock::Now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+/* us microseconds at rate / 1000 of normal speed, in 90 kHz units */
+int64_t PlaybackClock::Extrapolate(int64_t pts, int64_t us, int rate)
+{
+	return (pts + us * 9 * rate / 100000) & PTS_MASK;
+}
+
+/* called with mutex held */
+void PlaybackClock::Publish(int64_t _pts, int64_t _frameCount, int64_t _time, int _rate, bool _valid)
+{
+	seq++;
+	__sync_synchronize();
+	pts = _pts;
+	frameCount = _frameCount;
+	time = _time;
+	rate = _rate;
+	valid = _valid;
+	__sync_synchronize();
+	seq++;
+}
+
+bool PlaybackClock::Read(int64_t &_pts, int64_t &_frameCount, int64_t &_time, int &_rate)
+{
+	unsigned int s;
+	bool _valid;
+	do {
+		s = seq;
+		__sync_synchronize();
+		_pts = pts;
+		_frameCount = frameCount;
+		_time = time;
+		_rate = rate;
+		_valid = valid;
+		__sync_synchronize();
+	} while ((s & 1) || s != seq);
+	return _valid;
+}
+
+/* samples the device. If another thread is sampling, waits for it only if
+   there's no older sample to extrapolate from */
+void PlaybackClock::Refresh(bool wait)
+{
+	if (wait)
+		mutex.lock();
+	else if (mutex.trylock())
+		return;
+
+	int64_t now = Now();
+	if (now - time < CLOCK_SAMPLE_INTERVAL * 1000) {
+		/* someone else sampled while we waited */
+		mutex.unlock();
+		return;
+	}
+
+	int64_t _pts = 0, _frameCount = -1;
+	bool ok = sample && sample(opaque, _pts, _frameCount);
+	now = Now();
+	if (ok && valid) {
+		int64_t d = ((_pts - Extrapolate(pts, now - time, rate)) & PTS_MASK);
+		if (d > PTS_MASK / 2)
+			d -= PTS_MASK + 1;
+		if (llabs(d) > CLOCK_DISCONTINUITY)
+			fprintf(stderr, "%s: discontinuity, device is %lld ms off\n", __func__, (long long) d / 90);
+	}
+	Publish(_pts & PTS_MASK, _frameCount, now, rate, ok);
+	mutex.unlock();
+}
+
+bool PlaybackClock::Get(int64_t &_pts, int64_t &_frameCount)
+{
+	int64_t t;
+	int r;
+	bool ok = Read(_pts, _frameCount, t, r);
+	/* a failed sample is not repeated before the interval is over either */
+	if (Now() - t >= CLOCK_SAMPLE_INTERVAL * 1000) {
+		Refresh(!ok);
+		ok = Read(_pts, _frameCount, t, r);
+	}
+	if (!ok)
+		return false;
+	_pts = Extrapolate(_pts, Now() - t, r);
+	return true;
+}
+
+bool PlaybackClock::GetPts(int64_t &_pts)
+{
+	int64_t _frameCount;
+	return Get(_pts, _frameCount);
+}
+
+bool PlaybackClock::GetFrameCount(int64_t &_frameCount)
+{
+	int64_t _pts;
+	return Get(_pts, _frameCount) && _frameCount > -1;
+}
+
+/* continues from where the old rate has brought the clock */
+void PlaybackClock::SetRate(int _rate)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (_rate == rate)
+		return;
+	int64_t now = Now();
+	Publish(valid ? Extrapolate(pts, now - time, rate) : pts, frameCount, now, _rate, valid);
+}
+
+void PlaybackClock::Invalidate()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	Publish(pts, -1, 0, rate, false);
+}
@@ -0,0 +1,207 @@
+/*
+ * reading files that are still being recorded
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/inotify.h>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include "follow.h"
+
+FollowFile::FollowFile()
+{
+	fd = -1;
+	inotify = -1;
+	avio = NULL;
+	interrupt.callback = NULL;
+	interrupt.opaque = NULL;
+	openSize = size = 0;
+	grown = 0;
+	closed = false;
+}
+
+FollowFile::~FollowFile()
+{
+	Close();
+}
+
+/* fails if the file isn't growing, it's then up to the file protocol */
+bool FollowFile::Open(const char *path, AVIOInterruptCB *cb)
+{
+	Close();
+
+	const char *follow = getenv("EPLAYER3_FOLLOW");
+	if (follow && !atoi(follow))
+		return false;
+
+	struct stat st;
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || (time(NULL) - st.st_mtime) * 1000 > FOLLOW_IDLE)
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify > -1 && inotify_add_watch(inotify, path, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		close(inotify);
+		inotify = -1;
+	}
+
+	unsigned char *buffer = (unsigned char *) av_malloc(FOLLOW_CHUNK);
+	if (buffer)
+		avio = avio_alloc_context(buffer, FOLLOW_CHUNK, 0, this, read_cb, NULL, seek_cb);
+	if (!avio) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		av_free(buffer);
+		Close();
+		return false;
+	}
+	avio->seekable = AVIO_SEEKABLE_NORMAL;
+
+	interrupt = *cb;
+	openSize = size = st.st_size;
+	grown = av_gettime();
+	closed = false;
+	fprintf(stderr, "%s: following %s, %lld bytes%s\n", __func__, path, (long long) size, inotify < 0 ? ", without inotify" : "");
+	return true;
+}
+
+void FollowFile::Close()
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		openSize = size = 0;
+	}
+	if (avio) {
+		av_freep(&avio->buffer);
+		av_freep(&avio);
+	}
+	if (inotify > -1) {
+		close(inotify);
+		inotify = -1;
+	}
+	if (fd > -1) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+/* updates the size, true if the file has grown */
+bool FollowFile::Grown()
+{
+	struct stat st;
+	if (fstat(fd, &st))
+		return false;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (st.st_size <= size)
+		return false;
+	size = st.st_size;
+	grown = av_gettime();
+	return true;
+}
+
+/* at the end of the file: 0 when there's more, AVERROR_EOF when the
+   recording has ended */
+int FollowFile::Wait()
+{
+	for (;;) {
+		if (Grown())
+			return 0;
+		if (closed || av_gettime() - grown > FOLLOW_IDLE * 1000LL)
+			return AVERROR_EOF;
+		if (interrupt.callback && interrupt.callback(interrupt.opaque))
+			return AVERROR_EXIT;
+
+		if (inotify < 0) {
+			usleep(FOLLOW_POLL * 1000);
+			continue;
+		}
+		struct pollfd pfd = { inotify, POLLIN, 0 };
+		if (poll(&pfd, 1, FOLLOW_POLL) < 1)
+			continue;
+		char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t len = read(inotify, events, sizeof(events));
+		for (char *p = events; p < events + len; ) {
+			struct inotify_event *e = (struct inotify_event *) p;
+			/* a deleted timeshift file can still be read to its end */
+			if (e->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+				closed = true;
+			p += sizeof(struct inotify_event) + e->len;
+		}
+		/* the recorder may have written before closing */
+	}
+}
+
+int FollowFile::Read(uint8_t *buf, int buf_size)
+{
+	for (;;) {
+		ssize_t n = read(fd, buf, buf_size);
+		if (n > 0)
+			return n;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return AVERROR(errno);
+		}
+		int err = Wait();
+		if (err)
+			return err;
+	}
+}
+
+int64_t FollowFile::Seek(int64_t offset, int whence)
+{
+	if (whence == AVSEEK_SIZE) {
+		Grown();
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		return size;
+	}
+	off_t r = lseek(fd, offset, whence & ~AVSEEK_FORCE);
+	return r < 0 ? AVERROR(errno) : r;
+}
+
+int FollowFile::read_cb(void *opaque, uint8_t *buf, int buf_size)
+{
+	return ((FollowFile *) opaque)->Read(buf, buf_size);
+}
+
+int64_t FollowFile::seek_cb(void *opaque, int64_t offset, int whence)
+{
+	return ((FollowFile *) opaque)->Seek(offset, whence);
+}
+
+/* libavformat estimated the duration from the file at Open(), it grows
+   with the file. Called by other threads than the one reading */
+int64_t FollowFile::ScaleDuration(int64_t duration)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (duration <= 0 || openSize <= 0 || size <= openSize)
+		return duration;
+	return av_rescale(duration, size, openSize);
+}
@@ -0,0 +1,100 @@
+/*
+ * bandwidth based variant selection for adaptive http streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __ADAPTIVE_H__
+#define __ADAPTIVE_H__
+
+#include <stdint.h>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "manager.h"
+
+/* half-lives of the two throughput averages, in us */
+#define ADAPTIVE_FAST		2000000
+#define ADAPTIVE_SLOW		10000000
+
+/* a sample covers at least this much read time */
+#define ADAPTIVE_SAMPLE		250000
+
+/* no decision before this much read time was measured */
+#define ADAPTIVE_WARMUP		2000000
+
+/* the share of the estimate that a variant may use. Switching up needs
+   more headroom than staying, so the choice doesn't flip back and forth */
+#define ADAPTIVE_UP		70	/* percent */
+#define ADAPTIVE_DOWN		90	/* percent */
+
+/* minimum time since the last switch, in us */
+#define ADAPTIVE_UP_HOLD	10000000
+#define ADAPTIVE_DOWN_HOLD	2000000
+
+/* a switch that hasn't found a keyframe of the new variant after this long is abandoned */
+#define ADAPTIVE_PENDING	10000000
+
+/* Estimates the throughput from the bytes that av_read_frame() returns and
+   the time it blocks, which is the time libavformat spends downloading
+   (for HLS, the segments of the enabled variants). The slower of a fast and
+   a slow moving average counts, so a drop is seen quickly and a short burst
+   doesn't cause a switch up.
+
+   Select() picks the variant (a program with a variant_bitrate, as the hls
+   demuxer sets up) that fits the estimate. The play thread then enables the
+   streams of that variant, so libavformat starts fetching it at the next
+   segment, and switches over at its first keyframe */
+class VariantSelector
+{
+	private:
+		struct Variant
+		{
+			int id;
+			int64_t bitrate;
+			std::vector<AVStream *> streams;
+		};
+		std::vector<Variant> variants;	/* sorted by bitrate */
+		int pending;			/* id of the variant being switched to, -1 if none */
+		int64_t pendingTime;
+		int64_t switchTime;
+		volatile bool fixed;		/* a program was selected explicitly */
+
+		int64_t sampleBytes;
+		int64_t sampleUs;
+		int64_t totalUs;
+		double fast, slow;		/* bits per second */
+
+		Variant *find(int id);
+		static bool by_bitrate(const Variant &a, const Variant &b);
+	public:
+		VariantSelector();
+		bool Init(std::vector<Program> &programs);
+		void Clear() { variants.clear(); pending = -1; }
+		void Fix() { fixed = true; }
+		bool Active() { return !fixed && variants.size() > 1; }
+		void Sample(int bytes, int64_t us);
+		int64_t Estimate();
+		int Select(AVStream *current, int64_t now);
+		int Lowest() { return variants.empty() ? -1 : variants.front().id; }
+		int Pending(AVStream *stream);
+		void Switched(int64_t now);
+		void Abandon();
+};
+
+#endif
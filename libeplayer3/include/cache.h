@@ -0,0 +1,89 @@
+/*
+ * read-ahead cache for network streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Condition>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+}
+
+/* defaults, can be changed with EPLAYER3_CACHE_SIZE and EPLAYER3_PREBUFFER (in kB) */
+#define CACHE_SIZE	(8 * 1024 * 1024)
+#define CACHE_PREBUFFER	(512 * 1024)
+#define CACHE_CHUNK	(32 * 1024)
+
+/* A fetch thread reads the stream into a ring buffer, libavformat reads
+   from the ring through a custom AVIOContext, so a slow network does not
+   stall av_read_frame() until the buffer runs empty. A quarter of the ring
+   keeps data that was already read, seeks within the ring are instant.
+   Seeks outside of it are passed upstream, which for http means a range
+   request */
+class Cache
+{
+	private:
+		OpenThreads::Mutex mutex;
+		OpenThreads::Condition cond;	/* broadcast on every change */
+		AVIOContext *upstream;
+		AVIOContext *avio;
+		AVIOInterruptCB interrupt;
+		uint8_t *ring;
+		size_t size;
+		size_t prebuffer;
+		int64_t start;		/* stream position of the oldest byte in the ring */
+		int64_t end;		/* stream position after the newest byte */
+		int64_t pos;		/* read position of libavformat */
+		int64_t seekTo;		/* for the fetch thread, -1 if none */
+		int64_t streamSize;	/* -1 if unknown */
+		unsigned int generation;	/* incremented when the ring is emptied */
+		int error;		/* last upstream error, AVERROR_EOF at the end */
+		bool running;
+		pthread_t thread;
+
+		int64_t rateUs;		/* time spent in avio_read() */
+		uint64_t rateBytes;
+		int64_t throughput;	/* bytes per second */
+
+		static void *fetchthread(void *arg);
+		void Fetch();
+		bool Interrupted();
+		static int upstream_interrupt_cb(void *opaque);
+		static int read_cb(void *opaque, uint8_t *buf, int buf_size);
+		static int64_t seek_cb(void *opaque, int64_t offset, int whence);
+		int Read(uint8_t *buf, int buf_size);
+		int64_t Seek(int64_t offset, int whence);
+	public:
+		Cache();
+		~Cache();
+		bool Open(const char *url, AVIOInterruptCB *cb);
+		void Close();
+		AVIOContext *GetAVIOContext() { return avio; }
+		void SetInterruptCallback(AVIOInterruptCB *cb);
+		bool GetStatus(size_t &level, int64_t &bytesPerSecond);
+};
+
+#endif
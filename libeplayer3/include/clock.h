@@ -0,0 +1,68 @@
+/*
+ * playback clock, extrapolated from occasional device PTS samples
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Mutex>
+
+#define CLOCK_SAMPLE_INTERVAL	500	/* ms between two samples of the device */
+#define CLOCK_DISCONTINUITY	90000	/* a sample that is off by more than 1 s is logged */
+#define CLOCK_RATE_NORMAL	1000
+
+/* Position polling (progress bars, subtitles, relative seeks) used to cost
+   an ioctl each time. The clock asks the device at most every
+   CLOCK_SAMPLE_INTERVAL ms and extrapolates in between, with the current
+   playback rate. Readers don't lock: the sample is guarded by a sequence
+   counter, which is odd while a writer updates it. Writers (sampling,
+   rate changes, invalidation) are serialized by the mutex. */
+class PlaybackClock
+{
+	public:
+		/* pts is required, frameCount is -1 if not available */
+		typedef bool (*SampleFunc)(void *opaque, int64_t &pts, int64_t &frameCount);
+	private:
+		volatile unsigned int seq;
+		int64_t pts;
+		int64_t frameCount;
+		int64_t time;		/* CLOCK_MONOTONIC, us */
+		int rate;		/* 1/1000 of normal speed, 0 while paused */
+		bool valid;
+
+		OpenThreads::Mutex mutex;
+		SampleFunc sample;
+		void *opaque;
+
+		static int64_t Now();
+		static int64_t Extrapolate(int64_t pts, int64_t us, int rate);
+		void Publish(int64_t _pts, int64_t _frameCount, int64_t _time, int _rate, bool _valid);
+		bool Read(int64_t &_pts, int64_t &_frameCount, int64_t &_time, int &_rate);
+		bool Get(int64_t &_pts, int64_t &_frameCount);
+		void Refresh(bool wait);
+	public:
+		PlaybackClock();
+		void Init(SampleFunc _sample, void *_opaque);
+		void SetRate(int _rate);
+		void Invalidate();		/* after a seek or a clear, the next read samples the device */
+		bool GetPts(int64_t &_pts);
+		bool GetFrameCount(int64_t &_frameCount);
+};
+#endif
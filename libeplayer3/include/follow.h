@@ -0,0 +1,75 @@
+/*
+ * reading files that are still being recorded
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __FOLLOW_H__
+#define __FOLLOW_H__
+
+#include <stdint.h>
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Mutex>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+}
+
+/* a file that was modified within this time (ms) is taken as a recording
+   in progress, and one that hasn't grown for this long as finished */
+#define FOLLOW_IDLE	10000
+
+/* at the end of the file, the size is checked at least this often (ms) */
+#define FOLLOW_POLL	100
+
+#define FOLLOW_CHUNK	(32 * 1024)
+
+/* ffmpeg's file protocol returns EOF at the current end of a file that is
+   still being written, e.g. a timeshift recording. This AVIOContext waits
+   there instead, woken by inotify when the recorder writes, until the
+   recorder closes the file or it stops growing. EPLAYER3_FOLLOW=0 leaves
+   growing files to the file protocol */
+class FollowFile
+{
+	private:
+		OpenThreads::Mutex mutex;	/* size, for GetSize() */
+		int fd;
+		int inotify;		/* -1 if unavailable, then the size is polled */
+		AVIOContext *avio;
+		AVIOInterruptCB interrupt;
+		int64_t openSize;	/* at Open() */
+		int64_t size;
+		int64_t grown;		/* av_gettime() of the last growth */
+		bool closed;		/* the recorder has closed the file */
+
+		static int read_cb(void *opaque, uint8_t *buf, int buf_size);
+		static int64_t seek_cb(void *opaque, int64_t offset, int whence);
+		int Read(uint8_t *buf, int buf_size);
+		int64_t Seek(int64_t offset, int whence);
+		int Wait();
+		bool Grown();
+	public:
+		FollowFile();
+		~FollowFile();
+		bool Open(const char *path, AVIOInterruptCB *cb);
+		void Close();
+		AVIOContext *GetAVIOContext() { return avio; }
+		bool IsOpen() { return avio != NULL; }
+		int64_t ScaleDuration(int64_t duration);
+};
+
+#endif
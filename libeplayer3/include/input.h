@@ -38,6 +38,13 @@ extern "C" {
 #include <libavutil/opt.h>
 }
 
+#include "cache.h"
+#include "keyindex.h"
+#include "adaptive.h"
+#include "subtitle.h"
+#include "follow.h"
+#include "mapped.h"
+
 class Player;
 class Track;
 
@@ -45,15 +52,18 @@ class Input
 {
 	friend class Player;
 	friend class WriterPCM; // needs calcPts()
+	friend class Output; // calcPts() for telemetry
 	friend int interrupt_cb(void *arg);
 
 	private:
 		OpenThreads::Mutex mutex;
 
-		Track *videoTrack;
-		Track *audioTrack;
-		Track *subtitleTrack;
-		Track *teletextTrack;
+		const Track *videoTrack;
+		const Track *audioTrack;
+		const Track *subtitleTrack;
+		const Track *teletextTrack;
+		uint64_t trackSignature;	/* of the streams the tracks were made from */
+		uint64_t StreamSignature();
 
 		int hasPlayThreadStarted;
 		int64_t seek_avts_abs;
@@ -63,7 +73,33 @@ class Input
 
 		Player *player;
 		AVFormatContext *avfc;
+		Cache caches[2];	/* for http streams, the current and the next item */
+		Cache *cache;
+		FollowFile follow;	/* for recordings in progress */
+		MappedFile mapped;	/* for other local files */
+		int zeroCopy;		/* queue the demuxer's packets (1) or pooled copies (0), -1: copies while the heap is fragmented */
+		KeyframeIndex keyIndex;	/* for transport streams */
+		VariantSelector variants;	/* for HLS */
+		SubtitleWorker subtitles;
+
+		/* the next item, opened and probed in the background by Preload() */
+		struct NextItem {
+			std::string url;
+			Cache *cache;
+			AVFormatContext *avfc;	/* NULL until the thread is done or if it failed */
+			bool http;
+			bool noprobe;
+			bool abort;
+			bool running;
+			int64_t start;
+			pthread_t thread;
+		} next;
+		static void *preloadthread(void *arg);
+		static AVFormatContext *OpenFormat(const char *filename, Cache *c, AVIOInterruptCB *cb, bool http, bool noprobe, FollowFile *f = NULL, MappedFile *m = NULL);
+		void JoinPreload();
+		void DropPreload();
 		uint64_t readCount;
+		int64_t openTime;	/* for latency logging */
 		int64_t calcPts(AVStream * stream, int64_t pts);
 
 	public:
@@ -73,15 +109,16 @@ class Input
 		bool ReadSubtitle(const char *filename, const char *format, int pid);
 		bool ReadSubtitles(const char *filename);
 		bool Init(const char *filename);
+		bool Preload(const char *filename, bool http, bool noprobe);
 		bool UpdateTracks();
 		bool Play();
 		bool Stop();
 		bool Seek(int64_t sec, bool absolute);
 		bool GetDuration(int64_t &duration);
-		bool SwitchAudio(Track *track);
-		bool SwitchSubtitle(Track *track);
-		bool SwitchTeletext(Track *track);
-		bool SwitchVideo(Track *track);
+		bool SwitchAudio(const Track *track, bool seamless = false);
+		bool SwitchSubtitle(const Track *track);
+		bool SwitchTeletext(const Track *track);
+		bool SwitchVideo(const Track *track, bool seamless = false);
 		bool GetMetadata(std::vector<std::string> &keys, std::vector<std::string> &values);
 		bool GetReadCount(uint64_t &readcount);
 		AVFormatContext *GetAVFormatContext();
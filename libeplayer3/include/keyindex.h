@@ -0,0 +1,88 @@
+/*
+ * persistent keyframe index for seeking in transport streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __KEYINDEX_H__
+#define __KEYINDEX_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+}
+
+/* neighbouring entries that are at most this far apart (90 kHz) are
+   taken as consecutive keyframes, wider gaps are interpolated */
+#define KEYINDEX_GAP		(5 * 90000)
+
+/* default background scan rate, can be changed with EPLAYER3_INDEX_SCAN (in kB/s), 0 disables the scan */
+#define KEYINDEX_SCAN_RATE	(8 * 1024 * 1024)
+
+struct Keyframe
+{
+	int64_t pts;	/* 90 kHz, relative to the start of the file, as Input::calcPts() */
+	int64_t pos;	/* byte position of the packet */
+};
+
+/* The positions of the video keyframes of a file or URL, sorted by position.
+   Entries are added by the play thread for every keyframe it reads and, for
+   local files, by a scan thread that demuxes the file at idle priority.
+   The index is stored next to the probe cache on Close() and restored by
+   Open(), with the same key (see ProbeCache), and a scan continues where
+   the last one stopped */
+class KeyframeIndex
+{
+	private:
+		OpenThreads::Mutex mutex;
+		std::vector<Keyframe> entries;
+		std::string url;
+		std::string key;
+		int id;			/* of the video stream */
+		int64_t start;		/* AVFormatContext.start_time of the play thread */
+		int64_t bitrate;	/* for extrapolation, bits per second */
+		int rate;		/* of the scan, bytes per second */
+		int64_t scanned;	/* the scan has read everything before this position */
+		bool complete;		/* the scan has reached the end of the file */
+		bool running;
+		bool scanning;
+		pthread_t thread;
+
+		bool Restore();
+		bool Store();
+		static void *scanthread(void *arg);
+		void Scan();
+		static int interrupt_cb(void *opaque);
+	public:
+		KeyframeIndex();
+		~KeyframeIndex();
+		bool Open(const char *url, int id, int64_t start, int64_t bitrate);
+		void Close();
+		int GetStreamId() { return id; }
+		size_t Size();
+		void Add(int64_t pts, int64_t pos);
+		int64_t Seek(int64_t pts);
+		bool Next(int64_t pts, int dir, Keyframe &k);
+};
+
+#endif
@@ -58,6 +58,21 @@ struct Program
 	int id;
 	std::string title;
 	std::vector<AVStream *> streams;
+	int64_t bitrate;	/* of a HLS variant, 0 if unknown */
+};
+
+enum { TRACK_VIDEO, TRACK_AUDIO, TRACK_SUBTITLE, TRACK_TELETEXT, TRACK_TYPES };
+
+/* The tracks and programs as published by the manager. A snapshot is never
+   changed once published, readers don't lock and may keep pointers into
+   it until the next clearTracks() but one */
+struct TrackSnapshot
+{
+	unsigned int generation;
+	std::map<int,Track> tracks[TRACK_TYPES];	/* by pid, including inactive and hidden ones */
+	std::vector<Track> visible[TRACK_TYPES];	/* neither inactive nor hidden */
+	std::map<int,Program> programs;
+	TrackSnapshot() : generation(0) {}
 };
 
 class Manager
@@ -66,32 +81,40 @@ class Manager
 
 	private:
 		Player *player;
-		OpenThreads::Mutex mutex;
-		std::map<int,Track*> videoTracks, audioTracks, subtitleTracks, teletextTracks;
-		std::map<int,Program> Programs;
-		void addTrack(std::map<int,Track*> &tracks, Track &track);
-		Track *getTrack(std::map<int,Track*> &tracks, int pid);
-		std::vector<Track> getTracks(std::map<int,Track*> &tracks);
+		OpenThreads::Mutex mutex;	/* serializes the writers */
+		TrackSnapshot work;		/* changed by the writers, then published */
+		TrackSnapshot *current;		/* published */
+		std::vector<TrackSnapshot *> retired;	/* replaced since the last clearTracks() */
+		std::vector<TrackSnapshot *> expired;	/* replaced before it, freed by the next one */
+		bool updating;			/* between initTrackUpdate() and commitTrackUpdate() */
+		void publish();
+		void addTrack(int type, Track &track);
+		const Track *getTrack(int type, int pid);
+		const std::vector<Track> &getTracks(int type);
 	public:
+		Manager();
+		const TrackSnapshot *getSnapshot() { return __atomic_load_n(&current, __ATOMIC_ACQUIRE); }
+
 		void addVideoTrack(Track &track);
 		void addAudioTrack(Track &track);
 		void addSubtitleTrack(Track &track);
 		void addTeletextTrack(Track &track);
 		void addProgram(Program &program);
 
-		std::vector<Track> getVideoTracks();
-		std::vector<Track> getAudioTracks();
-		std::vector<Track> getSubtitleTracks();
-		std::vector<Track> getTeletextTracks();
+		const std::vector<Track> &getVideoTracks();
+		const std::vector<Track> &getAudioTracks();
+		const std::vector<Track> &getSubtitleTracks();
+		const std::vector<Track> &getTeletextTracks();
 		std::vector<Program> getPrograms();
-		bool selectProgram(const int id);
+		bool selectProgram(const int id, bool seamless = false);
 
-		Track *getVideoTrack(int pid);
-		Track *getAudioTrack(int pid);
-		Track *getSubtitleTrack(int pid);
-		Track *getTeletextTrack(int pid);
+		const Track *getVideoTrack(int pid);
+		const Track *getAudioTrack(int pid);
+		const Track *getSubtitleTrack(int pid);
+		const Track *getTeletextTrack(int pid);
 
 		bool initTrackUpdate();
+		void commitTrackUpdate();
 		void clearTracks();
 
 		~Manager();
@@ -0,0 +1,71 @@
+/*
+ * memory mapped reading of local files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __MAPPED_H__
+#define __MAPPED_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+}
+
+/* the part of the file that is mapped at a time */
+#define MAPPED_WINDOW	(8 * 1024 * 1024)
+
+/* reads larger than this go straight from the mapping to the packet,
+   past the AVIOContext buffer */
+#define MAPPED_CHUNK	(4 * 1024)
+
+/* Serves libavformat's reads of a local file from a window of it that is
+   mapped into memory, instead of read() calls through the file protocol.
+   The kernel is told that the window is read sequentially, and to read
+   the next window ahead. Files on network file systems and files that are
+   still being written (see FollowFile) are left to the file protocol.
+   A read error in the mapping (SIGBUS) fails the read with EIO.
+   EPLAYER3_MMAP=0 disables it */
+class MappedFile
+{
+	private:
+		int fd;
+		int64_t size;
+		uint8_t *map;
+		int64_t mapStart;	/* file position of map */
+		size_t mapLength;
+		int64_t pos;
+		bool readAhead;		/* the next window has been requested */
+		AVIOContext *avio;
+
+		bool Map(int64_t at);
+		void Unmap();
+		static int read_cb(void *opaque, uint8_t *buf, int buf_size);
+		static int64_t seek_cb(void *opaque, int64_t offset, int whence);
+		int Read(uint8_t *buf, int buf_size);
+		int64_t Seek(int64_t offset, int whence);
+	public:
+		MappedFile();
+		~MappedFile();
+		bool Open(const char *path);
+		void Close();
+		AVIOContext *GetAVIOContext() { return avio; }
+		bool IsOpen() { return avio != NULL; }
+};
+
+#endif
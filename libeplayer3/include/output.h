@@ -25,6 +25,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <pthread.h>
 
 #include <OpenThreads/ScopedLock>
 #include <OpenThreads/Thread>
@@ -39,9 +41,42 @@ extern "C" {
 }
 
 #include "writer.h"
+#include "clock.h"
+#include "telemetry.h"
 
 class Player;
 
+/* the demux thread blocks if a queue holds more than QUEUE_MAX_TIME ms,
+   or more than QUEUE_MAX_BYTES if the timestamps are of no use */
+#define QUEUE_MAX_TIME	2000
+#define QUEUE_MAX_BYTES	(8 * 1024 * 1024)
+
+struct QueueEntry
+{
+	AVStream *stream;
+	AVPacket packet;
+	int64_t pts;
+	int64_t time;		/* ms, AV_NOPTS_VALUE if unknown */
+	bool reset;		/* no data, passes a NULL packet to the writer */
+};
+
+/* packets on their way from the demux thread to a device writer thread */
+struct OutputQueue
+{
+	OpenThreads::Mutex mutex;
+	OpenThreads::Condition cond;	/* broadcast on every change */
+	std::deque<QueueEntry> entries;
+	size_t bytes;
+	unsigned int generation;	/* incremented on clear, older packets are not written */
+	bool running;
+	bool joinable;			/* stopped, but the thread has not been joined yet */
+	bool busy;			/* the writer thread is writing a packet */
+	bool draining;			/* running empty is expected */
+	StreamTelemetry stats;
+	pthread_t thread;
+	int64_t Duration();
+};
+
 class Output
 {
 	friend class Player;
@@ -50,9 +85,31 @@ class Output
 		int videofd;
 		int audiofd;
 		Writer *videoWriter, *audioWriter;
+		/* audioMutex/videoMutex guard the device state and are never held
+		   across a write, a write to a frozen or full decoder may block until
+		   Continue() or a clear. The write mutexes are held by the writer
+		   threads while writing and by whoever changes the writers */
 		OpenThreads::Mutex audioMutex, videoMutex;
+		OpenThreads::Mutex audioWriteMutex, videoWriteMutex;
 		AVStream *audioStream, *videoStream;
+		/* what the writers are set up for. After a seamless switch, this is
+		   the old stream until the first packet of the new one is written */
+		AVStream *audioWriterStream, *videoWriterStream;
 		Player *player;
+
+		OutputQueue videoQueue, audioQueue;
+		static void *videoThread(void *arg);
+		static void *audioThread(void *arg);
+		void WriterThread(OutputQueue &q, bool video);
+		void StartQueue(OutputQueue &q, bool video);
+		void StopQueue(OutputQueue &q);
+		void JoinQueue(OutputQueue &q);
+		void ClearQueue(OutputQueue &q);
+		void DrainQueue(OutputQueue &q);
+		bool Enqueue(OutputQueue &q, OutputQueue &other, AVStream *stream, AVPacket *packet, int64_t pts);
+
+		PlaybackClock clock;
+		static bool sample_cb(void *opaque, int64_t &pts, int64_t &frameCount);
 	public:
 		Output();
 		~Output();
@@ -72,9 +129,12 @@ class Output
 		bool ClearVideo();
 		bool GetPts(int64_t &pts);
 		bool GetFrameCount(int64_t &framecount);
-		bool SwitchAudio(AVStream *stream);
-		bool SwitchVideo(AVStream *stream);
+		bool SwitchAudio(AVStream *stream, bool seamless = false);
+		bool SwitchVideo(AVStream *stream, bool seamless = false);
 		bool Write(AVStream *stream, AVPacket *packet, int64_t Pts);
+		bool GetQueueFill(int64_t &videoMs, size_t &videoBytes, int64_t &audioMs, size_t &audioBytes);
+		void Dropped(AVStream *stream);
+		void GetTelemetry(PlaybackTelemetry &t);
 };
 
 #endif
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "misc.h"
+
 #define PES_MAX_HEADER_SIZE			64
 #define PES_PRIVATE_DATA_FLAG			0x80
 #define PES_PRIVATE_DATA_LENGTH			8
@@ -28,7 +30,57 @@
 #define VC1_VIDEO_PES_START_CODE		0xfd
 #define AAC_AUDIO_PES_START_CODE		0xcf
 
-int InsertPesHeader(uint8_t *data, int size, uint8_t stream_id, int64_t pts, int pic_start_code);
+/* The PES header comes in four shapes only: with or without PTS, with or
+   without the fake picture start code. Each shape is a template instance
+   that stores its bytes directly. Returns the header length. */
+template <bool with_pts, bool with_start_code>
+inline int PesHeader(uint8_t *data, int size, uint8_t stream_id, int64_t pts, int pic_start_code)
+{
+	int len = size + 3 + (with_pts ? 5 : 0) + (with_start_code ? 5 : 0);
+	if (size > MAX_PES_PACKET_SIZE || len > 0xffff)
+		len = 0;		// unbounded
+
+	data[0] = 0x00;
+	data[1] = 0x00;
+	data[2] = 0x01;		// Start Code
+	data[3] = stream_id;
+	data[4] = len >> 8;	// PES_packet_length
+	data[5] = len;
+	data[6] = 0x80;		// 10, not scrambled, no priority/alignment/copyright/original
+	data[7] = with_pts ? 0x80 : 0x00;	// PTS_DTS flag, no ESCR/ES_rate/trick mode/copy info/CRC/extension
+	data[8] = with_pts ? 5 : 0;	// PES_header_data_length
+	uint8_t *d = data + 9;
+
+	if (with_pts) {
+		d[0] = 0x20 | ((pts >> 29) & 0x0e) | 1;
+		d[1] = pts >> 22;
+		d[2] = ((pts >> 14) & 0xfe) | 1;
+		d[3] = pts >> 7;
+		d[4] = ((pts << 1) & 0xfe) | 1;
+		d += 5;
+	}
+
+	if (with_start_code) {
+		d[0] = 0x00;
+		d[1] = 0x00;
+		d[2] = 0x01;	// Start Code
+		d[3] = pic_start_code & 0xff;		// 00, for picture start
+		d[4] = (pic_start_code >> 8) & 0xff;	// For any extra information (like in mpeg4p2, the pic_start_code)
+		d += 5;
+	}
+
+	return d - data;
+}
+
+inline int InsertPesHeader(uint8_t *data, int size, uint8_t stream_id, int64_t pts, int pic_start_code)
+{
+	if (pts != INVALID_PTS_VALUE)
+		return pic_start_code ? PesHeader<true, true>(data, size, stream_id, pts, pic_start_code)
+				      : PesHeader<true, false>(data, size, stream_id, pts, 0);
+	return pic_start_code ? PesHeader<false, true>(data, size, stream_id, pts, pic_start_code)
+			      : PesHeader<false, false>(data, size, stream_id, pts, 0);
+}
+
 int InsertVideoPrivateDataHeader(uint8_t *data, int payload_size);
 
 #endif
@@ -67,6 +67,16 @@ class Player {
 		std::vector<Chapter> chapters;
 		pthread_t playThread;
 
+		/* the play thread sleeps on stateCond while paused and every state
+		   change wakes it up, so there is no polling in pause or on stop */
+		OpenThreads::Mutex stateMutex;
+		OpenThreads::Condition stateCond;
+		int64_t stateTime;	/* av_gettime() of the last change, for latency logging */
+		void StateChanged();
+		void WaitWhilePaused();
+		void WaitForStateChange(int64_t timeout);
+		bool debug;		/* EPLAYER3_DEBUG=1, e.g. for the wakeup latencies */
+
 		bool abortRequested;
 		bool isHttp;
 		bool isPaused;
@@ -74,6 +84,7 @@ class Player {
 		bool hasThreadStarted;
 		bool isForwarding;
 		bool isBackWard;
+		bool isStepping;	/* fast forward by keyframe jumps instead of VIDEO_FAST_FORWARD */
 		bool isPlaying;
 
 		int Speed;
@@ -99,6 +110,10 @@ class Player {
 		bool GetPts(int64_t &pts);
 		bool GetFrameCount(int64_t &framecount);
 		bool GetDuration(int64_t &duration);
+		bool GetQueueFill(int64_t &videoMs, size_t &videoBytes, int64_t &audioMs, size_t &audioBytes);
+		bool GetCacheStatus(size_t &level, int64_t &bytesPerSecond);
+		bool GetTelemetry(PlaybackTelemetry &t);
+		void GetPoolStats(unsigned long &requests, unsigned long &allocated, size_t &allocatedBytes, unsigned long &oversized);
 
 		bool GetMetadata(std::vector<std::string> &keys, std::vector<std::string> &values);
 		bool SlowMotion(int repeats);
@@ -106,6 +121,7 @@ class Player {
 		bool FastForward(int speed);
 
 		bool Open(const char *Url, bool noprobe = false);
+		bool Preload(const char *Url, bool noprobe = false);
 		bool Close();
 		bool Play();
 		bool Pause();
@@ -121,6 +137,7 @@ class Player {
 		bool GetPrograms(std::vector<std::string> &keys, std::vector<std::string> &values);
 		bool SelectProgram(int key);
 		bool SelectProgram(std::string &key);
+		bool IsAdaptive();
 
 		Player();
 };
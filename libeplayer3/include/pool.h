@@ -0,0 +1,74 @@
+/*
+ * pooled buffers for queued packets and resampled audio
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavcodec/avcodec.h>
+}
+
+/* size classes from 1 kB to 2 MB in steps of 1 and 1.5 times a power of two */
+#define POOL_MIN_SIZE	1024
+#define POOL_CLASSES	23
+
+/* the heap counts as fragmented if the free memory malloc can't give back
+   exceeds this part of it (and POOL_FRAGMENTED_MIN), until it drops below
+   half of that again. Checked at most every POOL_CHECK_INTERVAL us */
+#define POOL_FRAGMENTED		4	/* a quarter */
+#define POOL_FRAGMENTED_MIN	(2 * 1024 * 1024)
+#define POOL_CHECK_INTERVAL	1000000
+
+/* Buffers of a few size classes, handed out as AVBufferRef and returned
+   to their class by av_buffer_unref(). Queued packets and the resampler
+   output live much longer than the packets of the demuxer. Keeping them
+   in fixed sizes that are reused stops them from fragmenting the heap.
+   There's one pool for the whole process, the writers are singletons, too. */
+class BufferPool
+{
+	private:
+		AVBufferPool *pools[POOL_CLASSES];
+		unsigned long requests;		/* buffers handed out */
+		unsigned long allocated;	/* buffers that had to be allocated */
+		unsigned long oversized;	/* requests larger than the largest class */
+		size_t allocatedBytes;
+		bool fragmented;		/* as of the last check */
+		int64_t checkTime;		/* of the next check */
+
+		static BufferPool pool;
+		static size_t ClassSize(int i) { return (size_t) ((i & 1) ? 3 * POOL_MIN_SIZE / 2 : POOL_MIN_SIZE) << (i / 2); }
+		static AVBufferRef *alloc(int size);
+		BufferPool();
+		~BufferPool();
+	public:
+		/* at least size bytes, followed by FF_INPUT_BUFFER_PADDING_SIZE zeroed bytes */
+		static AVBufferRef *Get(int size);
+		/* moves the packet into a pooled buffer, src is empty afterwards.
+		   With reference, a refcounted packet keeps its buffer instead */
+		static bool MovePacket(AVPacket *dst, AVPacket *src, bool reference = false);
+		/* whether the packets of the demuxer should be copied to the pool
+		   instead of referenced, because the heap is fragmented. For the
+		   play thread only */
+		static bool Fragmented();
+		static void GetStats(unsigned long &requests, unsigned long &allocated, size_t &allocatedBytes, unsigned long &oversized);
+};
+#endif
@@ -0,0 +1,56 @@
+/*
+ * persistent cache of avformat_find_stream_info() results
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __PROBECACHE_H__
+#define __PROBECACHE_H__
+
+#include <stdint.h>
+#include <string>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+}
+
+/* default location, can be changed with EPLAYER3_PROBE_CACHE, empty disables the cache */
+#define PROBECACHE_DIR	"/var/cache/eplayer3"
+
+/* the least recently used files are deleted above these limits */
+#define PROBECACHE_MAX_FILES	256
+#define PROBECACHE_MAX_BYTES	(8 * 1024 * 1024)
+
+/* Stores the stream layout, codec parameters and extradata that
+   avformat_find_stream_info() has found, and restores them when the same
+   file (path, size, mtime and a hash of the first block) or the same URL
+   is opened again. The restored values are only used if the streams that
+   avformat_open_input() has set up match the stored ones. The start time
+   and duration are only restored for files */
+class ProbeCache
+{
+	friend class KeyframeIndex;	/* uses the same keys and directory */
+	private:
+		static std::string Key(const char *url);
+		static std::string FileName(const std::string &key);
+		static void Touch(const std::string &name);
+		static void Prune();
+	public:
+		static bool Restore(AVFormatContext *avfc, const char *url);
+		static bool Store(AVFormatContext *avfc, const char *url);
+};
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * subtitle and teletext decoding and delivery
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __SUBTITLE_H__
+#define __SUBTITLE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Condition>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+}
+
+/* bitmap and ASS cues are handed over this long (90 kHz) before they are
+   due, their handlers display them by their own timing. Teletext has no
+   timing of its own and goes out when it's due */
+#define SUBTITLE_LEAD		(90000 / 2)
+
+/* the clock is polled at least this often (ms) */
+#define SUBTITLE_POLL		100
+
+/* a clock that moves further than this (90 kHz) between two polls was
+   seeked, the position in the external files is looked up again */
+#define SUBTITLE_JUMP		(5 * 90000)
+
+/* packets read from an external file before the cues are checked again */
+#define SUBTITLE_CHUNK		256
+
+/* packets waiting to be decoded, the oldest is dropped beyond this */
+#define SUBTITLE_MAX_PACKETS	256
+
+class Player;
+
+/* Decodes the packets of the current subtitle and teletext tracks in a
+   thread of its own, so bitmap subtitles don't hold up the demuxer, and
+   keeps the results in a store ordered by PTS. They are handed to the
+   dvbsub and tuxtxt handlers by the playback clock.
+
+   External .srt/.ass/.ssa files are opened by the thread, too, and read a
+   chunk at a time into a time index. Only the entries around the playback
+   position are decoded, found by binary search after a seek */
+class SubtitleWorker
+{
+	private:
+		enum { CUE_BITMAP, CUE_ASS, CUE_TELETEXT };
+		struct Packet
+		{
+			AVStream *stream;	/* NULL for teletext */
+			int pid;
+			int64_t pts;		/* 90 kHz, as Input::calcPts() */
+			AVPacket packet;
+		};
+		struct Cue
+		{
+			int type;
+			int pid;
+			int64_t pts;
+			AVCodecContext *codec;
+			AVSubtitle sub;
+			AVPacket packet;	/* teletext */
+		};
+		struct Entry
+		{
+			int64_t pts;
+			AVPacket packet;
+		};
+		struct File
+		{
+			std::string name;
+			std::string format;
+			int pid;
+			AVFormatContext *avfc;	/* NULL until opened */
+			bool failed;
+			bool complete;		/* read to the end */
+			std::vector<Entry> index;	/* sorted by pts */
+			size_t next;		/* the next entry to deliver */
+			int64_t maxDuration;	/* of an entry, a seek goes back this far */
+			bool rewind;		/* look up next again */
+		};
+
+		Player *player;
+		OpenThreads::Mutex mutex;	/* packets, cues, running */
+		OpenThreads::Condition cond;
+		OpenThreads::Mutex workMutex;	/* held by the thread while it works, Flush() waits for it */
+		std::deque<Packet> packets;
+		std::multimap<int64_t, Cue> cues;	/* by the time they are handed over */
+		std::vector<File *> files;
+		std::vector<AVCodecContext *> codecs;	/* that decoded something, flushed on seek */
+		int64_t lastClock;
+		bool running;
+		pthread_t thread;
+
+		static void *subtitlethread(void *arg);
+		void Run();
+		bool Decode();
+		bool ReadFiles();
+		bool OpenFile(File *f);
+		int64_t Deliver();
+		void Send(Cue &c);
+		static void FreeCue(Cue &c);
+		static bool by_pts(const Entry &a, const Entry &b);
+	public:
+		SubtitleWorker();
+		~SubtitleWorker();
+		bool Start(Player *_player);
+		void Stop();
+		void AddFile(const char *name, const char *format, int pid);
+		/* takes the data of packet, stream is NULL for teletext */
+		void Push(AVStream *stream, AVPacket *packet, int64_t pts, int pid);
+		void Flush();
+};
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * playback health counters
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* write latency histogram: < 1, 2, 5, 10, 20, 50, 100, 200 ms and the rest */
+#define TELEMETRY_LATENCY_BUCKETS 9
+
+/* Counters are per playback, they start at 0 with Player::Play().
+   PTS values are in 90 kHz units, INVALID_PTS_VALUE if unknown. */
+struct StreamTelemetry
+{
+	uint64_t packets;		/* written to the device */
+	uint64_t bytes;
+	uint64_t dropped;		/* never queued: video before the first audio packet, or queueing failed */
+	uint64_t cleared;		/* queued, but discarded by a seek or a track change */
+	uint64_t writeErrors;
+	uint64_t underruns;		/* the queue ran empty while playing */
+	uint64_t overruns;		/* the queue was full, the demux thread had to wait */
+	uint32_t writeLatency[TELEMETRY_LATENCY_BUCKETS];
+	int64_t maxWriteLatency;	/* us */
+
+	int64_t injectedPts;		/* of the last packet written */
+	int64_t presentedPts;		/* from the device play info */
+	int64_t frameCount;		/* from the device play info, -1 if unknown */
+	int64_t lead;			/* ms from presented to injected, what the device holds; 0 if unknown */
+	int64_t queuedMs;
+	size_t queuedBytes;
+};
+
+struct PlaybackTelemetry
+{
+	StreamTelemetry video;
+	StreamTelemetry audio;
+	int64_t avDrift;		/* ms the video is ahead of the audio, 0 if unknown */
+	uint64_t readBytes;
+};
+#endif
@@ -0,0 +1,50 @@
+/*
+ * PES to transport stream packetizer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __TS_H__
+#define __TS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TS_PACKET_SIZE		188
+#define TS_HEADER_SIZE		4
+#define TS_PAYLOAD_SIZE		(TS_PACKET_SIZE - TS_HEADER_SIZE)
+
+/* Splits PES packets into TS packets of one PID. The last packet of a PES
+   packet is padded with adaptation field stuffing, the continuity counter
+   is kept across PES packets. */
+class TsPacketizer
+{
+	private:
+		uint16_t pid;
+		uint8_t cc;
+	public:
+		TsPacketizer(uint16_t _pid = 0x100) { Reset(_pid); }
+		void Reset(uint16_t _pid) { pid = _pid & 0x1fff; cc = 0; }
+		uint16_t Pid() { return pid; }
+
+		/* buffer size needed for a PES packet of pes_len bytes */
+		static size_t Size(size_t pes_len) { return (pes_len + TS_PAYLOAD_SIZE - 1) / TS_PAYLOAD_SIZE * TS_PACKET_SIZE; }
+		/* packetizes the PES packet given as iovecs into out, which must hold
+		   Size() bytes. Returns the number of bytes stored. */
+		size_t Packetize(const struct iovec *iov, int iovcnt, uint8_t *out);
+		size_t Packetize(const uint8_t *pes, size_t pes_len, uint8_t *out);
+};
+#endif
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -44,6 +45,7 @@ class Writer
 	protected:
 		int fd;
 		Player *player;
+		static bool WriteV(int fd, struct iovec *iov, int iovcnt);
 	public:
 		static void Register(Writer *w, enum AVCodecID id, video_encoding_t encoding);
 		static void Register(Writer *w, enum AVCodecID id, audio_encoding_t encoding);
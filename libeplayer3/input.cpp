@@ -28,9 +28,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <algorithm>
 
 #include "player.h"
 #include "misc.h"
+#include "probecache.h"
+
+/* time between two pictures in reverse and keyframe trick play */
+#define TRICK_STEP 300000
+
+/* how often the play thread checks whether the streams have changed */
+#define TRACK_UPDATE_INTERVAL 1000000
 
 #define averror(_err,_fun) ({										\
 	if (_err < 0) {											\
@@ -52,10 +61,16 @@ Input::Input()
 	seek_avts_abs = INT64_MIN;
 	seek_avts_rel = 0;
 	abortPlayback = false;
+	zeroCopy = -1;
+	cache = &caches[0];
+	next.cache = &caches[1];
+	next.avfc = NULL;
+	next.running = false;
 }
 
 Input::~Input()
 {
+	DropPreload();
 }
 
 int64_t Input::calcPts(AVStream * stream, int64_t pts)
@@ -74,11 +89,7 @@ int64_t Input::calcPts(AVStream * stream, int64_t pts)
 }
 
 // from neutrino-mp/lib/libdvbsubtitle/dvbsub.cpp
-extern void dvbsub_write(AVSubtitle *, int64_t);
-extern void dvbsub_ass_write(AVCodecContext *c, AVSubtitle *sub, int pid);
 extern void dvbsub_ass_clear(void);
-// from neutrino-mp/lib/lib/libtuxtxt/tuxtxt_common.h
-extern void teletext_write(int pid, uint8_t *data, int size);
 
 static std::string lastlog_message;
 static unsigned int lastlog_repeats;
@@ -113,6 +124,19 @@ bool Input::Play()
 	int64_t showtime = 0;
 	bool restart_audio_resampling = false;
 	bool bof = false;
+	bool firstFrame = true;
+	bool stepping = false;		/* trick play from keyframe to keyframe */
+	bool stepShown = false;		/* the keyframe of the current step was written */
+	Keyframe lastKey = { INVALID_PTS_VALUE, -1 };
+	int64_t lastVideoPts = INVALID_PTS_VALUE;	/* for variant switches */
+	int64_t selectTime = 0;
+	unsigned int streamCount = avfc->nb_streams;
+	int64_t trackTime = 0;			/* of the next UpdateTracks() */
+	/* a network stream restored from the probe cache has no start time */
+	bool startPending = avfc->start_time == AV_NOPTS_VALUE;
+	bool videoStarted = false, audioStarted = false;
+
+	subtitles.Start(player);
 
 	// HACK: Dropping all video frames until the first audio frame was seen will keep player2 from stuttering.
 	//       Oddly, this seems to be necessary for network streaming only ...
@@ -122,17 +146,25 @@ bool Input::Play()
 
 		//IF MOVIE IS PAUSED, WAIT
 		if (player->isPaused) {
-			fprintf(stderr, "paused\n");
-			usleep(100000);
+			if (player->debug)
+				fprintf(stderr, "paused\n");
+			player->WaitWhilePaused();
 			continue;
 		}
 
 		int seek_target_flag = 0;
 		int64_t seek_target = INT64_MIN; // in AV_TIME_BASE units
+		bool indexed = keyIndex.Size() > 0;
 
 		if (seek_avts_rel) {
 			if (avfc->iformat->flags & AVFMT_TS_DISCONT) {
-				if (avfc->bit_rate) {
+				int64_t pts, pos = -1;
+				if (indexed && player->output.GetPts(pts))
+					pos = keyIndex.Seek(pts + av_rescale(seek_avts_rel, 90000ll, AV_TIME_BASE));
+				if (pos > -1) {
+					seek_target_flag = AVSEEK_FLAG_BYTE;
+					seek_target = pos;
+				} else if (avfc->bit_rate) {
 					seek_target_flag = AVSEEK_FLAG_BYTE;
 					seek_target = avio_tell(avfc->pb) + av_rescale(seek_avts_rel, avfc->bit_rate, 8 * AV_TIME_BASE);
 				}
@@ -144,7 +176,11 @@ bool Input::Play()
 			seek_avts_rel = 0;
 		} else if (seek_avts_abs != INT64_MIN) {
 			if (avfc->iformat->flags & AVFMT_TS_DISCONT) {
-				if (avfc->bit_rate) {
+				int64_t pos = indexed ? keyIndex.Seek(av_rescale(seek_avts_abs, 90000ll, AV_TIME_BASE)) : -1;
+				if (pos > -1) {
+					seek_target_flag = AVSEEK_FLAG_BYTE;
+					seek_target = pos;
+				} else if (avfc->bit_rate) {
 					seek_target_flag = AVSEEK_FLAG_BYTE;
 					seek_target = av_rescale(seek_avts_abs, avfc->bit_rate, 8 * AV_TIME_BASE);
 				}
@@ -152,19 +188,56 @@ bool Input::Play()
 				seek_target = seek_avts_abs;
 			}
 			seek_avts_abs = INT64_MIN;
+		} else if ((player->isBackWard || player->isStepping) && indexed) {
+			/* show one keyframe per step and drop everything up to the next one */
+			int64_t now = av_gettime();
+			if (now >= showtime) {
+				int64_t from = lastKey.pts;
+				if (from == INVALID_PTS_VALUE && !player->output.GetPts(from))
+					from = 0;
+				Keyframe k;
+				bool found;
+				if (player->isBackWard)		/* Speed seconds per step, as without index */
+					found = keyIndex.Next(from + player->Speed * 90000ll, -1, k);
+				else				/* Speed times the step time */
+					found = keyIndex.Next(from + player->Speed * 90ll * TRICK_STEP / 1000, 1, k);
+				if (found && k.pos != lastKey.pos) {
+					player->output.ClearVideo();
+					seek_target_flag = AVSEEK_FLAG_BYTE;
+					seek_target = k.pos;
+					lastKey = k;
+					stepShown = false;
+				}
+				/* at either end of the index the last picture stays */
+				stepping = true;
+				showtime = now + TRICK_STEP;
+			} else if (stepShown) {
+				player->WaitForStateChange(showtime - now);
+				continue;
+			}
 		} else if (player->isBackWard && av_gettime() >= showtime) {
 			player->output.ClearVideo();
 
 			if (bof) {
 				showtime = av_gettime();
-				usleep(100000);
+				player->WaitForStateChange(100000);
 				continue;
 			}
 			seek_avts_rel = player->Speed * AV_TIME_BASE;
-			showtime = av_gettime() + 300000;	//jump back every 300ms
+			showtime = av_gettime() + TRICK_STEP;
 			continue;
 		} else {
 			bof = false;
+			if (stepping) {
+				/* continue with the picture that was shown last */
+				stepping = false;
+				if (lastKey.pos > -1 && !player->isBackWard) {
+					seek_target_flag = AVSEEK_FLAG_BYTE;
+					seek_target = lastKey.pos;
+				}
+				lastKey.pts = INVALID_PTS_VALUE;
+				lastKey.pos = -1;
+			}
 		}
 
 		if (seek_target > INT64_MIN) {
@@ -179,17 +252,20 @@ bool Input::Play()
 			seek_target = INT64_MIN;
 			restart_audio_resampling = true;
 
-			// clear streams
+			// clear streams, the subtitle thread flushes its decoders
 			for (unsigned int i = 0; i < avfc->nb_streams; i++)
-				if (avfc->streams[i]->codec && avfc->streams[i]->codec->codec)
+				if (avfc->streams[i]->codec && avfc->streams[i]->codec->codec &&
+				    avfc->streams[i]->codec->codec_type != AVMEDIA_TYPE_SUBTITLE)
 					avcodec_flush_buffers(avfc->streams[i]->codec);
 			player->output.ClearAudio();
 			player->output.ClearVideo();
+			subtitles.Flush();
 		}
 
 		AVPacket packet;
 		av_init_packet(&packet);
 
+		int64_t readTime = av_gettime();
 		int err = av_read_frame(avfc, &packet);
 		if (err == AVERROR(EAGAIN)) {
 			av_free_packet(&packet);
@@ -200,56 +276,90 @@ bool Input::Play()
 
 		player->readCount += packet.size;
 
+		/* streams that were found or completed while reading become tracks
+		   here, the getters of the manager only read the published tracks */
+		if (avfc->nb_streams != streamCount || readTime >= trackTime) {
+			UpdateTracks();
+			streamCount = avfc->nb_streams;
+			trackTime = readTime + TRACK_UPDATE_INTERVAL;
+		}
+
 		AVStream *stream = avfc->streams[packet.stream_index];
-		Track *_videoTrack = videoTrack;
-		Track *_audioTrack = audioTrack;
-		Track *_subtitleTrack = subtitleTrack;
-		Track *_teletextTrack = teletextTrack;
+
+		if (variants.Active()) {
+			int64_t now = av_gettime();
+			variants.Sample(packet.size, now - readTime);
+			if (now >= selectTime && videoTrack && !stepping && !player->isBackWard) {
+				variants.Select(videoTrack->stream, now);
+				selectTime = now + 1000000;
+			}
+			/* switch at the first keyframe of the new variant that doesn't go back in time */
+			int id;
+			int64_t pts;
+			if ((packet.flags & AV_PKT_FLAG_KEY) && (id = variants.Pending(stream)) > -1
+			 && stream->codec->codec_type == AVMEDIA_TYPE_VIDEO
+			 && (pts = calcPts(stream, packet.pts)) != INVALID_PTS_VALUE
+			 && (lastVideoPts == INVALID_PTS_VALUE || pts >= lastVideoPts)) {
+				player->manager.selectProgram(id, true);
+				variants.Switched(now);
+			}
+		}
+		const Track *_videoTrack = videoTrack;
+		const Track *_audioTrack = audioTrack;
+		const Track *_subtitleTrack = subtitleTrack;
+		const Track *_teletextTrack = teletextTrack;
+
+		/* the earliest first timestamp of the tracks, as avformat_find_stream_info() would */
+		if (startPending && packet.pts != AV_NOPTS_VALUE) {
+			bool video = _videoTrack && _videoTrack->stream == stream;
+			bool audio = _audioTrack && _audioTrack->stream == stream;
+			if ((video && !videoStarted) || (audio && !audioStarted)) {
+				int64_t t = av_rescale_q(packet.pts, stream->time_base, AV_TIME_BASE_Q);
+				if (avfc->start_time == AV_NOPTS_VALUE || t < avfc->start_time)
+					avfc->start_time = t;
+				videoStarted |= video;
+				audioStarted |= audio;
+				startPending = (_videoTrack && !videoStarted) || (_audioTrack && !audioStarted);
+			}
+		}
 
 		if (_videoTrack && (_videoTrack->stream == stream)) {
 			int64_t pts = calcPts(stream, packet.pts);
-			if (audioSeen && !player->output.Write(stream, &packet, pts))
-				logprintf("writing data to %s device failed\n", "video");
+			bool key = packet.flags & AV_PKT_FLAG_KEY;
+			if (key && packet.pos > -1 && pts != INVALID_PTS_VALUE && stream->id == keyIndex.GetStreamId())
+				keyIndex.Add(pts, packet.pos);
+			if (!audioSeen || (stepping && (stepShown || !key)))
+				player->output.Dropped(stream);
+			else if (!player->output.Write(stream, &packet, pts))
+				logprintf("queueing data for %s device failed\n", "video");
+			else {
+				if (pts != INVALID_PTS_VALUE)
+					lastVideoPts = pts;
+				if (stepping)
+					stepShown = true;
+				if (firstFrame) {
+					fprintf(stderr, "%s: first video frame %lld ms after open\n", __func__, (long long) (av_gettime() - openTime) / 1000);
+					firstFrame = false;
+				}
+			}
 		} else if (_audioTrack && (_audioTrack->stream == stream)) {
 			if (restart_audio_resampling) {
 				restart_audio_resampling = false;
 				player->output.Write(stream, NULL, 0);
 			}
-			if (!player->isBackWard) {
+			if (!player->isBackWard && !stepping) {
 				int64_t pts = calcPts(stream, packet.pts);
 				if (!player->output.Write(stream, &packet, _videoTrack ? pts : 0))
-					logprintf("writing data to %s device failed\n", "audio");
+					logprintf("queueing data for %s device failed\n", "audio");
 			}
 			audioSeen = true;
 		} else if (_subtitleTrack && (_subtitleTrack->stream == stream)) {
-			if (stream->codec->codec) {
-				AVSubtitle sub;
-				memset(&sub, 0, sizeof(sub));
-				int got_sub_ptr = 0;
-
-				err = avcodec_decode_subtitle2(stream->codec, &sub, &got_sub_ptr, &packet);
-				averror(err, avcodec_decode_subtitle2);
-
-				if (got_sub_ptr && sub.num_rects > 0) {
-					switch (sub.rects[0]->type) {
-						case SUBTITLE_TEXT: // FIXME?
-						case SUBTITLE_ASS:
-							dvbsub_ass_write(stream->codec, &sub, _subtitleTrack->pid);
-							break;
-						case SUBTITLE_BITMAP: {
-							int64_t pts = calcPts(stream, packet.pts);
-							dvbsub_write(&sub, pts);
-							// avsubtitle_free() will be called by handler
-							break;
-						}
-						default:
-							break;
-					}
-				}
-			}
+			/* decoded by the subtitle thread */
+			if (stream->codec->codec)
+				subtitles.Push(stream, &packet, calcPts(stream, packet.pts), _subtitleTrack->pid);
 		} else if (_teletextTrack && (_teletextTrack->stream == stream)) {
 			if (packet.data && packet.size > 1)
-				teletext_write(_teletextTrack->pid, packet.data + 1, packet.size - 1);
+				subtitles.Push(NULL, &packet, calcPts(stream, packet.pts), _teletextTrack->pid);
 		}
 
 		av_free_packet(&packet);
@@ -260,9 +370,11 @@ bool Input::Play()
 	else
 		player->output.Flush();
 
+	subtitles.Stop();
 	dvbsub_ass_clear();
 	abortPlayback = true;
 	hasPlayThreadStarted = false;
+	player->StateChanged();
 
 	return true;
 }
@@ -309,47 +421,8 @@ bool Input::ReadSubtitle(const char *filename, const char *format, int pid)
 	if (access(subfile, R_OK))
 		return false;
 
-	AVFormatContext *subavfc = avformat_alloc_context();
-	int err = avformat_open_input(&subavfc, subfile, av_find_input_format(format), 0);
-	if (averror(err, avformat_open_input)) {
-		avformat_free_context(subavfc);
-		return false;
-	}
-
-	avformat_find_stream_info(subavfc, NULL);
-	if (subavfc->nb_streams != 1) {
-		avformat_free_context(subavfc);
-		return false;
-	}
-
-	AVCodecContext *c = subavfc->streams[0]->codec;
-	AVCodec *codec = avcodec_find_decoder(c->codec_id);
-	if (!codec) {
-		avformat_free_context(subavfc);
-		return false;
-	}
-
-	err = avcodec_open2(c, codec, NULL);
-	if (averror(err, avcodec_open2)) {
-		avformat_free_context(subavfc);
-		return false;
-	}
-
-	AVPacket packet;
-	av_init_packet(&packet);
-
-	while (av_read_frame(subavfc, &packet) > -1) {
-		AVSubtitle sub;
-		memset(&sub, 0, sizeof(sub));
-		int got_sub = 0;
-		avcodec_decode_subtitle2(c, &sub, &got_sub, &packet);
-		if (got_sub)
-			dvbsub_ass_write(c, &sub, pid);
-		av_free_packet(&packet);
-	}
-	avcodec_close(c);
-	avformat_close_input(&subavfc);
-	avformat_free_context(subavfc);
+	/* opened and read by the subtitle thread once playback has started */
+	subtitles.AddFile(subfile, format, pid);
 
 	Track track;
 	track.title = format;
@@ -370,9 +443,150 @@ bool Input::ReadSubtitles(const char *filename) {
 	return ret;
 }
 
+/* open and probe filename, or restore the stream info from the probe cache.
+   http streams are read through c. Called by Init() and by the preload
+   thread, so nothing here may touch the player */
+AVFormatContext *Input::OpenFormat(const char *filename, Cache *c, AVIOInterruptCB *cb, bool http, bool noprobe, FollowFile *f, MappedFile *m)
+{
+	int64_t start = av_gettime();
+	AVFormatContext *ctx;
+again:
+	ctx = avformat_alloc_context();
+	ctx->interrupt_callback = *cb;
+
+	if (http && (!strncmp(filename, "http://", 7) || !strncmp(filename, "https://", 8))
+	 && c->Open(filename, &ctx->interrupt_callback))
+		ctx->pb = c->GetAVIOContext();
+	else if (f && !strncmp(filename, "file://", 7) && f->Open(filename + 7, &ctx->interrupt_callback))
+		ctx->pb = f->GetAVIOContext();
+	else if (m && !strncmp(filename, "file://", 7) && m->Open(filename + 7))
+		ctx->pb = m->GetAVIOContext();
+
+	int err = avformat_open_input(&ctx, filename, NULL, 0);
+	if (averror(err, avformat_open_input)) {
+		avformat_free_context(ctx);
+		c->Close();
+		if (f)
+			f->Close();
+		if (m)
+			m->Close();
+		return NULL;
+	}
+
+	ctx->iformat->flags |= AVFMT_SEEK_TO_PTS;
+	ctx->flags = AVFMT_FLAG_GENPTS;
+	if (noprobe) {
+#if (LIBAVFORMAT_VERSION_MAJOR <  55) || \
+    (LIBAVFORMAT_VERSION_MAJOR == 55 && LIBAVFORMAT_VERSION_MINOR <  43) || \
+    (LIBAVFORMAT_VERSION_MAJOR == 55 && LIBAVFORMAT_VERSION_MINOR == 43 && LIBAVFORMAT_VERSION_MICRO < 100)
+		ctx->max_analyze_duration = 1;
+#else
+		ctx->max_analyze_duration2 = 1;
+#endif
+		ctx->probesize = 131072;
+	}
+
+	if (ProbeCache::Restore(ctx, filename))
+		fprintf(stderr, "%s: stream info restored after %lld ms\n", __func__, (long long) (av_gettime() - start) / 1000);
+	else {
+		err = avformat_find_stream_info(ctx, NULL);
+		if (averror(err, avformat_find_stream_info)) {
+			avformat_close_input(&ctx);
+			c->Close();
+			if (f)
+				f->Close();
+			if (m)
+				m->Close();
+			if (noprobe) {
+				noprobe = false;
+				goto again;
+			}
+			return NULL;
+		}
+		/* minimal probing may have missed something */
+		if (!noprobe)
+			ProbeCache::Store(ctx, filename);
+		fprintf(stderr, "%s: stream info probed after %lld ms\n", __func__, (long long) (av_gettime() - start) / 1000);
+	}
+	return ctx;
+}
+
+static int preload_interrupt_cb(void *arg)
+{
+	return *(bool *) arg;
+}
+
+void *Input::preloadthread(void *arg)
+{
+	char threadname[17];
+	strncpy(threadname, __func__, sizeof(threadname));
+	threadname[16] = 0;
+	prctl(PR_SET_NAME, (unsigned long) threadname);
+
+	Input *input = (Input *) arg;
+	NextItem &next = input->next;
+	AVIOInterruptCB cb = { preload_interrupt_cb, &next.abort };
+	next.avfc = OpenFormat(next.url.c_str(), next.cache, &cb, next.http, next.noprobe);
+	fprintf(stderr, "%s: %s %s after %lld ms\n", __func__, next.url.c_str(), next.avfc ? "ready" : "failed",
+		(long long) (av_gettime() - next.start) / 1000);
+	return NULL;
+}
+
+bool Input::Preload(const char *filename, bool http, bool noprobe)
+{
+	DropPreload();
+
+	av_lockmgr_register(lock_callback);
+	avcodec_register_all();
+	av_register_all();
+	avformat_network_init();
+
+	next.url = filename;
+	next.http = http;
+	next.noprobe = noprobe;
+	next.abort = false;
+	next.avfc = NULL;
+	next.start = av_gettime();
+	int err = pthread_create(&next.thread, NULL, preloadthread, this);
+	if (err) {
+		fprintf(stderr, "%s %s %d: pthread_create: %d (%s)\n", __FILE__, __func__, __LINE__, err, strerror(err));
+		next.url.clear();
+		avformat_network_deinit();
+		return false;
+	}
+	next.running = true;
+	return true;
+}
+
+/* waits for the preload thread, the result is in next.avfc */
+void Input::JoinPreload()
+{
+	if (next.running) {
+		pthread_join(next.thread, NULL);
+		next.running = false;
+	}
+}
+
+void Input::DropPreload()
+{
+	if (next.url.empty())
+		return;
+	next.abort = true;
+	JoinPreload();
+	if (next.avfc) {
+		for (unsigned int i = 0; i < next.avfc->nb_streams; i++)
+			avcodec_close(next.avfc->streams[i]->codec);
+		avformat_close_input(&next.avfc);
+	}
+	next.cache->Close();
+	next.url.clear();
+	avformat_network_deinit();
+}
+
 bool Input::Init(const char *filename)
 {
 	abortPlayback = false;
+	openTime = av_gettime();
 	av_lockmgr_register(lock_callback);
 #if ENABLE_LOGGING
 	av_log_set_callback(log_callback);
@@ -384,53 +598,48 @@ bool Input::Init(const char *filename)
 	}
 	fprintf(stderr, "%s %s %d: %s\n", __FILE__, __func__, __LINE__, filename);
 
-	avcodec_register_all();
-	av_register_all();
-	avformat_network_init();
-
 	videoTrack = NULL;
 	audioTrack = NULL;
 	subtitleTrack = NULL;
 	teletextTrack = NULL;
-
-again:
-	avfc = avformat_alloc_context();
-	avfc->interrupt_callback.callback = interrupt_cb;
-	avfc->interrupt_callback.opaque = (void *) player;
-
-	int err = avformat_open_input(&avfc, filename, NULL, 0);
-	if (averror(err, avformat_open_input)) {
-		avformat_free_context(avfc);
-		return false;
+	trackSignature = 0;
+
+	AVIOInterruptCB cb = { interrupt_cb, player };
+	avfc = NULL;
+	if (next.url == filename) {
+		/* connected and probed in the background, possibly still busy */
+		JoinPreload();
+		if (next.avfc) {
+			avfc = next.avfc;
+			next.avfc = NULL;
+			next.url.clear();
+			avfc->interrupt_callback = cb;
+			std::swap(cache, next.cache);
+			cache->SetInterruptCallback(&cb);
+			fprintf(stderr, "%s: preloaded stream taken over after %lld ms\n", __func__, (long long) (av_gettime() - openTime) / 1000);
+		}
 	}
+	if (!avfc) {
+		DropPreload();
 
-	avfc->iformat->flags |= AVFMT_SEEK_TO_PTS;
-	avfc->flags = AVFMT_FLAG_GENPTS;
-	if (player->noprobe) {
-#if (LIBAVFORMAT_VERSION_MAJOR <  55) || \
-    (LIBAVFORMAT_VERSION_MAJOR == 55 && LIBAVFORMAT_VERSION_MINOR <  43) || \
-    (LIBAVFORMAT_VERSION_MAJOR == 55 && LIBAVFORMAT_VERSION_MINOR == 43 && LIBAVFORMAT_VERSION_MICRO < 100)
-		avfc->max_analyze_duration = 1;
-#else
-		avfc->max_analyze_duration2 = 1;
-#endif
-		avfc->probesize = 131072;
-	}
+		avcodec_register_all();
+		av_register_all();
+		avformat_network_init();
 
-	err = avformat_find_stream_info(avfc, NULL);
-	if (averror(err, avformat_find_stream_info)) {
-		avformat_close_input(&avfc);
-		if (player->noprobe) {
-			player->noprobe = false;
-			goto again;
-		}
-		return false;
+		avfc = OpenFormat(filename, cache, &cb, player->isHttp, player->noprobe, &follow, &mapped);
+		if (!avfc)
+			return false;
 	}
+	const char *zc = getenv("EPLAYER3_ZEROCOPY");
+	zeroCopy = zc ? !!atoi(zc) : -1;
 
 	bool res = UpdateTracks();
 
 	if (!videoTrack && !audioTrack) {
 		avformat_close_input(&avfc);
+		cache->Close();
+		follow.Close();
+		mapped.Close();
 		return false;
 	}
 
@@ -439,16 +648,57 @@ again:
 	if (audioTrack)
 		player->output.SwitchAudio(audioTrack->stream);
 
+	/* HLS: start with the lowest variant, the selector switches up when the
+	   throughput allows. EPLAYER3_ADAPTIVE=0 leaves the choice to the caller */
+	const char *adaptive = getenv("EPLAYER3_ADAPTIVE");
+	std::vector<Program> programs = player->manager.getPrograms();
+	if (player->isHttp && (!adaptive || atoi(adaptive)) && variants.Init(programs))
+		player->manager.selectProgram(variants.Lowest());
+	else
+		variants.Clear();
+
+	/* libavformat can only estimate byte positions from the bit rate */
+	if ((avfc->iformat->flags & AVFMT_TS_DISCONT) && videoTrack)
+		keyIndex.Open(filename, videoTrack->stream->id, avfc->start_time, avfc->bit_rate);
+
 	ReadSubtitles(filename);
 
 	return res;
 }
 
+/* what UpdateTracks() derives the tracks from */
+uint64_t Input::StreamSignature()
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+#define MIX(v) do { h ^= (uint64_t) (v); h *= 0x100000001b3ULL; } while (0)
+	MIX(avfc->nb_streams);
+	MIX(avfc->nb_programs);
+	MIX(avfc->nb_chapters);
+	for (unsigned int n = 0; n < avfc->nb_streams; n++) {
+		AVStream *stream = avfc->streams[n];
+		MIX(stream->id);
+		MIX(stream->codec->codec_type);
+		MIX(stream->codec->codec_id);
+		MIX(stream->codec->extradata_size);
+		MIX(!!stream->codec->codec);
+		MIX(stream->metadata);
+	}
+	for (unsigned int n = 0; n < avfc->nb_programs; n++)
+		MIX(avfc->programs[n]->nb_stream_indexes);
+#undef MIX
+	return h;
+}
+
+/* rebuilds the tracks if the streams have changed since the last call.
+   Called by Init() and then by the play thread only */
 bool Input::UpdateTracks()
 {
 	if (abortPlayback)
 		return true;
 
+	if (StreamSignature() == trackSignature)
+		return true;
+
 	std::vector<Chapter> chapters;
 	for (unsigned int i = 0; i < avfc->nb_chapters; i++) {
 		AVChapter *ch = avfc->chapters[i];
@@ -466,6 +716,7 @@ bool Input::UpdateTracks()
 	av_dump_format(avfc, 0, player->url.c_str(), 0);
 
 	bool use_index_as_pid = false;
+	int videoPid = -1, audioPid = -1;
 	for (unsigned int n = 0; n < avfc->nb_streams; n++) {
 		AVStream *stream = avfc->streams[n];
 
@@ -490,8 +741,8 @@ bool Input::UpdateTracks()
 		switch (stream->codec->codec_type) {
 			case AVMEDIA_TYPE_VIDEO:
 				player->manager.addVideoTrack(track);
-				if (!videoTrack)
-					videoTrack = player->manager.getVideoTrack(track.pid);
+				if (videoPid < 0)
+					videoPid = track.pid;
 				break;
 			case AVMEDIA_TYPE_AUDIO:
 				switch(stream->codec->codec_id) {
@@ -517,8 +768,8 @@ bool Input::UpdateTracks()
 						track.ac3flags = 0;
 				}
 				player->manager.addAudioTrack(track);
-				if (!audioTrack)
-					audioTrack = player->manager.getAudioTrack(track.pid);
+				if (audioPid < 0)
+					audioPid = track.pid;
 				break;
 			case AVMEDIA_TYPE_SUBTITLE:
 				if (stream->codec->codec_id == AV_CODEC_ID_DVB_TELETEXT) {
@@ -561,21 +812,36 @@ bool Input::UpdateTracks()
 			Program program;
 			program.title = name ? name->value : "";
 			program.id = p->id;
+			AVDictionaryEntry *rate = av_dict_get(p->metadata, "variant_bitrate", NULL, 0);
+			program.bitrate = rate ? atoll(rate->value) : 0;
 			for (unsigned m = 0; m < p->nb_stream_indexes; m++)
 				program.streams.push_back(avfc->streams[p->stream_index[m]]);
 			player->manager.addProgram(program);
 		}
 	}
+	player->manager.commitTrackUpdate();
+
+	if (!videoTrack && videoPid > -1)
+		videoTrack = player->manager.getVideoTrack(videoPid);
+	if (!audioTrack && audioPid > -1)
+		audioTrack = player->manager.getAudioTrack(audioPid);
 
+	/* after opening the subtitle decoders */
+	trackSignature = StreamSignature();
 	return true;
 }
 
 bool Input::Stop()
 {
 	abortPlayback = true;
+	player->StateChanged();
 
-	while (hasPlayThreadStarted != 0)
-		usleep(100000);
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(player->stateMutex);
+		while (hasPlayThreadStarted != 0)
+			player->stateCond.wait(&player->stateMutex);
+	}
+	subtitles.Stop();
 
 	if (avfc) {
 		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(mutex);
@@ -583,6 +849,11 @@ bool Input::Stop()
 			avcodec_close(avfc->streams[i]->codec);
 		avformat_close_input(&avfc);
 	}
+	cache->Close();
+	follow.Close();
+	mapped.Close();
+	keyIndex.Close();
+	variants.Clear();
 
 	avformat_network_deinit();
 
@@ -617,36 +888,43 @@ bool Input::GetDuration(int64_t &duration)
 {
 	if (avfc) {
 		duration = avfc->duration;
+		if (follow.IsOpen())
+			duration = follow.ScaleDuration(duration);
 		return true;
 	}
 	duration = 0;
 	return false;
 }
 
-bool Input::SwitchAudio(Track *track)
+bool Input::SwitchAudio(const Track *track, bool seamless)
 {
 	audioTrack = track;
-	player->output.SwitchAudio(track ? track->stream : NULL);
+	player->output.SwitchAudio(track ? track->stream : NULL, seamless);
 	// player->Seek(-5000, false);
 	return true;
 }
 
-bool Input::SwitchSubtitle(Track *track)
+bool Input::SwitchSubtitle(const Track *track)
 {
+	/* selectProgram() passes the same track from a newer snapshot */
+	if ((track ? track->pid : -1) != (subtitleTrack ? subtitleTrack->pid : -1))
+		subtitles.Flush();
 	subtitleTrack = track;
 	return true;
 }
 
-bool Input::SwitchTeletext(Track *track)
+bool Input::SwitchTeletext(const Track *track)
 {
+	if ((track ? track->pid : -1) != (teletextTrack ? teletextTrack->pid : -1))
+		subtitles.Flush();
 	teletextTrack = track;
 	return true;
 }
 
-bool Input::SwitchVideo(Track *track)
+bool Input::SwitchVideo(const Track *track, bool seamless)
 {
 	videoTrack = track;
-	player->output.SwitchVideo(track ? track->stream : NULL);
+	player->output.SwitchVideo(track ? track->stream : NULL, seamless);
 	return true;
 }
 
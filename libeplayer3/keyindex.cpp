@@ -0,0 +1,383 @@
+/*
+ * persistent keyframe index for seeking in transport streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include "keyindex.h"
+#include "probecache.h"
+
+static const char KEYINDEX_MAGIC[8] = { 'E', 'P', '3', 'K', 'I', 'D', 'X', '1' };
+
+static bool by_pos(const Keyframe &a, const Keyframe &b)
+{
+	return a.pos < b.pos;
+}
+
+/* the positions are sorted, Add() makes sure that the PTS are too */
+static bool by_pts(const Keyframe &a, const Keyframe &b)
+{
+	return a.pts < b.pts;
+}
+
+KeyframeIndex::KeyframeIndex()
+{
+	id = -1;
+	start = AV_NOPTS_VALUE;
+	bitrate = 0;
+	rate = 0;
+	scanned = 0;
+	complete = false;
+	running = false;
+	scanning = false;
+}
+
+KeyframeIndex::~KeyframeIndex()
+{
+	Close();
+}
+
+bool KeyframeIndex::Open(const char *_url, int _id, int64_t _start, int64_t _bitrate)
+{
+	Close();
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	url = _url;
+	key = ProbeCache::Key(_url);
+	id = _id;
+	start = _start;
+	bitrate = _bitrate;
+	scanned = 0;
+	complete = false;
+	if (Restore())
+		fprintf(stderr, "%s: %zu keyframes restored%s\n", __func__, entries.size(), complete ? "" : ", scan incomplete");
+
+	rate = KEYINDEX_SCAN_RATE;
+	const char *tmp = getenv("EPLAYER3_INDEX_SCAN");
+	if (tmp)
+		rate = atoi(tmp) * 1024;
+	/* scanning a network stream would compete with playback for the bandwidth */
+	if (complete || rate <= 0 || strncmp(_url, "file://", 7))
+		return true;
+
+	running = true;
+	int r = pthread_create(&thread, NULL, scanthread, this);
+	if (r) {
+		fprintf(stderr, "%s %s %d: pthread_create: %d (%s)\n", __FILE__, __func__, __LINE__, r, strerror(r));
+		running = false;
+	}
+	scanning = running;
+	return true;
+}
+
+void KeyframeIndex::Close()
+{
+	running = false;
+	if (scanning)
+		pthread_join(thread, NULL);
+	scanning = false;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (id > -1 && !entries.empty())
+		Store();
+	entries.clear();
+	url.clear();
+	key.clear();
+	id = -1;
+}
+
+size_t KeyframeIndex::Size()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	return entries.size();
+}
+
+void KeyframeIndex::Add(int64_t pts, int64_t pos)
+{
+	Keyframe k = { pts, pos };
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	std::vector<Keyframe>::iterator it = std::lower_bound(entries.begin(), entries.end(), k, by_pos);
+	if (it != entries.end() && it->pos == pos)
+		return;
+	/* a discontinuity, the index can only map monotonic PTS */
+	if ((it != entries.end() && it->pts <= pts) || (it != entries.begin() && (it - 1)->pts >= pts))
+		return;
+	entries.insert(it, k);
+}
+
+/* the position to seek to for pts: the keyframe at or before pts if the
+   index is dense there, an interpolation between the neighbouring entries
+   otherwise, -1 if there are no entries */
+int64_t KeyframeIndex::Seek(int64_t pts)
+{
+	Keyframe k = { pts, 0 };
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (entries.empty())
+		return -1;
+	std::vector<Keyframe>::iterator it = std::upper_bound(entries.begin(), entries.end(), k, by_pts);
+	int64_t pos;
+	if (it == entries.begin()) {
+		/* before the first entry */
+		pos = bitrate ? it->pos - av_rescale(it->pts - pts, bitrate, 8 * 90000) : 0;
+	} else if (it == entries.end()) {
+		/* after the last entry */
+		Keyframe &e = entries.back();
+		if (pts - e.pts <= KEYINDEX_GAP || !bitrate)
+			pos = e.pos;
+		else
+			pos = e.pos + av_rescale(pts - e.pts, bitrate, 8 * 90000);
+	} else {
+		Keyframe &e0 = *(it - 1), &e1 = *it;
+		if (e1.pts - e0.pts <= KEYINDEX_GAP)
+			pos = e0.pos;
+		else
+			pos = e0.pos + av_rescale(pts - e0.pts, e1.pos - e0.pos, e1.pts - e0.pts);
+	}
+	return pos < 0 ? 0 : pos;
+}
+
+/* the nearest entry at or before (dir < 0) or at or after (dir > 0) pts */
+bool KeyframeIndex::Next(int64_t pts, int dir, Keyframe &k)
+{
+	Keyframe t = { pts, 0 };
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	std::vector<Keyframe>::iterator it;
+	if (dir < 0) {
+		it = std::upper_bound(entries.begin(), entries.end(), t, by_pts);
+		if (it == entries.begin())
+			return false;
+		--it;
+	} else {
+		it = std::lower_bound(entries.begin(), entries.end(), t, by_pts);
+		if (it == entries.end())
+			return false;
+	}
+	k = *it;
+	return true;
+}
+
+bool KeyframeIndex::Restore()
+{
+	std::string name = ProbeCache::FileName(key);
+	if (name.empty())
+		return false;
+	name += ".idx";
+	FILE *f = fopen(name.c_str(), "r");
+	if (!f)
+		return false;
+
+	bool ret = false;
+	char magic[8];
+	uint32_t len, count;
+	int32_t _id;
+	int64_t hdr[2];
+	std::string k;
+	struct stat st;
+	long at;
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, KEYINDEX_MAGIC, sizeof(magic)) ||
+	    fread(&len, sizeof(len), 1, f) != 1 || len != key.length())
+		goto out;
+	k.resize(len);
+	if (fread(&k[0], len, 1, f) != 1 || k != key)
+		goto out;	/* hash collision */
+	if (fread(&_id, sizeof(_id), 1, f) != 1 || _id != id ||
+	    fread(hdr, sizeof(hdr), 1, f) != 1 || fread(&count, sizeof(count), 1, f) != 1)
+		goto out;
+	/* the entries must be there before they are allocated */
+	if (fstat(fileno(f), &st) || (at = ftell(f)) < 0 ||
+	    (uint64_t) count * sizeof(Keyframe) != (uint64_t) (st.st_size - at))
+		goto out;
+	entries.resize(count);
+	if (count && fread(&entries[0], sizeof(Keyframe), count, f) != count) {
+		entries.clear();
+		goto out;
+	}
+	scanned = hdr[0];
+	complete = hdr[1];
+	ret = true;
+ out:
+	fclose(f);
+	if (ret)
+		ProbeCache::Touch(name);
+	else
+		fprintf(stderr, "%s: %s does not match %s\n", __func__, name.c_str(), url.c_str());
+	return ret;
+}
+
+bool KeyframeIndex::Store()
+{
+	std::string name = ProbeCache::FileName(key);
+	if (name.empty())
+		return false;
+	mkdir(name.substr(0, name.rfind('/')).c_str(), 0755);
+	name += ".idx";
+
+	std::string tmp = name + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		fprintf(stderr, "%s: cannot open %s (%m)\n", __func__, tmp.c_str());
+		return false;
+	}
+	uint32_t len = key.length();
+	int32_t _id = id;
+	int64_t hdr[2] = { scanned, complete };
+	uint32_t count = entries.size();
+	fwrite(KEYINDEX_MAGIC, sizeof(KEYINDEX_MAGIC), 1, f);
+	fwrite(&len, sizeof(len), 1, f);
+	fwrite(key.data(), len, 1, f);
+	fwrite(&_id, sizeof(_id), 1, f);
+	fwrite(hdr, sizeof(hdr), 1, f);
+	fwrite(&count, sizeof(count), 1, f);
+	fwrite(&entries[0], sizeof(Keyframe), count, f);
+	if (ferror(f) | fclose(f)) {
+		fprintf(stderr, "%s: writing %s failed\n", __func__, tmp.c_str());
+		unlink(tmp.c_str());
+		return false;
+	}
+	if (rename(tmp.c_str(), name.c_str())) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	/* the indexes count towards the limits of the probe cache */
+	ProbeCache::Prune();
+	return true;
+}
+
+int KeyframeIndex::interrupt_cb(void *opaque)
+{
+	KeyframeIndex *index = (KeyframeIndex *) opaque;
+	return !index->running;
+}
+
+void *KeyframeIndex::scanthread(void *arg)
+{
+	char threadname[17];
+	strncpy(threadname, __func__, sizeof(threadname));
+	threadname[16] = 0;
+	prctl(PR_SET_NAME, (unsigned long) threadname);
+	/* playback must not notice the scan */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	KeyframeIndex *index = (KeyframeIndex *) arg;
+	index->Scan();
+	return NULL;
+}
+
+void KeyframeIndex::Scan()
+{
+	AVFormatContext *avfc = avformat_alloc_context();
+	avfc->interrupt_callback.callback = interrupt_cb;
+	avfc->interrupt_callback.opaque = this;
+	/* the stream layout is known from the PMT, no need to probe */
+	int err = avformat_open_input(&avfc, url.c_str(), NULL, 0);
+	if (err < 0) {
+		fprintf(stderr, "%s: avformat_open_input: %d\n", __func__, err);
+		avformat_free_context(avfc);
+		return;
+	}
+
+	int vidx = -1;
+	for (unsigned int i = 0; i < avfc->nb_streams; i++) {
+		avfc->streams[i]->discard = AVDISCARD_ALL;
+		if (avfc->streams[i]->id == id && vidx < 0) {
+			avfc->streams[i]->discard = AVDISCARD_DEFAULT;
+			vidx = i;
+		}
+	}
+	if (vidx < 0) {
+		fprintf(stderr, "%s: stream %d not found\n", __func__, id);
+		avformat_close_input(&avfc);
+		return;
+	}
+	AVStream *stream = avfc->streams[vidx];
+
+	AVPacket packet;
+	av_init_packet(&packet);
+
+	/* the first timestamp sets the wrap reference, as for the play thread */
+	int64_t from;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		from = scanned;
+	}
+	if (from > 0) {
+		while (running && !(err = av_read_frame(avfc, &packet))) {
+			bool found = packet.stream_index == vidx && packet.pts != AV_NOPTS_VALUE;
+			av_free_packet(&packet);
+			if (found)
+				break;
+		}
+		if (!err)
+			err = avformat_seek_file(avfc, -1, INT64_MIN, from, INT64_MAX, AVSEEK_FLAG_BYTE);
+		if (err < 0)
+			from = 0;
+	}
+
+	int64_t t = av_gettime();
+	int64_t offset = start != AV_NOPTS_VALUE ? av_rescale(90000ll, start, AV_TIME_BASE) : 0;
+	unsigned int found = 0;
+	while (running) {
+		err = av_read_frame(avfc, &packet);
+		if (err == AVERROR(EAGAIN)) {
+			av_free_packet(&packet);
+			continue;
+		}
+		if (err < 0)
+			break;
+		if (packet.stream_index == vidx && (packet.flags & AV_PKT_FLAG_KEY) && packet.pos > -1 && packet.pts != AV_NOPTS_VALUE) {
+			int64_t pts = av_rescale(90000ll * stream->time_base.num, packet.pts, stream->time_base.den) - offset;
+			if (pts > -1) {
+				Add(pts, packet.pos);
+				found++;
+			}
+		}
+		av_free_packet(&packet);
+
+		int64_t pos = avio_tell(avfc->pb);
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+			if (pos > scanned)
+				scanned = pos;
+		}
+		/* stay below the rate, a little too slow after a long sleep does not matter */
+		int64_t ahead = av_rescale(pos - from, 1000000, rate) - (av_gettime() - t);
+		if (ahead > 0)
+			usleep(ahead > 100000 ? 100000 : ahead);
+	}
+
+	avformat_close_input(&avfc);
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (err == AVERROR_EOF)
+		complete = true;
+	fprintf(stderr, "%s: %u keyframes in %lld ms, %zu in the index, %s at %lld\n", __func__, found,
+		(long long) (av_gettime() - t) / 1000, entries.size(), complete ? "complete" : "stopped", (long long) scanned);
+}
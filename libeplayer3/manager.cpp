@@ -20,244 +20,216 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <set>
 #include "manager.h"
 #include "player.h"
 
-void Manager::addTrack(std::map<int,Track*> &tracks, Track &track)
+Manager::Manager()
+{
+	player = NULL;
+	current = new TrackSnapshot;
+	updating = false;
+}
+
+/* makes work the current snapshot. Called with mutex held */
+void Manager::publish()
+{
+	TrackSnapshot *s = new TrackSnapshot(work);
+	s->generation = current->generation + 1;
+	for (int t = 0; t < TRACK_TYPES; t++)
+		for (std::map<int,Track>::iterator it = s->tracks[t].begin(); it != s->tracks[t].end(); ++it)
+			if (!it->second.inactive && !it->second.hidden)
+				s->visible[t].push_back(it->second);
+	retired.push_back(current);
+	__atomic_store_n(&current, s, __ATOMIC_RELEASE);
+}
+
+void Manager::addTrack(int type, Track &track)
 {
 	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
-	std::map<int,Track*>::iterator it = tracks.find(track.pid);
-	if (it == tracks.end()) {
-		Track *t = new Track;
-		*t = track;
-		tracks[track.pid] = t;
-	} else
-		*it->second = track;
+	work.tracks[type][track.pid] = track;
+	if (!updating)
+		publish();
 }
 
 void Manager::addVideoTrack(Track &track)
 {
-	addTrack(videoTracks, track);
+	addTrack(TRACK_VIDEO, track);
 }
 
 void Manager::addAudioTrack(Track &track)
 {
-	addTrack(audioTracks, track);
+	addTrack(TRACK_AUDIO, track);
 }
 
 void Manager::addSubtitleTrack(Track &track)
 {
-	addTrack(subtitleTracks, track);
+	addTrack(TRACK_SUBTITLE, track);
 }
 
 void Manager::addTeletextTrack(Track &track)
 {
-	addTrack(teletextTracks, track);
+	addTrack(TRACK_TELETEXT, track);
 }
 
-std::vector<Track> Manager::getTracks(std::map<int,Track*> &tracks)
+/* the play thread keeps the tracks up to date, see Input::Play() */
+const std::vector<Track> &Manager::getTracks(int type)
 {
-	player->input.UpdateTracks();
-	std::vector<Track> res;
-	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
-	for(std::map<int,Track*>::iterator it = tracks.begin(); it != tracks.end(); ++it)
-		if (!it->second->inactive && !it->second->hidden)
-			res.push_back(*it->second);
-	return res;
+	return getSnapshot()->visible[type];
 }
 
-std::vector<Track> Manager::getVideoTracks()
+const std::vector<Track> &Manager::getVideoTracks()
 {
-	return getTracks(videoTracks);
+	return getTracks(TRACK_VIDEO);
 }
 
-std::vector<Track> Manager::getAudioTracks()
+const std::vector<Track> &Manager::getAudioTracks()
 {
-	return getTracks(audioTracks);
+	return getTracks(TRACK_AUDIO);
 }
 
-std::vector<Track> Manager::getSubtitleTracks()
+const std::vector<Track> &Manager::getSubtitleTracks()
 {
-	return getTracks(subtitleTracks);
+	return getTracks(TRACK_SUBTITLE);
 }
 
-std::vector<Track> Manager::getTeletextTracks()
+const std::vector<Track> &Manager::getTeletextTracks()
 {
-	return getTracks(teletextTracks);
+	return getTracks(TRACK_TELETEXT);
 }
 
-Track *Manager::getTrack(std::map<int,Track*> &tracks, int pid)
+const Track *Manager::getTrack(int type, int pid)
 {
-	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
-	std::map<int,Track*>::iterator it = tracks.find(pid);
-	if (it != tracks.end() && !it->second->inactive)
-		return it->second;
+	const TrackSnapshot *s = getSnapshot();
+	std::map<int,Track>::const_iterator it = s->tracks[type].find(pid);
+	if (it != s->tracks[type].end() && !it->second.inactive)
+		return &it->second;
 	return NULL;
 }
-Track *Manager::getVideoTrack(int pid)
+
+const Track *Manager::getVideoTrack(int pid)
 {
-	return getTrack(videoTracks, pid);
+	return getTrack(TRACK_VIDEO, pid);
 }
 
-Track *Manager::getAudioTrack(int pid)
+const Track *Manager::getAudioTrack(int pid)
 {
-	return getTrack(audioTracks, pid);
+	return getTrack(TRACK_AUDIO, pid);
 }
 
-Track *Manager::getSubtitleTrack(int pid)
+const Track *Manager::getSubtitleTrack(int pid)
 {
-	return getTrack(subtitleTracks, pid);
+	return getTrack(TRACK_SUBTITLE, pid);
 }
 
-Track *Manager::getTeletextTrack(int pid)
+const Track *Manager::getTeletextTrack(int pid)
 {
-	return getTrack(teletextTracks, pid);
+	return getTrack(TRACK_TELETEXT, pid);
 }
 
+/* the tracks that are added until commitTrackUpdate() are published at once */
 bool Manager::initTrackUpdate()
 {
 	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
-
-	for (std::map<int,Track*>::iterator it = audioTracks.begin(); it != audioTracks.end(); ++it)
-		it->second->inactive = !it->second->is_static;
-
-	for (std::map<int, Track*>::iterator it = videoTracks.begin(); it != videoTracks.end(); ++it)
-		it->second->inactive = !it->second->is_static;
-
-	for (std::map<int,Track*>::iterator it = subtitleTracks.begin(); it != subtitleTracks.end(); ++it)
-		it->second->inactive = !it->second->is_static;
-
-	for (std::map<int,Track*>::iterator it = teletextTracks.begin(); it != teletextTracks.end(); ++it)
-		it->second->inactive = !it->second->is_static;
-
+	for (int t = 0; t < TRACK_TYPES; t++)
+		for (std::map<int,Track>::iterator it = work.tracks[t].begin(); it != work.tracks[t].end(); ++it)
+			it->second.inactive = !it->second.is_static;
+	updating = true;
 	return true;
 }
 
+void Manager::commitTrackUpdate()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	updating = false;
+	publish();
+}
+
 void Manager::addProgram(Program &program)
 {
-	Programs[program.id] = program;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	work.programs[program.id] = program;
+	if (!updating)
+		publish();
 }
 
 std::vector<Program> Manager::getPrograms(void)
 {
-	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	const TrackSnapshot *s = getSnapshot();
 	std::vector<Program> res;
-	for (std::map<int,Program>::iterator it = Programs.begin(); it != Programs.end(); ++it)
+	for (std::map<int,Program>::const_iterator it = s->programs.begin(); it != s->programs.end(); ++it)
 		res.push_back(it->second);
 	return res;
 }
 
-bool Manager::selectProgram(const int id)
-{
-	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
-	std::map<int,Program>::iterator i = Programs.find(id);
-	if (i != Programs.end()) {
-
-		// mark all tracks as hidden
-		for (std::map<int,Track*>::iterator it = audioTracks.begin(); it != audioTracks.end(); ++it)
-			it->second->hidden = true;
-
-		for (std::map<int, Track*>::iterator it = videoTracks.begin(); it != videoTracks.end(); ++it)
-			it->second->hidden = true;
-
-		for (std::map<int,Track*>::iterator it = subtitleTracks.begin(); it != subtitleTracks.end(); ++it)
-			it->second->hidden = true;
-
-		for (std::map<int,Track*>::iterator it = teletextTracks.begin(); it != teletextTracks.end(); ++it)
-			it->second->hidden = true;
-
-		// unhide tracks that are part of the selected program
-		for (unsigned int j = 0; j < i->second.streams.size(); j++) {
-			AVStream *stream = i->second.streams[j];
-			bool h = true;
-			for (std::map<int,Track*>::iterator it = audioTracks.begin(); h && (it != audioTracks.end()); ++it)
-				if (stream == it->second->stream)
-					h = it->second->hidden = false;
-
-			if (!h)
-				continue;
-
-			for (std::map<int, Track*>::iterator it = videoTracks.begin(); h && (it != videoTracks.end()); ++it)
-				if (stream == it->second->stream)
-					h = it->second->hidden = false;
-
-			if (!h)
-				continue;
-
-			for (std::map<int,Track*>::iterator it = subtitleTracks.begin(); h && (it != subtitleTracks.end()); ++it)
-				if (stream == it->second->stream)
-					h = it->second->hidden = false;
+/* seamless: keep the decoders running if the codecs don't change, for
+   switching between variants of the same stream */
+bool Manager::selectProgram(const int id, bool seamless)
+{
+	const TrackSnapshot *s;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		std::map<int,Program>::iterator i = work.programs.find(id);
+		if (i == work.programs.end())
+			return false;
+
+		// hide the tracks that are not part of the selected program
+		std::set<AVStream *> streams(i->second.streams.begin(), i->second.streams.end());
+		for (int t = 0; t < TRACK_TYPES; t++)
+			for (std::map<int,Track>::iterator it = work.tracks[t].begin(); it != work.tracks[t].end(); ++it)
+				it->second.hidden = !streams.count(it->second.stream);
+		publish();
+		s = current;
+	}
 
-			if (!h)
+	// tell ffmpeg what we're interested in
+	for (int t = 0; t < TRACK_TYPES; t++)
+		for (std::map<int,Track>::const_iterator it = s->tracks[t].begin(); it != s->tracks[t].end(); ++it) {
+			const Track *track = &it->second;
+			if (track->hidden || track->inactive) {
+				if (track->stream)
+					track->stream->discard = AVDISCARD_ALL;
 				continue;
-
-			for (std::map<int,Track*>::iterator it = teletextTracks.begin(); h && (it != teletextTracks.end()); ++it)
-				if (stream == it->second->stream)
-					h = it->second->hidden = false;
-		}
-
-		// tell ffmpeg what we're interested in
-		for (std::map<int,Track*>::iterator it = audioTracks.begin(); it != audioTracks.end(); ++it)
-			if (it->second->hidden || it->second->inactive) {
-				it->second->stream->discard = AVDISCARD_ALL;
-			} else {
-				it->second->stream->discard = AVDISCARD_NONE;
-				player->input.SwitchAudio(it->second);
-			}
-
-		for (std::map<int, Track*>::iterator it = videoTracks.begin(); it != videoTracks.end(); ++it)
-			if (it->second->hidden || it->second->inactive) {
-				it->second->stream->discard = AVDISCARD_ALL;
-			} else {
-				it->second->stream->discard = AVDISCARD_NONE;
-				player->input.SwitchVideo(it->second);
-			}
-
-		for (std::map<int,Track*>::iterator it = subtitleTracks.begin(); it != subtitleTracks.end(); ++it)
-			if (it->second->hidden || it->second->inactive) {
-				it->second->stream->discard = AVDISCARD_ALL;
-			} else {
-				it->second->stream->discard = AVDISCARD_NONE;
-				player->input.SwitchSubtitle(it->second);
 			}
-
-		for (std::map<int,Track*>::iterator it = teletextTracks.begin(); it != teletextTracks.end(); ++it)
-			if (it->second->hidden || it->second->inactive) {
-				it->second->stream->discard = AVDISCARD_ALL;
-			} else {
-				it->second->stream->discard = AVDISCARD_NONE;
-				player->input.SwitchTeletext(it->second);
+			track->stream->discard = AVDISCARD_NONE;
+			switch (t) {
+				case TRACK_VIDEO:
+					player->input.SwitchVideo(track, seamless);
+					break;
+				case TRACK_AUDIO:
+					player->input.SwitchAudio(track, seamless);
+					break;
+				case TRACK_SUBTITLE:
+					player->input.SwitchSubtitle(track);
+					break;
+				case TRACK_TELETEXT:
+					player->input.SwitchTeletext(track);
+					break;
 			}
-
-		return true;
-	}
-	return false;
+		}
+	return true;
 }
 
+/* Readers may still be using the snapshots of this playback, those of
+   the one before are freed */
 void Manager::clearTracks()
 {
 	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
-
-	for (std::map<int,Track*>::iterator it = audioTracks.begin(); it != audioTracks.end(); ++it)
-		delete it->second;
-	audioTracks.clear();
-
-	for (std::map<int, Track*>::iterator it = videoTracks.begin(); it != videoTracks.end(); ++it)
-		delete it->second;
-	videoTracks.clear();
-
-	for (std::map<int,Track*>::iterator it = subtitleTracks.begin(); it != subtitleTracks.end(); ++it)
-		delete it->second;
-	subtitleTracks.clear();
-
-	for (std::map<int,Track*>::iterator it = teletextTracks.begin(); it != teletextTracks.end(); ++it)
-		delete it->second;
-	teletextTracks.clear();
-
-	Programs.clear();
+	for (std::vector<TrackSnapshot *>::iterator it = expired.begin(); it != expired.end(); ++it)
+		delete *it;
+	expired.swap(retired);
+	retired.clear();
+	work = TrackSnapshot();
+	updating = false;
+	publish();
 }
 
 Manager::~Manager()
 {
 	clearTracks();
+	for (std::vector<TrackSnapshot *>::iterator it = expired.begin(); it != expired.end(); ++it)
+		delete *it;
+	for (std::vector<TrackSnapshot *>::iterator it = retired.begin(); it != retired.end(); ++it)
+		delete *it;
+	delete current;
 }
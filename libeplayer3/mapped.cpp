@@ -0,0 +1,254 @@
+/*
+ * memory mapped reading of local files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "mapped.h"
+
+/* f_type of the network and user space file systems */
+static const long remote_fs[] = {
+	0x6969,		/* NFS */
+	0x517b,		/* SMB */
+	0xff534d42,	/* CIFS */
+	0xfe534d42,	/* SMB2 */
+	0x65735546,	/* FUSE */
+	0
+};
+
+/* A page of the mapping that can't be read, because of a bad sector, an
+   unplugged disk or a file that has been truncated, raises SIGBUS instead
+   of failing a read(). While a thread copies from its mapping, the handler
+   jumps back to Read(), which fails with EIO. Other faults go to the
+   previous handler */
+static __thread sigjmp_buf *volatile fault_jmp;
+static __thread const uint8_t *fault_start, *fault_end;
+static struct sigaction prev_sigbus;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+
+static void sigbus_handler(int sig, siginfo_t *si, void *ctx)
+{
+	const uint8_t *addr = (const uint8_t *) si->si_addr;
+	if (fault_jmp && addr >= fault_start && addr < fault_end)
+		siglongjmp(*fault_jmp, 1);
+	if (prev_sigbus.sa_flags & SA_SIGINFO)
+		prev_sigbus.sa_sigaction(sig, si, ctx);
+	else if (prev_sigbus.sa_handler != SIG_DFL && prev_sigbus.sa_handler != SIG_IGN)
+		prev_sigbus.sa_handler(sig);
+	else
+		/* the fault recurs on return, with the default action */
+		sigaction(SIGBUS, &prev_sigbus, NULL);
+}
+
+static void install_sigbus_handler()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sigbus_handler;
+	/* not blocked in the handler, so siglongjmp() needn't restore the mask */
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &prev_sigbus);
+}
+
+MappedFile::MappedFile()
+{
+	fd = -1;
+	size = 0;
+	map = NULL;
+	mapStart = 0;
+	mapLength = 0;
+	pos = 0;
+	readAhead = false;
+	avio = NULL;
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+/* fails if the file should be read through the file protocol */
+bool MappedFile::Open(const char *path)
+{
+	Close();
+
+	const char *tmp = getenv("EPLAYER3_MMAP");
+	if (tmp && !atoi(tmp))
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	struct statfs sfs;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size || fstatfs(fd, &sfs)) {
+		Close();
+		return false;
+	}
+	for (int i = 0; remote_fs[i]; i++)
+		if ((unsigned long) sfs.f_type == (unsigned long) remote_fs[i]) {
+			Close();
+			return false;
+		}
+	size = st.st_size;
+	pos = 0;
+	pthread_once(&sigbus_once, install_sigbus_handler);
+	if (!Map(0)) {
+		Close();
+		return false;
+	}
+
+	unsigned char *buffer = (unsigned char *) av_malloc(MAPPED_CHUNK);
+	if (buffer)
+		avio = avio_alloc_context(buffer, MAPPED_CHUNK, 0, this, read_cb, NULL, seek_cb);
+	if (!avio) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		av_free(buffer);
+		Close();
+		return false;
+	}
+	avio->seekable = AVIO_SEEKABLE_NORMAL;
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (avio) {
+		av_freep(&avio->buffer);
+		av_freep(&avio);
+	}
+	Unmap();
+	if (fd > -1) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+void MappedFile::Unmap()
+{
+	if (map)
+		munmap(map, mapLength);
+	map = NULL;
+	mapLength = 0;
+}
+
+/* maps the window that starts at the page of at */
+bool MappedFile::Map(int64_t at)
+{
+	Unmap();
+	static const int64_t page = sysconf(_SC_PAGESIZE);
+	mapStart = at & ~(page - 1);
+	int64_t len = size - mapStart;
+	if (len > MAPPED_WINDOW)
+		len = MAPPED_WINDOW;
+	if (len <= 0)
+		return false;
+	void *m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, mapStart);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %m\n", __func__);
+		return false;
+	}
+	map = (uint8_t *) m;
+	mapLength = len;
+	madvise(map, mapLength, MADV_SEQUENTIAL);
+	madvise(map, mapLength, MADV_WILLNEED);
+	readAhead = false;
+	return true;
+}
+
+int MappedFile::Read(uint8_t *buf, int buf_size)
+{
+	if (pos >= size)
+		return AVERROR_EOF;
+	if (pos < mapStart || pos >= mapStart + (int64_t) mapLength) {
+		if (!Map(pos))
+			return AVERROR(EIO);
+	}
+	int64_t n = mapStart + mapLength - pos;
+	if (n > buf_size)
+		n = buf_size;
+	const uint8_t *src = map + (pos - mapStart);
+	sigjmp_buf env;
+	if (sigsetjmp(env, 0)) {
+		fault_jmp = NULL;
+		fprintf(stderr, "%s: I/O error at %lld\n", __func__, (long long) pos);
+		Unmap();
+		return AVERROR(EIO);
+	}
+	fault_start = map;
+	fault_end = map + mapLength;
+	fault_jmp = &env;
+	/* the copy must not be moved out of the guarded section */
+	__asm__ __volatile__("" ::: "memory");
+	memcpy(buf, src, n);
+	__asm__ __volatile__("" ::: "memory");
+	fault_jmp = NULL;
+	pos += n;
+
+	/* half way through the window, have the kernel read the next one */
+	if (!readAhead && pos - mapStart > (int64_t) mapLength / 2) {
+		int64_t next = mapStart + mapLength;
+		if (next < size)
+			posix_fadvise(fd, next, MAPPED_WINDOW, POSIX_FADV_WILLNEED);
+		readAhead = true;
+	}
+	return n;
+}
+
+int64_t MappedFile::Seek(int64_t offset, int whence)
+{
+	switch (whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return size;
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += pos;
+			break;
+		case SEEK_END:
+			offset += size;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+	if (offset < 0)
+		return AVERROR(EINVAL);
+	pos = offset;
+	return pos;
+}
+
+int MappedFile::read_cb(void *opaque, uint8_t *buf, int buf_size)
+{
+	return ((MappedFile *) opaque)->Read(buf, buf_size);
+}
+
+int64_t MappedFile::seek_cb(void *opaque, int64_t offset, int whence)
+{
+	return ((MappedFile *) opaque)->Seek(offset, whence);
+}
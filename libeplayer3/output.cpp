@@ -34,6 +34,7 @@
 #include <memory.h>
 #include <asm/types.h>
 #include <pthread.h>
+#include <sys/prctl.h>
 #include <errno.h>
 
 #include "player.h"
@@ -41,6 +42,7 @@
 #include "writer.h"
 #include "misc.h"
 #include "pes.h"
+#include "pool.h"
 
 #define dioctl(fd,req,arg) ({		\
 	int _r = ioctl(fd,req,arg); \
@@ -49,6 +51,11 @@
 	_r; \
 })
 
+/* upper bounds of the write latency buckets in StreamTelemetry, us */
+static const int64_t latencyLimit[TELEMETRY_LATENCY_BUCKETS - 1] = {
+	1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000
+};
+
 #define VIDEODEV "/dev/dvb/adapter0/video0"
 #define AUDIODEV "/dev/dvb/adapter0/audio0"
 
@@ -57,6 +64,16 @@ Output::Output()
 	videofd = audiofd = -1;
 	videoWriter = audioWriter = NULL;
 	videoStream = audioStream = NULL;
+	videoWriterStream = audioWriterStream = NULL;
+
+	videoQueue.bytes = audioQueue.bytes = 0;
+	videoQueue.generation = audioQueue.generation = 0;
+	videoQueue.running = audioQueue.running = false;
+	videoQueue.busy = audioQueue.busy = false;
+	videoQueue.draining = audioQueue.draining = false;
+	videoQueue.joinable = audioQueue.joinable = false;
+
+	clock.Init(sample_cb, this);
 }
 
 Output::~Output()
@@ -100,6 +117,8 @@ bool Output::Close()
 {
 	Stop();
 
+	OpenThreads::ScopedLock<OpenThreads::Mutex> vw_lock(videoWriteMutex);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> aw_lock(audioWriteMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
 
@@ -114,6 +133,8 @@ bool Output::Close()
 
 	videoStream = NULL;
 	audioStream = NULL;
+	videoWriterStream = NULL;
+	audioWriterStream = NULL;
 
 	return true;
 }
@@ -122,6 +143,8 @@ bool Output::Play()
 {
 	bool ret = true;
 
+	OpenThreads::ScopedLock<OpenThreads::Mutex> vw_lock(videoWriteMutex);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> aw_lock(audioWriteMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
 
@@ -130,6 +153,7 @@ bool Output::Play()
 	if (videoStream && videofd > -1 && (avcc = videoStream->codec)) {
 		videoWriter = Writer::GetWriter(avcc->codec_id, avcc->codec_type);
 		videoWriter->Init(videofd, videoStream, player);
+		videoWriterStream = videoStream;
 		if (dioctl(videofd, VIDEO_SET_ENCODING, videoWriter->GetVideoEncoding(avcc->codec_id))
 		||  dioctl(videofd, VIDEO_PLAY, NULL))
 			ret = false;
@@ -138,36 +162,55 @@ bool Output::Play()
 	if (audioStream && audiofd > -1 && (avcc = audioStream->codec)) {
 		audioWriter = Writer::GetWriter(avcc->codec_id, avcc->codec_type);
 		audioWriter->Init(audiofd, audioStream, player);
+		audioWriterStream = audioStream;
 		if (dioctl(audiofd, AUDIO_SET_ENCODING, audioWriter->GetAudioEncoding(avcc->codec_id))
 		||  dioctl(audiofd, AUDIO_PLAY, NULL))
 			ret = false;
 	}
+
+	StartQueue(videoQueue, true);
+	StartQueue(audioQueue, false);
+
+	clock.SetRate(CLOCK_RATE_NORMAL);
+	clock.Invalidate();
+
 	return ret;
 }
 
+/* the writer threads are joined after the devices have been cleared, which
+   releases a write that is blocked in the driver */
 bool Output::Stop()
 {
 	bool ret = true;
 
-	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
-	OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
+	StopQueue(videoQueue);
+	StopQueue(audioQueue);
+	clock.Invalidate();
 
-	if (videofd > -1) {
-		ioctl(videofd, VIDEO_CLEAR_BUFFER, NULL);
-		/* set back to normal speed (end trickmodes) */
-		dioctl(videofd, VIDEO_SET_SPEED, DVB_SPEED_NORMAL_PLAY);
-		if (dioctl(videofd, VIDEO_STOP, NULL))
-			ret = false;
-	}
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
+		OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
 
-	if (audiofd > -1) {
-		ioctl(audiofd, AUDIO_CLEAR_BUFFER, NULL);
-		/* set back to normal speed (end trickmodes) */
-		dioctl(audiofd, AUDIO_SET_SPEED, DVB_SPEED_NORMAL_PLAY);
-		if (dioctl(audiofd, AUDIO_STOP, NULL))
-			ret = false;
+		if (videofd > -1) {
+			ioctl(videofd, VIDEO_CLEAR_BUFFER, NULL);
+			/* set back to normal speed (end trickmodes) */
+			dioctl(videofd, VIDEO_SET_SPEED, DVB_SPEED_NORMAL_PLAY);
+			if (dioctl(videofd, VIDEO_STOP, NULL))
+				ret = false;
+		}
+
+		if (audiofd > -1) {
+			ioctl(audiofd, AUDIO_CLEAR_BUFFER, NULL);
+			/* set back to normal speed (end trickmodes) */
+			dioctl(audiofd, AUDIO_SET_SPEED, DVB_SPEED_NORMAL_PLAY);
+			if (dioctl(audiofd, AUDIO_STOP, NULL))
+				ret = false;
+		}
 	}
 
+	JoinQueue(videoQueue);
+	JoinQueue(audioQueue);
+
 	return ret;
 }
 
@@ -188,6 +231,8 @@ bool Output::Pause()
 			ret = false;
 	}
 
+	clock.SetRate(0);
+
 	return ret;
 }
 
@@ -204,6 +249,8 @@ bool Output::Continue()
 	if (audiofd > -1 && dioctl(audiofd, AUDIO_CONTINUE, NULL))
 		ret = false;
 
+	clock.SetRate(CLOCK_RATE_NORMAL);
+
 	return ret;
 }
 
@@ -219,6 +266,10 @@ bool Output::Flush()
 {
 	bool ret = true;
 
+	DrainQueue(videoQueue);
+	DrainQueue(audioQueue);
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> aw_lock(audioWriteMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
 
@@ -241,12 +292,14 @@ bool Output::Flush()
 
 bool Output::FastForward(int speed)
 {
+	clock.SetRate(speed * CLOCK_RATE_NORMAL);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	return videofd > -1 && !dioctl(videofd, VIDEO_FAST_FORWARD, speed);
 }
 
 bool Output::SlowMotion(int speed)
 {
+	clock.SetRate(speed ? CLOCK_RATE_NORMAL / speed : CLOCK_RATE_NORMAL);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	return videofd > -1 && !dioctl(videofd, VIDEO_SLOWMOTION, speed);
 }
@@ -259,12 +312,16 @@ bool Output::AVSync(bool b)
 
 bool Output::ClearAudio()
 {
+	ClearQueue(audioQueue);
+	clock.Invalidate();
 	OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
 	return audiofd > -1 && !ioctl(audiofd, AUDIO_CLEAR_BUFFER, NULL);
 }
 
 bool Output::ClearVideo()
 {
+	ClearQueue(videoQueue);
+	clock.Invalidate();
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	return videofd > -1 && !ioctl(videofd, VIDEO_CLEAR_BUFFER, NULL);
 }
@@ -276,35 +333,105 @@ bool Output::Clear()
 	return aret && vret;
 }
 
-bool Output::GetPts(int64_t &pts)
+bool Output::sample_cb(void *opaque, int64_t &pts, int64_t &frameCount)
 {
+	Output *output = (Output *) opaque;
+	int videofd = output->videofd, audiofd = output->audiofd;
+	dvb_play_info_t playInfo;
+
+	frameCount = -1;
+	if ((videofd > -1 && !dioctl(videofd, VIDEO_GET_PLAY_INFO, (void *) &playInfo)) ||
+	    (audiofd > -1 && !dioctl(audiofd, AUDIO_GET_PLAY_INFO, (void *) &playInfo)))
+		frameCount = playInfo.frame_count;
+
 	pts = 0;
 	return ((videofd > -1 && !ioctl(videofd, VIDEO_GET_PTS, (void *) &pts)) ||
 		(audiofd > -1 && !ioctl(audiofd, AUDIO_GET_PTS, (void *) &pts)));
 }
 
+/* both come from the playback clock, which asks the device only now and then */
+bool Output::GetPts(int64_t &pts)
+{
+	if (clock.GetPts(pts))
+		return true;
+	pts = 0;
+	return false;
+}
+
 bool Output::GetFrameCount(int64_t &framecount)
 {
-	dvb_play_info_t playInfo;
+	return clock.GetFrameCount(framecount);
+}
 
-	if ((videofd > -1 && !dioctl(videofd, VIDEO_GET_PLAY_INFO, (void *) &playInfo)) ||
-	    (audiofd > -1 && !dioctl(audiofd, AUDIO_GET_PLAY_INFO, (void *) &playInfo))) {
-		framecount = playInfo.frame_count;
-		return true;
+/* packets the demux thread did not queue */
+void Output::Dropped(AVStream *stream)
+{
+	OutputQueue &q = (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO) ? videoQueue : audioQueue;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+	q.stats.dropped++;
+}
+
+/* ms from b to a, PTS wrap around taken into account */
+static int64_t ptsdiff(int64_t a, int64_t b)
+{
+	int64_t d = (a - b) & 0x1ffffffffLL;
+	if (d > 0xffffffffLL)
+		d -= 0x200000000LL;
+	return d / 90;
+}
+
+/* the counters are copied, only the device play info is read now */
+void Output::GetTelemetry(PlaybackTelemetry &t)
+{
+	OutputQueue *q[2] = { &videoQueue, &audioQueue };
+	StreamTelemetry *st[2] = { &t.video, &t.audio };
+	int fd[2] = { videofd, audiofd };
+	unsigned long req[2] = { VIDEO_GET_PLAY_INFO, AUDIO_GET_PLAY_INFO };
+
+	for (int i = 0; i < 2; i++) {
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q[i]->mutex);
+			*st[i] = q[i]->stats;
+			st[i]->queuedMs = q[i]->Duration();
+			st[i]->queuedBytes = q[i]->bytes;
+		}
+		dvb_play_info_t playInfo;
+		st[i]->presentedPts = INVALID_PTS_VALUE;
+		st[i]->frameCount = -1;
+		if (fd[i] > -1 && !ioctl(fd[i], req[i], (void *) &playInfo)) {
+			st[i]->presentedPts = playInfo.pts & 0x1ffffffffLL;
+			st[i]->frameCount = playInfo.frame_count;
+		}
+		st[i]->lead = 0;
+		if (st[i]->injectedPts != INVALID_PTS_VALUE && st[i]->presentedPts != INVALID_PTS_VALUE)
+			st[i]->lead = ptsdiff(st[i]->injectedPts, st[i]->presentedPts);
 	}
-	return false;
+
+	t.avDrift = 0;
+	if (t.video.presentedPts != INVALID_PTS_VALUE && t.audio.presentedPts != INVALID_PTS_VALUE)
+		t.avDrift = ptsdiff(t.video.presentedPts, t.audio.presentedPts);
 }
 
-bool Output::SwitchAudio(AVStream *stream)
+bool Output::SwitchAudio(AVStream *stream, bool seamless)
 {
+	OpenThreads::ScopedLock<OpenThreads::Mutex> aw_lock(audioWriteMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
 	if (stream == audioStream)
 		return true;
-	if (audiofd > -1) {
+	/* the decoder plays on, the new stream continues where the old one ends */
+	bool keep = seamless && audioStream && stream && audioStream->codec && stream->codec
+		&& audioStream->codec->codec_id == stream->codec->codec_id;
+	if (audiofd > -1 && !keep) {
 		dioctl(audiofd, AUDIO_STOP, NULL);
 		ioctl(audiofd, AUDIO_CLEAR_BUFFER, NULL);
 	}
 	audioStream = stream;
+	/* a seamless switch is done by the writer thread, when it gets to the
+	   first packet of the new stream. The old one's queued packets are
+	   still written */
+	if (keep)
+		return true;
+	audioWriterStream = stream;
 	if (stream) {
 		AVCodecContext *avcc = stream->codec;
 		if (!avcc)
@@ -319,16 +446,24 @@ bool Output::SwitchAudio(AVStream *stream)
 	return true;
 }
 
-bool Output::SwitchVideo(AVStream *stream)
+bool Output::SwitchVideo(AVStream *stream, bool seamless)
 {
+	OpenThreads::ScopedLock<OpenThreads::Mutex> vw_lock(videoWriteMutex);
 	OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
 	if (stream == videoStream)
 		return true;
-	if (videofd > -1) {
+	/* the decoder plays on, the new stream continues where the old one ends */
+	bool keep = seamless && videoStream && stream && videoStream->codec && stream->codec
+		&& videoStream->codec->codec_id == stream->codec->codec_id;
+	if (videofd > -1 && !keep) {
 		dioctl(videofd, VIDEO_STOP, NULL);
 		ioctl(videofd, VIDEO_CLEAR_BUFFER, NULL);
 	}
 	videoStream = stream;
+	/* see SwitchAudio() */
+	if (keep)
+		return true;
+	videoWriterStream = stream;
 	if (stream) {
 		AVCodecContext *avcc = stream->codec;
 		if (!avcc)
@@ -343,18 +478,310 @@ bool Output::SwitchVideo(AVStream *stream)
 	return true;
 }
 
+/* hands the packet over to the writer thread of the stream. On success,
+   the queue owns the data and *packet is reset. A NULL packet is passed
+   on as is, e.g. to restart the audio resampling */
 bool Output::Write(AVStream *stream, AVPacket *packet, int64_t pts)
 {
 	switch (stream->codec->codec_type) {
-		case AVMEDIA_TYPE_VIDEO: {
-			OpenThreads::ScopedLock<OpenThreads::Mutex> v_lock(videoMutex);
-			return videofd > -1 && videoWriter && videoWriter->Write(packet, pts);
-		}
-		case AVMEDIA_TYPE_AUDIO: {
-			OpenThreads::ScopedLock<OpenThreads::Mutex> a_lock(audioMutex);
-			return audiofd > -1 && audioWriter && audioWriter->Write(packet, pts);
-		}
+		case AVMEDIA_TYPE_VIDEO:
+			return Enqueue(videoQueue, audioQueue, stream, packet, pts);
+		case AVMEDIA_TYPE_AUDIO:
+			return Enqueue(audioQueue, videoQueue, stream, packet, pts);
 		default:
 			return false;
 	}
 }
+
+bool Output::GetQueueFill(int64_t &videoMs, size_t &videoBytes, int64_t &audioMs, size_t &audioBytes)
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(videoQueue.mutex);
+		videoMs = videoQueue.Duration();
+		videoBytes = videoQueue.bytes;
+	}
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(audioQueue.mutex);
+		audioMs = audioQueue.Duration();
+		audioBytes = audioQueue.bytes;
+	}
+	return videoQueue.running || audioQueue.running;
+}
+
+/* time span of the queued packets, 0 if unknown. Called with q.mutex held */
+int64_t OutputQueue::Duration()
+{
+	std::deque<QueueEntry>::iterator first = entries.begin();
+	while (first != entries.end() && first->time == AV_NOPTS_VALUE)
+		++first;
+	if (first == entries.end())
+		return 0;
+	std::deque<QueueEntry>::reverse_iterator last = entries.rbegin();
+	while (last->time == AV_NOPTS_VALUE)
+		++last;
+	int64_t d = last->time - first->time;
+	return (d < 0) ? 0 : d;	/* discontinuity, only the byte limit applies */
+}
+
+bool Output::Enqueue(OutputQueue &q, OutputQueue &other, AVStream *stream, AVPacket *packet, int64_t pts)
+{
+	QueueEntry e;
+	e.stream = stream;
+	e.pts = pts;
+	e.time = AV_NOPTS_VALUE;
+	e.reset = !packet;
+	av_init_packet(&e.packet);
+	e.packet.data = NULL;
+	e.packet.size = 0;
+
+	if (packet) {
+		int64_t t = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+		if (t != AV_NOPTS_VALUE)
+			e.time = av_rescale_q(t, stream->time_base, (AVRational) { 1, 1000 });
+		/* the data must stay valid after the next av_read_frame(). The
+		   demuxer's buffer is queued as it is, unless the heap has become
+		   fragmented: then the copy goes to the pool and the demuxer's
+		   buffer is freed right away. EPLAYER3_ZEROCOPY overrides this */
+		int zc = player->input.zeroCopy;
+		bool reference = (zc > -1) ? zc : !BufferPool::Fragmented();
+		if (!BufferPool::MovePacket(&e.packet, packet, reference)) {
+			OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+			q.stats.dropped++;
+			return false;
+		}
+	}
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+	bool waited = false;
+	for (;;) {
+		if (!q.running || !player->isPlaying || player->abortRequested) {
+			if (packet)
+				q.stats.dropped++;
+			av_free_packet(&e.packet);
+			return false;
+		}
+		/* don't block while the other queue is empty: the decoders may
+		   be waiting for each other because of AV sync */
+		bool full = q.bytes >= 2 * QUEUE_MAX_BYTES ||
+			((q.Duration() >= QUEUE_MAX_TIME || q.bytes >= QUEUE_MAX_BYTES) && other.bytes > 0);
+		if (!full)
+			break;
+		if (!waited)
+			q.stats.overruns++;
+		waited = true;
+		/* the timeout is for the other queue, which we can't wait for */
+		q.cond.wait(&q.mutex, 100);
+	}
+
+	q.entries.push_back(e);
+	q.bytes += e.packet.size;
+	q.cond.broadcast();
+	return true;
+}
+
+void Output::StartQueue(OutputQueue &q, bool video)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+	if (q.running)
+		return;
+	q.running = true;
+	memset(&q.stats, 0, sizeof(q.stats));
+	q.stats.injectedPts = INVALID_PTS_VALUE;
+	int err = pthread_create(&q.thread, NULL, video ? videoThread : audioThread, this);
+	if (err) {
+		fprintf(stderr, "%s %s %d: pthread_create: %d (%s)\n", __FILE__, __func__, __LINE__, err, strerror(err));
+		q.running = false;
+	}
+}
+
+/* tells the writer thread to end, JoinQueue() waits for it */
+void Output::StopQueue(OutputQueue &q)
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+		if (!q.running)
+			return;
+		q.running = false;
+		q.joinable = true;
+	}
+	ClearQueue(q);
+}
+
+void Output::JoinQueue(OutputQueue &q)
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+		if (!q.joinable)
+			return;
+		q.joinable = false;
+	}
+	pthread_join(q.thread, NULL);
+}
+
+/* drops everything that is queued. A packet that the writer thread has
+   already taken is dropped as well, because the generation has changed */
+void Output::ClearQueue(OutputQueue &q)
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+		q.generation++;
+		for (std::deque<QueueEntry>::iterator it = q.entries.begin(); it != q.entries.end(); ++it) {
+			if (!it->reset)
+				q.stats.cleared++;
+			av_free_packet(&it->packet);
+		}
+		q.entries.clear();
+		q.bytes = 0;
+		q.cond.broadcast();
+	}
+	/* a writer waiting for the end of a pause checks q.running */
+	OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(player->stateMutex);
+	player->stateCond.broadcast();
+}
+
+/* waits until everything that is queued has been written, e.g. at EOF */
+void Output::DrainQueue(OutputQueue &q)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+	q.draining = true;
+	while (q.running && (!q.entries.empty() || q.busy) && !player->abortRequested)
+		q.cond.wait(&q.mutex, 100);
+	q.draining = false;
+}
+
+void *Output::videoThread(void *arg)
+{
+	char threadname[17];
+	strncpy(threadname, __func__, sizeof(threadname));
+	threadname[16] = 0;
+	prctl(PR_SET_NAME, (unsigned long) threadname);
+
+	Output *output = (Output *) arg;
+	output->WriterThread(output->videoQueue, true);
+	return NULL;
+}
+
+void *Output::audioThread(void *arg)
+{
+	char threadname[17];
+	strncpy(threadname, __func__, sizeof(threadname));
+	threadname[16] = 0;
+	prctl(PR_SET_NAME, (unsigned long) threadname);
+
+	Output *output = (Output *) arg;
+	output->WriterThread(output->audioQueue, false);
+	return NULL;
+}
+
+/* a slow device write or audio resampling only stalls this thread, the
+   demux thread and the other stream keep going. Nothing is written while
+   paused, the queue is kept for Continue() */
+void Output::WriterThread(OutputQueue &q, bool video)
+{
+	OpenThreads::Mutex &writeMutex = video ? videoWriteMutex : audioWriteMutex;
+	bool failed = false;
+	bool wrote = false;		/* since the queue was last empty */
+	unsigned int wroteGeneration = 0;
+
+	for (;;) {
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(player->stateMutex);
+			while (player->isPaused && player->isPlaying && q.running && !player->abortRequested)
+				player->stateCond.wait(&player->stateMutex);
+		}
+
+		QueueEntry e;
+		unsigned int generation;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+			/* not after a clear or at the end, the queue is meant to be empty then */
+			if (q.entries.empty() && wrote && wroteGeneration == q.generation && !q.draining &&
+			    player->isPlaying && !player->isPaused)
+				q.stats.underruns++;
+			if (q.entries.empty())
+				wrote = false;
+			while (q.running && q.entries.empty())
+				q.cond.wait(&q.mutex);
+			if (!q.running)
+				break;
+			e = q.entries.front();
+			q.entries.pop_front();
+			q.bytes -= e.packet.size;
+			q.busy = true;
+			generation = q.generation;
+			q.cond.broadcast();
+		}
+
+		bool ok = true;
+		bool written = false;
+		bool paused = false;
+		int64_t latency = 0, injectedPts = INVALID_PTS_VALUE;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> w_lock(writeMutex);
+			int fd = video ? videofd : audiofd;
+			Writer *&writer = video ? videoWriter : audioWriter;
+			AVStream *stream = video ? videoStream : audioStream;
+			AVStream *&writerStream = video ? videoWriterStream : audioWriterStream;
+			/* skip packets that were cleared or belong to a track that is no longer
+			   selected. Those of the previous track that were queued before a
+			   seamless switch are written until the new track's first packet */
+			bool current;
+			{
+				OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+				current = (generation == q.generation);
+				/* paused since the wait above: back to the queue */
+				if (current && player->isPaused && player->isPlaying && q.running) {
+					q.entries.push_front(e);
+					q.bytes += e.packet.size;
+					q.busy = false;
+					q.cond.broadcast();
+					paused = true;
+				}
+			}
+			if (paused)
+				continue;
+			if (current && e.stream == stream && stream != writerStream && stream->codec) {
+				writer = Writer::GetWriter(stream->codec->codec_id, stream->codec->codec_type);
+				writer->Init(fd, stream, player);
+				writerStream = stream;
+			}
+			if (current && (e.stream == stream || e.stream == writerStream)) {
+				if (!e.reset)
+					injectedPts = player->input.calcPts(e.stream, e.packet.pts);
+				latency = av_gettime();
+				ok = fd > -1 && writer && writer->Write(e.reset ? NULL : &e.packet, e.pts);
+				latency = av_gettime() - latency;
+				written = true;
+			}
+		}
+		if (!ok && !failed)
+			fprintf(stderr, "writing data to %s device failed\n", video ? "video" : "audio");
+		failed = !ok;
+
+		OpenThreads::ScopedLock<OpenThreads::Mutex> q_lock(q.mutex);
+		if (!e.reset) {
+			StreamTelemetry &st = q.stats;
+			if (!written)
+				st.cleared++;
+			else if (!ok)
+				st.writeErrors++;
+			else {
+				st.packets++;
+				st.bytes += e.packet.size;
+				int b = 0;
+				while (b < TELEMETRY_LATENCY_BUCKETS - 1 && latency >= latencyLimit[b])
+					b++;
+				st.writeLatency[b]++;
+				if (latency > st.maxWriteLatency)
+					st.maxWriteLatency = latency;
+				if (injectedPts != INVALID_PTS_VALUE)
+					st.injectedPts = injectedPts;
+				wrote = true;
+				wroteGeneration = generation;
+			}
+		}
+		av_free_packet(&e.packet);
+		q.busy = false;
+		q.cond.broadcast();
+	}
+}
@@ -29,9 +29,11 @@
 
 #include "player.h"
 #include "misc.h"
+#include "pool.h"
 
 #define cMaxSpeed_ff   128	/* fixme: revise */
 #define cMaxSpeed_fr   -320	/* fixme: revise */
+#define cStepSpeed_ff  8	/* keyframe trick play from this speed on */
 
 Player::Player()
 {
@@ -44,8 +46,39 @@ Player::Player()
 	isPlaying = false;
 	isForwarding = false;
 	isBackWard = false;
+	isStepping = false;
 	isSlowMotion = false;
 	Speed = 0;
+	stateTime = 0;
+	const char *d = getenv("EPLAYER3_DEBUG");
+	debug = d && atoi(d);
+}
+
+/* to be called after the state flags have been changed. Taking the lock
+   makes sure that a thread that just found the old state is already
+   waiting and does not miss the wakeup */
+void Player::StateChanged()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(stateMutex);
+	stateTime = av_gettime();
+	stateCond.broadcast();
+}
+
+void Player::WaitWhilePaused()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(stateMutex);
+	while (isPaused && isPlaying && !abortRequested && !input.abortPlayback)
+		stateCond.wait(&stateMutex);
+	if (debug)
+		fprintf(stderr, "%s: woken up %lld us after the state change\n", __func__, (long long)(av_gettime() - stateTime));
+}
+
+/* sleeps for up to timeout us, a state change ends the sleep early */
+void Player::WaitForStateChange(int64_t timeout)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(stateMutex);
+	if (isPlaying && !abortRequested && !input.abortPlayback)
+		stateCond.wait(&stateMutex, timeout > 1000 ? timeout / 1000 : 1);
 }
 
 void *Player::playthread(void *arg)
@@ -59,20 +92,14 @@ void *Player::playthread(void *arg)
 	player->hasThreadStarted = true;
 	player->input.Play();
 	player->hasThreadStarted = false;
+	player->StateChanged();
 	player->Stop();
 	pthread_exit(NULL);
 }
 
-bool Player::Open(const char *Url, bool _noprobe)
+static bool makeUrl(const char *Url, std::string &url, bool &isHttp)
 {
-	fprintf(stderr, "URL=%s\n", Url);
-
 	isHttp = false;
-	noprobe = _noprobe;
-	abortRequested = false;
-
-	manager.clearTracks();
-
 	if (!strncmp("mms://", Url, 6)) {
 		url = "mmst";
 		url += Url + 3;
@@ -86,19 +113,54 @@ bool Player::Open(const char *Url, bool _noprobe)
 		fprintf(stderr, "%s %s %d: Unknown stream (%s)\n", __FILE__, __func__, __LINE__, Url);
 		return false;
 	}
+	return true;
+}
+
+bool Player::Open(const char *Url, bool _noprobe)
+{
+	fprintf(stderr, "URL=%s\n", Url);
+
+	noprobe = _noprobe;
+	abortRequested = false;
+
+	manager.clearTracks();
+
+	if (!makeUrl(Url, url, isHttp))
+		return false;
 
 	return input.Init(url.c_str());
 }
 
+/* Connects to and probes the next item while the current one is still
+   playing, http streams also fill their read-ahead cache. Open() with the
+   same URL takes the prepared stream over, or waits for it if it isn't
+   ready yet. Preloading another URL or opening a different one drops it */
+bool Player::Preload(const char *Url, bool _noprobe)
+{
+	std::string u;
+	bool http;
+	if (!makeUrl(Url, u, http))
+		return false;
+	return input.Preload(u.c_str(), http, _noprobe);
+}
+
 bool Player::Close()
 {
 	isPaused = false;
 	isPlaying = false;
 	isForwarding = false;
 	isBackWard = false;
+	isStepping = false;
 	isSlowMotion = false;
 	Speed = 0;
 	url.clear();
+	StateChanged();
+
+	unsigned long requests, allocated, oversized;
+	size_t allocatedBytes;
+	BufferPool::GetStats(requests, allocated, allocatedBytes, oversized);
+	fprintf(stderr, "%s: buffer pool: %lu buffers used, %lu allocated (%zu kB), %lu oversized\n",
+		__func__, requests, allocated, allocatedBytes / 1024, oversized);
 
 	return true;
 }
@@ -116,8 +178,9 @@ bool Player::Play()
 			isPlaying = true;
 			isPaused = false;
 			isForwarding = false;
-			if (isBackWard) {
+			if (isBackWard || isStepping) {
 				isBackWard = false;
+				isStepping = false;
 				output.Mute(false);
 			}
 			isSlowMotion = false;
@@ -152,13 +215,16 @@ bool Player::Pause()
 		if (isSlowMotion)
 			output.Clear();
 
+		/* first, so that the writer threads don't start another write to
+		   the decoder that is about to freeze */
+		isPaused = true;
 		output.Pause();
 
-		isPaused = true;
 		//isPlaying  = 1;
 		isForwarding = false;
-		if (isBackWard) {
+		if (isBackWard || isStepping) {
 			isBackWard = false;
+			isStepping = false;
 			output.Mute(false);
 		}
 		isSlowMotion = false;
@@ -184,12 +250,14 @@ bool Player::Continue()
 		isPaused = false;
 		//isPlaying  = 1;
 		isForwarding = false;
-		if (isBackWard) {
+		if (isBackWard || isStepping) {
 			isBackWard = false;
+			isStepping = false;
 			output.Mute(false);
 		}
 		isSlowMotion = false;
 		Speed = 1;
+		StateChanged();
 	} else {
 		fprintf(stderr,"continue not possible\n");
 		ret = false;
@@ -206,12 +274,14 @@ bool Player::Stop()
 		isPaused = false;
 		isPlaying = false;
 		isForwarding = false;
-		if (isBackWard) {
+		if (isBackWard || isStepping) {
 			isBackWard = false;
+			isStepping = false;
 			output.Mute(false);
 		}
 		isSlowMotion = false;
 		Speed = 0;
+		StateChanged();
 
 		output.Stop();
 		input.Stop();
@@ -221,8 +291,13 @@ bool Player::Stop()
 		ret = false;
 	}
 
-	while (hasThreadStarted)
-		usleep(100000);
+	int64_t start = av_gettime();
+	OpenThreads::ScopedLock<OpenThreads::Mutex> s_lock(stateMutex);
+	if (hasThreadStarted) {
+		while (hasThreadStarted)
+			stateCond.wait(&stateMutex);
+		fprintf(stderr, "%s: play thread stopped after %lld us\n", __func__, (long long)(av_gettime() - start));
+	}
 
 	return ret;
 }
@@ -239,9 +314,19 @@ bool Player::FastForward(int speed)
 			return false;
 		}
 
+		/* above the rate the decoder can take, jump from keyframe to keyframe */
+		bool step = speed >= cStepSpeed_ff && input.keyIndex.Size() > 0;
+		if (step != isStepping) {
+			output.Clear();
+			output.Mute(step);
+		}
 		isForwarding = 1;
+		isStepping = step;
 		Speed = speed;
-		output.FastForward(speed);
+		if (step)
+			output.clock.SetRate(0);
+		else
+			output.FastForward(speed);
 	} else {
 		fprintf(stderr,"fast forward not possible\n");
 		ret = false;
@@ -286,6 +371,8 @@ bool Player::FastBackward(int speed)
 
 	if (isBackWard)
 		output.Mute(true);
+	/* the position jumps back with every seek, the clock follows the samples only */
+	output.clock.SetRate(isBackWard ? 0 : CLOCK_RATE_NORMAL);
 
 	return ret;
 }
@@ -336,27 +423,55 @@ bool Player::GetDuration(int64_t &duration)
 	return isPlaying && input.GetDuration(duration);
 }
 
+/* how much data is queued for the video and audio devices */
+bool Player::GetQueueFill(int64_t &videoMs, size_t &videoBytes, int64_t &audioMs, size_t &audioBytes)
+{
+	return output.GetQueueFill(videoMs, videoBytes, audioMs, audioBytes);
+}
+
+/* fill level and download rate of the read-ahead cache for http streams */
+bool Player::GetCacheStatus(size_t &level, int64_t &bytesPerSecond)
+{
+	return input.cache->GetStatus(level, bytesPerSecond);
+}
+
+/* how playback is going: what the queues and the devices hold, write
+   latencies, underruns and dropped packets */
+bool Player::GetTelemetry(PlaybackTelemetry &t)
+{
+	output.GetTelemetry(t);
+	t.readBytes = readCount;
+	return isPlaying;
+}
+
+/* buffers handed out by the pool for queued packets and resampled audio,
+   and how many of them had to be allocated */
+void Player::GetPoolStats(unsigned long &requests, unsigned long &allocated, size_t &allocatedBytes, unsigned long &oversized)
+{
+	BufferPool::GetStats(requests, allocated, allocatedBytes, oversized);
+}
+
 bool Player::SwitchVideo(int pid)
 {
-	Track *track = manager.getVideoTrack(pid);
+	const Track *track = manager.getVideoTrack(pid);
 	return input.SwitchVideo(track);
 }
 
 bool Player::SwitchAudio(int pid)
 {
-	Track *track = manager.getAudioTrack(pid);
+	const Track *track = manager.getAudioTrack(pid);
 	return input.SwitchAudio(track);
 }
 
 bool Player::SwitchSubtitle(int pid)
 {
-	Track *track = manager.getSubtitleTrack(pid);
+	const Track *track = manager.getSubtitleTrack(pid);
 	return input.SwitchSubtitle(track);
 }
 
 bool Player::SwitchTeletext(int pid)
 {
-	Track *track = manager.getTeletextTrack(pid);
+	const Track *track = manager.getTeletextTrack(pid);
 	return input.SwitchTeletext(track);
 }
 
@@ -369,7 +484,6 @@ bool Player::GetChapters(std::vector<int> &positions, std::vector<std::string> &
 {
 	positions.clear();
 	titles.clear();
-	input.UpdateTracks();
 	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(chapterMutex);
 	for (std::vector<Chapter>::iterator it = chapters.begin(); it != chapters.end(); ++it) {
 		positions.push_back(it->start/1000);
@@ -387,29 +501,30 @@ void Player::SetChapters(std::vector<Chapter> &Chapters)
 void Player::RequestAbort()
 {
 	abortRequested = true;
+	StateChanged();
 }
 
 int Player::GetVideoPid()
 {
-	Track *track = input.videoTrack;
+	const Track *track = input.videoTrack;
 	return track ? track->pid : 0;
 }
 
 int Player::GetAudioPid()
 {
-	Track *track = input.audioTrack;
+	const Track *track = input.audioTrack;
 	return track ? track->pid : 0;
 }
 
 int Player::GetSubtitlePid()
 {
-	Track *track = input.subtitleTrack;
+	const Track *track = input.subtitleTrack;
 	return track ? track->pid : 0;
 }
 
 int Player::GetTeletextPid()
 {
-	Track *track = input.teletextTrack;
+	const Track *track = input.teletextTrack;
 	return track ? track->pid : 0;
 }
 
@@ -433,12 +548,20 @@ bool Player::GetPrograms(std::vector<std::string> &keys, std::vector<std::string
 	return true;
 }
 
+/* an explicit selection ends the adaptive switching between HLS variants */
 bool Player::SelectProgram(int key)
 {
+	input.variants.Fix();
 	return manager.selectProgram(key);
 }
 
 bool Player::SelectProgram(std::string &key)
 {
-	return manager.selectProgram(atoi(key.c_str()));
+	return SelectProgram(atoi(key.c_str()));
+}
+
+/* the input thread switches between the variants of an HLS stream */
+bool Player::IsAdaptive()
+{
+	return input.variants.Active();
 }
@@ -0,0 +1,133 @@
+/*
+ * pooled buffers for queued packets and resampled audio
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include "pool.h"
+
+BufferPool BufferPool::pool __attribute__ ((init_priority (200)));
+
+BufferPool::BufferPool()
+{
+	for (int i = 0; i < POOL_CLASSES; i++)
+		pools[i] = av_buffer_pool_init(ClassSize(i), alloc);
+	requests = 0;
+	allocated = 0;
+	oversized = 0;
+	allocatedBytes = 0;
+	fragmented = false;
+	checkTime = 0;
+}
+
+/* buffers still in use are freed when they are returned */
+BufferPool::~BufferPool()
+{
+	for (int i = 0; i < POOL_CLASSES; i++)
+		av_buffer_pool_uninit(&pools[i]);
+}
+
+AVBufferRef *BufferPool::alloc(int size)
+{
+	AVBufferRef *buf = av_buffer_alloc(size);
+	if (buf) {
+		__sync_fetch_and_add(&pool.allocated, 1);
+		__sync_fetch_and_add(&pool.allocatedBytes, size);
+	}
+	return buf;
+}
+
+AVBufferRef *BufferPool::Get(int size)
+{
+	AVBufferRef *buf = NULL;
+	int i = 0;
+	while (i < POOL_CLASSES && ClassSize(i) < (size_t) size + FF_INPUT_BUFFER_PADDING_SIZE)
+		i++;
+	if (i < POOL_CLASSES && pool.pools[i])
+		buf = av_buffer_pool_get(pool.pools[i]);
+	else {
+		__sync_fetch_and_add(&pool.oversized, 1);
+		buf = av_buffer_alloc(size + FF_INPUT_BUFFER_PADDING_SIZE);
+	}
+	if (!buf)
+		return NULL;
+	__sync_fetch_and_add(&pool.requests, 1);
+	memset(buf->data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+	return buf;
+}
+
+bool BufferPool::MovePacket(AVPacket *dst, AVPacket *src, bool reference)
+{
+	/* side data would have to be copied, none of the writers need it */
+	if (src->side_data_elems || (reference && src->buf)) {
+		if (av_dup_packet(src))
+			return false;
+		*dst = *src;
+	} else {
+		AVBufferRef *buf = Get(src->size);
+		if (!buf)
+			return false;
+		memcpy(buf->data, src->data, src->size);
+		*dst = *src;
+		dst->buf = buf;
+		dst->data = buf->data;
+		av_free_packet(src);
+	}
+	av_init_packet(src);
+	src->data = NULL;
+	src->size = 0;
+	return true;
+}
+
+bool BufferPool::Fragmented()
+{
+	int64_t now = av_gettime();
+	if (now < pool.checkTime)
+		return pool.fragmented;
+	pool.checkTime = now + POOL_CHECK_INTERVAL;
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+	/* free chunks between used ones, the top of the heap can be trimmed */
+	size_t holes = (size_t) mi.fordblks - (size_t) mi.keepcost;
+	size_t limit = (size_t) mi.arena / POOL_FRAGMENTED;
+	if (pool.fragmented)
+		limit /= 2;
+	bool f = holes >= POOL_FRAGMENTED_MIN && holes > limit;
+	if (f != pool.fragmented)
+		fprintf(stderr, "%s: %zu of %zu kB of the heap are unusable holes, %s packets\n", __func__,
+			holes / 1024, (size_t) mi.arena / 1024, f ? "copying" : "referencing");
+	pool.fragmented = f;
+	return f;
+}
+
+void BufferPool::GetStats(unsigned long &requests, unsigned long &allocated, size_t &allocatedBytes, unsigned long &oversized)
+{
+	requests = pool.requests;
+	allocated = pool.allocated;
+	allocatedBytes = pool.allocatedBytes;
+	oversized = pool.oversized;
+}
@@ -0,0 +1,316 @@
+/*
+ * persistent cache of avformat_find_stream_info() results
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <vector>
+
+#include "probecache.h"
+
+static const char PROBECACHE_MAGIC[8] = { 'E', 'P', '3', 'P', 'R', 'O', 'B', '1' };
+
+/* the key of a file includes a hash of its first block */
+#define PROBECACHE_BLOCK 65536
+
+/* the parameters of a stream, in the order in which they are stored */
+#define PROBECACHE_FIELDS 29
+
+/* timing: restore the start time and duration, too */
+static void fields(AVStream *st, int64_t *v, bool store, bool timing = true)
+{
+	AVCodecContext *c = st->codec;
+	int n = 0;
+#define FIELD(f) do { if (store) v[n] = (f); else (f) = (__typeof__(f)) v[n]; n++; } while (0)
+#define TIMING(f) do { if (store) v[n] = (f); else if (timing) (f) = (__typeof__(f)) v[n]; n++; } while (0)
+	/* these three are checked before anything is restored */
+	FIELD(st->id);
+	FIELD(c->codec_type);
+	FIELD(c->codec_id);
+
+	FIELD(c->codec_tag);
+	TIMING(st->start_time);
+	TIMING(st->duration);
+	FIELD(st->avg_frame_rate.num);
+	FIELD(st->avg_frame_rate.den);
+	FIELD(st->r_frame_rate.num);
+	FIELD(st->r_frame_rate.den);
+	FIELD(st->sample_aspect_ratio.num);
+	FIELD(st->sample_aspect_ratio.den);
+	FIELD(c->bit_rate);
+	FIELD(c->width);
+	FIELD(c->height);
+	FIELD(c->sample_aspect_ratio.num);
+	FIELD(c->sample_aspect_ratio.den);
+	FIELD(c->has_b_frames);
+	FIELD(c->time_base.num);
+	FIELD(c->time_base.den);
+	FIELD(c->ticks_per_frame);
+	FIELD(c->sample_rate);
+	FIELD(c->channels);
+	FIELD(c->channel_layout);
+	FIELD(c->sample_fmt);
+	FIELD(c->block_align);
+	FIELD(c->frame_size);
+	FIELD(c->profile);
+	FIELD(c->level);
+#undef TIMING
+#undef FIELD
+}
+
+/* FNV-1a */
+static uint64_t hash(const void *data, size_t len, uint64_t h = 0xcbf29ce484222325ULL)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static const char *cachedir()
+{
+	const char *dir = getenv("EPLAYER3_PROBE_CACHE");
+	return dir ? dir : PROBECACHE_DIR;
+}
+
+std::string ProbeCache::Key(const char *url)
+{
+	if (!strncmp(url, "file://", 7)) {
+		const char *path = url + 7;
+		struct stat st;
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return "";
+		uint8_t *buf = (uint8_t *) malloc(PROBECACHE_BLOCK);
+		ssize_t len = buf ? read(fd, buf, PROBECACHE_BLOCK) : -1;
+		bool ok = !fstat(fd, &st) && len > 0;
+		close(fd);
+		uint64_t h = ok ? hash(buf, len) : 0;
+		free(buf);
+		if (!ok)
+			return "";
+		char k[64];
+		snprintf(k, sizeof(k), "|%lld|%ld|%016llx", (long long) st.st_size, (long) st.st_mtime, (unsigned long long) h);
+		return std::string(path) + k;
+	}
+	/* network streams are identified by the URL */
+	if (strstr(url, "://") && strncmp(url, "bluray:", 7))
+		return url;
+	return "";
+}
+
+std::string ProbeCache::FileName(const std::string &key)
+{
+	const char *dir = cachedir();
+	if (!*dir || key.empty())
+		return "";
+	char name[20];
+	snprintf(name, sizeof(name), "/%016llx", (unsigned long long) hash(key.data(), key.length()));
+	return dir + std::string(name);
+}
+
+/* the modification time of a cache file is the time it was last used */
+void ProbeCache::Touch(const std::string &name)
+{
+	utimes(name.c_str(), NULL);
+}
+
+struct CacheFile
+{
+	std::string name;
+	time_t used;
+	off_t size;
+};
+
+static bool less_recently_used(const CacheFile &a, const CacheFile &b)
+{
+	return a.used < b.used;
+}
+
+/* deletes the least recently used files of the probe cache and the
+   keyframe indexes until both limits are met */
+void ProbeCache::Prune()
+{
+	const char *dir = cachedir();
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	std::vector<CacheFile> files;
+	off_t total = 0;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		/* only the files named by FileName(), the directory may be shared */
+		if (strspn(de->d_name, "0123456789abcdef") != 16)
+			continue;
+		CacheFile c;
+		c.name = std::string(dir) + "/" + de->d_name;
+		struct stat st;
+		if (stat(c.name.c_str(), &st) || !S_ISREG(st.st_mode))
+			continue;
+		c.used = st.st_mtime;
+		c.size = st.st_size;
+		total += c.size;
+		files.push_back(c);
+	}
+	closedir(d);
+
+	size_t count = files.size();
+	if (count <= PROBECACHE_MAX_FILES && total <= PROBECACHE_MAX_BYTES)
+		return;
+	std::sort(files.begin(), files.end(), less_recently_used);
+	for (std::vector<CacheFile>::iterator it = files.begin(); it != files.end(); ++it) {
+		if (count <= PROBECACHE_MAX_FILES && total <= PROBECACHE_MAX_BYTES)
+			break;
+		if (!unlink(it->name.c_str())) {
+			count--;
+			total -= it->size;
+		}
+	}
+}
+
+bool ProbeCache::Restore(AVFormatContext *avfc, const char *url)
+{
+	std::string key = Key(url);
+	std::string name = FileName(key);
+	if (name.empty())
+		return false;
+	FILE *f = fopen(name.c_str(), "r");
+	if (!f)
+		return false;
+
+	bool ret = false;
+	bool timing;
+	char magic[8];
+	uint32_t len, nb_streams;
+	int64_t hdr[3];
+	std::vector<int64_t> v;
+	std::vector<std::vector<uint8_t> > extradata;
+	std::string k;
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, PROBECACHE_MAGIC, sizeof(magic)) ||
+	    fread(&len, sizeof(len), 1, f) != 1 || len != key.length())
+		goto out;
+	k.resize(len);
+	if (fread(&k[0], len, 1, f) != 1 || k != key)
+		goto out;	/* hash collision */
+	if (fread(hdr, sizeof(hdr), 1, f) != 1 || fread(&nb_streams, sizeof(nb_streams), 1, f) != 1)
+		goto out;
+	/* the demuxer must have found the same streams */
+	if (!nb_streams || nb_streams != avfc->nb_streams)
+		goto out;
+
+	v.resize(nb_streams * PROBECACHE_FIELDS);
+	extradata.resize(nb_streams);
+	for (unsigned int i = 0; i < nb_streams; i++) {
+		int64_t *s = &v[i * PROBECACHE_FIELDS];
+		AVStream *st = avfc->streams[i];
+		if (fread(s, sizeof(int64_t), PROBECACHE_FIELDS, f) != PROBECACHE_FIELDS ||
+		    fread(&len, sizeof(len), 1, f) != 1 || len > 1024 * 1024)
+			goto out;
+		extradata[i].resize(len);
+		if (len && fread(&extradata[i][0], len, 1, f) != 1)
+			goto out;
+		if (s[0] != st->id ||
+		    (st->codec->codec_type != AVMEDIA_TYPE_UNKNOWN && s[1] != st->codec->codec_type) ||
+		    (st->codec->codec_id != AV_CODEC_ID_NONE && s[2] != st->codec->codec_id))
+			goto out;
+	}
+
+	/* the timestamps of a network stream differ every time it is tuned,
+	   only a file's key pins them. Otherwise the demuxer and the first
+	   packets set them (see Input::Play()) */
+	timing = !strncmp(url, "file://", 7);
+	if (timing) {
+		avfc->duration = hdr[0];
+		avfc->start_time = hdr[1];
+	}
+	avfc->bit_rate = hdr[2];
+	for (unsigned int i = 0; i < nb_streams; i++) {
+		AVStream *st = avfc->streams[i];
+		fields(st, &v[i * PROBECACHE_FIELDS], false, timing);
+		if (extradata[i].size() && !st->codec->extradata) {
+			st->codec->extradata = (uint8_t *) av_mallocz(extradata[i].size() + FF_INPUT_BUFFER_PADDING_SIZE);
+			if (st->codec->extradata) {
+				memcpy(st->codec->extradata, &extradata[i][0], extradata[i].size());
+				st->codec->extradata_size = extradata[i].size();
+			}
+		}
+	}
+	ret = true;
+ out:
+	fclose(f);
+	if (ret)
+		Touch(name);
+	else
+		fprintf(stderr, "%s: %s does not match %s\n", __func__, name.c_str(), url);
+	return ret;
+}
+
+bool ProbeCache::Store(AVFormatContext *avfc, const char *url)
+{
+	std::string key = Key(url);
+	std::string name = FileName(key);
+	if (name.empty() || !avfc->nb_streams)
+		return false;
+	mkdir(cachedir(), 0755);
+
+	std::string tmp = name + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		fprintf(stderr, "%s: cannot open %s (%m)\n", __func__, tmp.c_str());
+		return false;
+	}
+	uint32_t len = key.length();
+	uint32_t nb_streams = avfc->nb_streams;
+	int64_t hdr[3] = { avfc->duration, avfc->start_time, avfc->bit_rate };
+	fwrite(PROBECACHE_MAGIC, sizeof(PROBECACHE_MAGIC), 1, f);
+	fwrite(&len, sizeof(len), 1, f);
+	fwrite(key.data(), len, 1, f);
+	fwrite(hdr, sizeof(hdr), 1, f);
+	fwrite(&nb_streams, sizeof(nb_streams), 1, f);
+	for (unsigned int i = 0; i < nb_streams; i++) {
+		AVStream *st = avfc->streams[i];
+		int64_t v[PROBECACHE_FIELDS];
+		fields(st, v, true);
+		fwrite(v, sizeof(v), 1, f);
+		len = (st->codec->extradata && st->codec->extradata_size > 0) ? st->codec->extradata_size : 0;
+		fwrite(&len, sizeof(len), 1, f);
+		if (len)
+			fwrite(st->codec->extradata, len, 1, f);
+	}
+	if (ferror(f) | fclose(f)) {
+		fprintf(stderr, "%s: writing %s failed\n", __func__, tmp.c_str());
+		unlink(tmp.c_str());
+		return false;
+	}
+	if (rename(tmp.c_str(), name.c_str())) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	Prune();
+	return true;
+}
@@ -0,0 +1,391 @@
+/*
+ * subtitle and teletext decoding and delivery
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <algorithm>
+
+#include "player.h"
+#include "misc.h"
+#include "pool.h"
+#include "subtitle.h"
+
+// from neutrino-mp/lib/libdvbsubtitle/dvbsub.cpp
+extern void dvbsub_write(AVSubtitle *, int64_t);
+extern void dvbsub_ass_write(AVCodecContext *c, AVSubtitle *sub, int pid);
+// from neutrino-mp/lib/lib/libtuxtxt/tuxtxt_common.h
+extern void teletext_write(int pid, uint8_t *data, int size);
+
+SubtitleWorker::SubtitleWorker()
+{
+	player = NULL;
+	lastClock = INVALID_PTS_VALUE;
+	running = false;
+}
+
+SubtitleWorker::~SubtitleWorker()
+{
+	Stop();
+}
+
+bool SubtitleWorker::by_pts(const Entry &a, const Entry &b)
+{
+	return a.pts < b.pts;
+}
+
+bool SubtitleWorker::Start(Player *_player)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (running)
+		return true;
+	player = _player;
+	lastClock = INVALID_PTS_VALUE;
+	running = true;
+	int err = pthread_create(&thread, NULL, subtitlethread, this);
+	if (err) {
+		fprintf(stderr, "%s %s %d: pthread_create: %d (%s)\n", __FILE__, __func__, __LINE__, err, strerror(err));
+		running = false;
+	}
+	return running;
+}
+
+/* stops the thread and drops everything, including the external files */
+void SubtitleWorker::Stop()
+{
+	bool join;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		join = running;
+		running = false;
+		cond.broadcast();
+	}
+	if (join)
+		pthread_join(thread, NULL);
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> w_lock(workMutex);
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	for (std::deque<Packet>::iterator it = packets.begin(); it != packets.end(); ++it)
+		av_free_packet(&it->packet);
+	packets.clear();
+	for (std::multimap<int64_t, Cue>::iterator it = cues.begin(); it != cues.end(); ++it)
+		FreeCue(it->second);
+	cues.clear();
+	for (std::vector<File *>::iterator it = files.begin(); it != files.end(); ++it) {
+		File *f = *it;
+		for (std::vector<Entry>::iterator e = f->index.begin(); e != f->index.end(); ++e)
+			av_free_packet(&e->packet);
+		if (f->avfc) {
+			avcodec_close(f->avfc->streams[0]->codec);
+			avformat_close_input(&f->avfc);
+		}
+		delete f;
+	}
+	files.clear();
+	codecs.clear();
+}
+
+/* the file is opened by the thread, when playback has started */
+void SubtitleWorker::AddFile(const char *name, const char *format, int pid)
+{
+	File *f = new File;
+	f->name = name;
+	f->format = format;
+	f->pid = pid;
+	f->avfc = NULL;
+	f->failed = false;
+	f->complete = false;
+	f->next = 0;
+	f->maxDuration = 0;
+	f->rewind = true;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> w_lock(workMutex);
+	files.push_back(f);
+}
+
+void SubtitleWorker::Push(AVStream *stream, AVPacket *packet, int64_t pts, int pid)
+{
+	Packet p;
+	p.stream = stream;
+	p.pid = pid;
+	p.pts = pts;
+	if (!BufferPool::MovePacket(&p.packet, packet))
+		return;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+	if (!running) {
+		av_free_packet(&p.packet);
+		return;
+	}
+	if (packets.size() >= SUBTITLE_MAX_PACKETS) {
+		fprintf(stderr, "%s: decoder too slow, packet dropped\n", __func__);
+		av_free_packet(&packets.front().packet);
+		packets.pop_front();
+	}
+	packets.push_back(p);
+	cond.broadcast();
+}
+
+/* after a seek or a track change. Waits until the thread is idle, so
+   nothing that was decoded before shows up afterwards */
+void SubtitleWorker::Flush()
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> w_lock(workMutex);
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		for (std::deque<Packet>::iterator it = packets.begin(); it != packets.end(); ++it)
+			av_free_packet(&it->packet);
+		packets.clear();
+		for (std::multimap<int64_t, Cue>::iterator it = cues.begin(); it != cues.end(); ++it)
+			FreeCue(it->second);
+		cues.clear();
+	}
+	for (std::vector<AVCodecContext *>::iterator it = codecs.begin(); it != codecs.end(); ++it)
+		avcodec_flush_buffers(*it);
+	for (std::vector<File *>::iterator it = files.begin(); it != files.end(); ++it)
+		(*it)->rewind = true;
+	lastClock = INVALID_PTS_VALUE;
+}
+
+void SubtitleWorker::FreeCue(Cue &c)
+{
+	if (c.type == CUE_TELETEXT)
+		av_free_packet(&c.packet);
+	else
+		avsubtitle_free(&c.sub);
+}
+
+/* hands a cue over to its handler, which then owns the AVSubtitle */
+void SubtitleWorker::Send(Cue &c)
+{
+	switch (c.type) {
+		case CUE_BITMAP:
+			dvbsub_write(&c.sub, c.pts);
+			break;
+		case CUE_ASS:
+			dvbsub_ass_write(c.codec, &c.sub, c.pid);
+			break;
+		case CUE_TELETEXT:
+			teletext_write(c.pid, c.packet.data + 1, c.packet.size - 1);
+			av_free_packet(&c.packet);
+			break;
+	}
+}
+
+/* decodes the queued packets into cues, returns false if there were none */
+bool SubtitleWorker::Decode()
+{
+	bool busy = false;
+	for (;;) {
+		Packet p;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+			if (packets.empty() || !running)
+				break;
+			p = packets.front();
+			packets.pop_front();
+		}
+		busy = true;
+
+		Cue c;
+		c.pid = p.pid;
+		c.pts = p.pts;
+		c.codec = NULL;
+		int64_t due = INT64_MIN;	/* now, without a PTS */
+		if (!p.stream) {
+			c.type = CUE_TELETEXT;
+			c.packet = p.packet;
+			if (p.pts != INVALID_PTS_VALUE)
+				due = p.pts;
+		} else {
+			AVCodecContext *codec = p.stream->codec;
+			memset(&c.sub, 0, sizeof(c.sub));
+			int got_sub = 0;
+			int err = avcodec_decode_subtitle2(codec, &c.sub, &got_sub, &p.packet);
+			av_free_packet(&p.packet);
+			if (err < 0)
+				fprintf(stderr, "%s: avcodec_decode_subtitle2: %d\n", __func__, err);
+			if (std::find(codecs.begin(), codecs.end(), codec) == codecs.end())
+				codecs.push_back(codec);
+			if (!got_sub)
+				continue;
+			if (!c.sub.num_rects || c.sub.rects[0]->type == SUBTITLE_NONE) {
+				avsubtitle_free(&c.sub);
+				continue;
+			}
+			c.type = (c.sub.rects[0]->type == SUBTITLE_BITMAP) ? CUE_BITMAP : CUE_ASS;
+			c.codec = codec;
+			if (p.pts != INVALID_PTS_VALUE)
+				due = p.pts - SUBTITLE_LEAD;
+		}
+
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		cues.insert(std::make_pair(due, c));
+	}
+	return busy;
+}
+
+bool SubtitleWorker::OpenFile(File *f)
+{
+	AVFormatContext *avfc = avformat_alloc_context();
+	int err = avformat_open_input(&avfc, f->name.c_str(), av_find_input_format(f->format.c_str()), 0);
+	if (err < 0) {
+		fprintf(stderr, "%s: avformat_open_input %s: %d\n", __func__, f->name.c_str(), err);
+		return false;
+	}
+	avformat_find_stream_info(avfc, NULL);
+	AVCodecContext *c = avfc->nb_streams == 1 ? avfc->streams[0]->codec : NULL;
+	AVCodec *codec = c ? avcodec_find_decoder(c->codec_id) : NULL;
+	if (!codec || avcodec_open2(c, codec, NULL) < 0) {
+		fprintf(stderr, "%s: no decoder for %s\n", __func__, f->name.c_str());
+		avformat_close_input(&avfc);
+		return false;
+	}
+	f->avfc = avfc;
+	return true;
+}
+
+/* opens the external files and adds a chunk of each to its index,
+   returns false if all of them are complete */
+bool SubtitleWorker::ReadFiles()
+{
+	bool busy = false;
+	for (std::vector<File *>::iterator it = files.begin(); it != files.end(); ++it) {
+		File *f = *it;
+		if (f->failed || f->complete)
+			continue;
+		if (!f->avfc && !OpenFile(f)) {
+			f->failed = true;
+			continue;
+		}
+		AVStream *st = f->avfc->streams[0];
+		AVPacket packet;
+		av_init_packet(&packet);
+		int n;
+		for (n = 0; n < SUBTITLE_CHUNK && av_read_frame(f->avfc, &packet) > -1; n++) {
+			if (packet.pts == AV_NOPTS_VALUE || av_dup_packet(&packet)) {
+				av_free_packet(&packet);
+				continue;
+			}
+			Entry e;
+			e.pts = av_rescale(90000ll * st->time_base.num, packet.pts, st->time_base.den);
+			e.packet = packet;
+			int64_t duration = av_rescale(90000ll * st->time_base.num, packet.duration, st->time_base.den);
+			if (duration > f->maxDuration)
+				f->maxDuration = duration;
+			/* the demuxers sort by time, this is just in case */
+			if (f->index.empty() || f->index.back().pts <= e.pts)
+				f->index.push_back(e);
+			else {
+				f->index.insert(std::upper_bound(f->index.begin(), f->index.end(), e, by_pts), e);
+				f->rewind = true;
+			}
+		}
+		if (n < SUBTITLE_CHUNK) {
+			f->complete = true;
+			fprintf(stderr, "%s: %s: %d entries\n", __func__, f->name.c_str(), (int) f->index.size());
+		} else
+			busy = true;
+	}
+	return busy;
+}
+
+/* hands over what is due by the playback clock, returns the time until
+   the next cue is due in ms */
+int64_t SubtitleWorker::Deliver()
+{
+	int64_t clock;
+	bool valid = player->GetPts(clock) && clock != INVALID_PTS_VALUE;
+	int64_t next = SUBTITLE_POLL * 90;
+
+	/* without a clock the cues of the tracks go out right away, as they
+	   used to. The files wait, there's no telling where playback is */
+	std::vector<Cue> due;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		std::multimap<int64_t, Cue>::iterator it = cues.begin();
+		for (; it != cues.end() && (!valid || it->first <= clock); ++it)
+			due.push_back(it->second);
+		cues.erase(cues.begin(), it);
+		if (it != cues.end())
+			next = std::min(next, it->first - clock);
+	}
+	for (std::vector<Cue>::iterator it = due.begin(); it != due.end(); ++it)
+		Send(*it);
+	if (!valid)
+		return SUBTITLE_POLL;
+
+	bool jump = lastClock != INVALID_PTS_VALUE && (clock < lastClock - SUBTITLE_JUMP || clock > lastClock + SUBTITLE_JUMP);
+	lastClock = clock;
+
+	for (std::vector<File *>::iterator it = files.begin(); it != files.end(); ++it) {
+		File *f = *it;
+		if (!f->avfc)
+			continue;
+		if (f->rewind || jump) {
+			/* entries that started before the position may still be shown */
+			Entry e;
+			e.pts = clock - f->maxDuration;
+			f->next = std::lower_bound(f->index.begin(), f->index.end(), e, by_pts) - f->index.begin();
+			f->rewind = false;
+		}
+		AVCodecContext *c = f->avfc->streams[0]->codec;
+		for (; f->next < f->index.size() && f->index[f->next].pts - SUBTITLE_LEAD <= clock; f->next++) {
+			AVSubtitle sub;
+			memset(&sub, 0, sizeof(sub));
+			int got_sub = 0;
+			avcodec_decode_subtitle2(c, &sub, &got_sub, &f->index[f->next].packet);
+			if (got_sub)
+				dvbsub_ass_write(c, &sub, f->pid);
+		}
+		if (f->next < f->index.size())
+			next = std::min(next, f->index[f->next].pts - SUBTITLE_LEAD - clock);
+	}
+	return next / 90;
+}
+
+void SubtitleWorker::Run()
+{
+	for (;;) {
+		int64_t wait;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> w_lock(workMutex);
+			bool busy = Decode();
+			busy |= ReadFiles();
+			wait = Deliver();
+			if (busy)
+				wait = 0;
+		}
+		OpenThreads::ScopedLock<OpenThreads::Mutex> m_lock(mutex);
+		if (!running)
+			break;
+		if (wait > 0 && packets.empty())
+			cond.wait(&mutex, std::min(wait, (int64_t) SUBTITLE_POLL));
+	}
+}
+
+void *SubtitleWorker::subtitlethread(void *arg)
+{
+	char threadname[17];
+	strncpy(threadname, __func__, sizeof(threadname));
+	threadname[16] = 0;
+	prctl(PR_SET_NAME, (unsigned long) threadname);
+
+	((SubtitleWorker *) arg)->Run();
+	return NULL;
+}
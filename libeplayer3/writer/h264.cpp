@@ -26,6 +26,8 @@
 #include <sys/uio.h>
 #include <errno.h>
 
+#include <vector>
+
 #include "misc.h"
 #include "pes.h"
 #include "writer.h"
@@ -43,12 +45,23 @@ typedef struct avcC_s {
 	uint8_t Params[1];		// {length,params}{length,params}...sequence then picture
 } avcC_t;
 
+/* payload bytes per PES packet, so that PES_packet_length still fits into 16 bits
+   with PTS and fake start code */
+#define H264_PES_PAYLOAD (MAX_PES_PACKET_SIZE - 13)
+
 class WriterH264 : public Writer
 {
 	private:
 		bool initialHeader;
 		unsigned int NalLengthBytes;
 		AVStream *stream;
+		/* the pieces of the access unit, the iovecs and PES headers that carry it;
+		   kept across packets, they only grow up to the largest access unit */
+		std::vector<struct iovec> pieces;
+		std::vector<struct iovec> iov;
+		std::vector<uint8_t> headers;
+		void Add(const void *data, size_t len);
+		bool Flush(int64_t pts, int pic_start_code);
 	public:
 		bool Write(AVPacket *packet, int64_t pts);
 		void Init(int _fd, AVStream *_stream, Player *_player);
@@ -62,14 +75,64 @@ void WriterH264::Init(int _fd, AVStream *_stream, Player *_player)
 	player = _player;
 	initialHeader = true;
 	NalLengthBytes = 1;
+	pieces.clear();
+}
+
+void WriterH264::Add(const void *data, size_t len)
+{
+	struct iovec v;
+	v.iov_base = (void *) data;
+	v.iov_len = len;
+	pieces.push_back(v);
+}
+
+/* write the collected pieces as one PES packet, split only if the payload
+   exceeds H264_PES_PAYLOAD. Only the first packet carries pts. */
+bool WriterH264::Flush(int64_t pts, int pic_start_code)
+{
+	size_t total = 0;
+	for (std::vector<struct iovec>::iterator it = pieces.begin(); it != pieces.end(); ++it)
+		total += it->iov_len;
+	size_t count = (total + H264_PES_PAYLOAD - 1) / H264_PES_PAYLOAD;
+	if (!count) {
+		pieces.clear();
+		return true;
+	}
+
+	headers.resize(count * PES_MAX_HEADER_SIZE);
+	iov.clear();
+	size_t p = 0, off = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t len = total - i * H264_PES_PAYLOAD;
+		if (len > H264_PES_PAYLOAD)
+			len = H264_PES_PAYLOAD;
+		struct iovec v;
+		v.iov_base = &headers[i * PES_MAX_HEADER_SIZE];
+		v.iov_len = InsertPesHeader((uint8_t *) v.iov_base, len, MPEG_VIDEO_PES_START_CODE,
+					    i ? INVALID_PTS_VALUE : pts, i ? 0 : pic_start_code);
+		iov.push_back(v);
+		while (len) {
+			v.iov_base = (uint8_t *) pieces[p].iov_base + off;
+			v.iov_len = pieces[p].iov_len - off;
+			if (v.iov_len > len)
+				v.iov_len = len;
+			iov.push_back(v);
+			len -= v.iov_len;
+			off += v.iov_len;
+			if (off == pieces[p].iov_len) {
+				p++;
+				off = 0;
+			}
+		}
+	}
+	pieces.clear();
+	return WriteV(fd, &iov[0], iov.size());
 }
 
 bool WriterH264::Write(AVPacket *packet, int64_t pts)
 {
 	if (!packet || !packet->data)
 		return false;
-	uint8_t PesHeader[PES_MAX_HEADER_SIZE];
-	struct iovec iov[512];
 
 	uint8_t *d = packet->data;
 
@@ -78,28 +141,18 @@ bool WriterH264::Write(AVPacket *packet, int64_t pts)
 			           || (d[0] == 0xff && d[1] == 0xff && d[2] == 0xff && d[3] == 0xff) // FIXME, needed???
 	)) {
 		unsigned int FakeStartCode = /* (call->Version << 8) | */ PES_VERSION_FAKE_START_CODE;
-		int ic = 0;
-		iov[ic++].iov_base = PesHeader;
-		unsigned int len = 0;
 		if (initialHeader) {
 			initialHeader = false;
-			iov[ic].iov_base = stream->codec->extradata;
-			iov[ic++].iov_len = stream->codec->extradata_size;
-			len += stream->codec->extradata_size;
+			Add(stream->codec->extradata, stream->codec->extradata_size);
 		}
-		iov[ic].iov_base = packet->data;
-		iov[ic++].iov_len = packet->size;
-		len += packet->size;
+		Add(packet->data, packet->size);
 #if 1 // FIXME: needed?
 		// Hellmaster1024:
 		// some packets will only be accepted by the player if we send one byte more than data is available.
 		// The content of this byte does not matter. It will be ignored by the player
-		iov[ic].iov_base = (void *) "";
-		iov[ic++].iov_len = 1;
-		len++;
+		Add("", 1);
 #endif
-		iov[0].iov_len = InsertPesHeader(PesHeader, len, MPEG_VIDEO_PES_START_CODE, pts, FakeStartCode);
-		return writev(fd, iov, ic) > -1;
+		return Flush(pts, FakeStartCode);
 	}
 
 	// convert NAL units without sync byte sequence to byte-stream format
@@ -152,32 +205,20 @@ bool WriterH264::Write(AVPacket *packet, int64_t pts)
 
 		Header[len++] = 0x80;	// Rsbp trailing bits
 
-		int ic = 0;
-		iov[ic].iov_base = PesHeader;
-		iov[ic++].iov_len = InsertPesHeader(PesHeader, len, MPEG_VIDEO_PES_START_CODE, INVALID_PTS_VALUE, 0);
-		iov[ic].iov_base = Header;
-		iov[ic++].iov_len = len;
-		if (writev(fd, iov, ic) < 0)
+		Add(Header, len);
+		if (!Flush(INVALID_PTS_VALUE, 0))
 			return false;
 
-		ic = 0;
-		iov[ic++].iov_base = PesHeader;
-
 		NalLengthBytes = (avcCHeader->NalLengthMinusOne & 0x03) + 1;
 		unsigned int ParamOffset = 0;
-		len = 0;
 
 		// sequence parameter set
 		unsigned int ParamSets = avcCHeader->NumParamSets & 0x1f;
 		for (unsigned int i = 0; i < ParamSets; i++) {
 			unsigned int PsLength = (avcCHeader->Params[ParamOffset] << 8) | avcCHeader->Params[ParamOffset + 1];
 
-			iov[ic].iov_base = (uint8_t *) "\0\0\0\1";
-			iov[ic++].iov_len = 4;
-			len += 4;
-			iov[ic].iov_base = &avcCHeader->Params[ParamOffset + 2];
-			iov[ic++].iov_len = PsLength;
-			len += PsLength;
+			Add("\0\0\0\1", 4);
+			Add(&avcCHeader->Params[ParamOffset + 2], PsLength);
 			ParamOffset += PsLength + 2;
 		}
 
@@ -187,23 +228,18 @@ bool WriterH264::Write(AVPacket *packet, int64_t pts)
 		for (unsigned int i = 0; i < ParamSets; i++) {
 			unsigned int PsLength = (avcCHeader->Params[ParamOffset] << 8) | avcCHeader->Params[ParamOffset + 1];
 
-			iov[ic].iov_base = (uint8_t *) "\0\0\0\1";
-			iov[ic++].iov_len = 4;
-			len += 4;
-			iov[ic].iov_base = &avcCHeader->Params[ParamOffset + 2];
-			iov[ic++].iov_len = PsLength;
-			len += PsLength;
+			Add("\0\0\0\1", 4);
+			Add(&avcCHeader->Params[ParamOffset + 2], PsLength);
 			ParamOffset += PsLength + 2;
 		}
 
-		iov[0].iov_len = InsertPesHeader(PesHeader, len, MPEG_VIDEO_PES_START_CODE, INVALID_PTS_VALUE, 0);
-		ssize_t l = writev(fd, iov, ic);
-		if (l < 0)
+		if (!Flush(INVALID_PTS_VALUE, 0))
 			return false;
 
 		initialHeader = false;
 	}
 
+	// all NAL units of the access unit go into one PES packet
 	uint8_t *de = d + packet->size;
 	do {
 		unsigned int len = 0;
@@ -230,24 +266,14 @@ bool WriterH264::Write(AVPacket *packet, int64_t pts)
 			break;
 		}
 
-		int ic = 0;
-		iov[ic++].iov_base = PesHeader;
-		iov[ic].iov_base = (uint8_t *) "\0\0\0\1";
-		iov[ic++].iov_len = 4;
-
-		iov[ic].iov_base = d;
-		iov[ic++].iov_len = len;
-		iov[0].iov_len = InsertPesHeader(PesHeader, len + 3, MPEG_VIDEO_PES_START_CODE, pts, 0);
-		ssize_t l = writev(fd, iov, ic);
-		if (l < 0)
-			return false;
-
+		Add("\0\0\0\1", 4);
+		Add(d, len);
 		d += len;
-		pts = INVALID_PTS_VALUE;
-
 	} while (d < de);
 
-	return true;
+	// see above, the player wants one byte more than data is available
+	Add("", 1);
+	return Flush(pts, 0);
 }
 
 WriterH264::WriterH264()
@@ -28,11 +28,20 @@
 #include <sys/ioctl.h>
 #include <sys/uio.h>
 #include <linux/dvb/audio.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+#include <vector>
 
 #include "misc.h"
 #include "pes.h"
 #include "writer.h"
 #include "player.h"
+#include "pool.h"
 
 extern "C" {
 #include <libavutil/avutil.h>
@@ -57,16 +66,73 @@ static const uint8_t clpcm_prv[14] = {
 	0, 0	//resvd for copyright management
 };
 
+// 16 bit LPCM is big endian, swap the bytes of every sample in place
+static void swap16(uint8_t *p, unsigned int len)
+{
+	unsigned int n = 0;
+#if defined(__SSSE3__)
+	const __m128i mask = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+	for (; n + 16 <= len; n += 16)
+		_mm_storeu_si128((__m128i *) (p + n), _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (p + n)), mask));
+#elif defined(HAVE_NEON)
+	for (; n + 16 <= len; n += 16)
+		vst1q_u8(p + n, vrev16q_u8(vld1q_u8(p + n)));
+#endif
+	for (; n + 4 <= len; n += 4) {
+		uint32_t v;
+		memcpy(&v, p + n, 4);
+		v = ((v & 0x00ff00ff) << 8) | ((v >> 8) & 0x00ff00ff);
+		memcpy(p + n, &v, 4);
+	}
+	for (; n + 2 <= len; n += 2) {
+		uint8_t t = p[n];
+		p[n] = p[n + 1];
+		p[n + 1] = t;
+	}
+}
+
+// 24 bit LPCM, two samples of two channels in 12 bytes:
+//      0   1   2   3   4   5   6   7   8   9  10  11
+//    A1c A1b A1a B1c B1b B1a A2c A2b A2a B2c B2b B2a
+// to A1a A1b B1a B1b A2a A2b B2a B2b A1c B1c A2c B2c
+static const uint8_t reorder24_map[16] = { 2, 1, 5, 4, 8, 7, 11, 10, 0, 3, 6, 9, 12, 13, 14, 15 };
+
+static void reorder24(uint8_t *p, unsigned int len)
+{
+	unsigned int n = 0;
+	// 16 bytes are loaded and stored, the last four of them unchanged
+#if defined(__SSSE3__)
+	const __m128i mask = _mm_loadu_si128((const __m128i *) reorder24_map);
+	for (; n + 16 <= len; n += 12)
+		_mm_storeu_si128((__m128i *) (p + n), _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (p + n)), mask));
+#elif defined(HAVE_NEON)
+	const uint8x8_t lo = vld1_u8(reorder24_map), hi = vld1_u8(reorder24_map + 8);
+	for (; n + 16 <= len; n += 12) {
+		uint8x8x2_t v;
+		v.val[0] = vld1_u8(p + n);
+		v.val[1] = vld1_u8(p + n + 8);
+		vst1_u8(p + n, vtbl2_u8(v, lo));
+		vst1_u8(p + n + 8, vtbl2_u8(v, hi));
+	}
+#endif
+	for (; n + 12 <= len; n += 12) {
+		uint8_t t[12];
+		memcpy(t, p + n, 12);
+		for (unsigned int i = 0; i < 12; i++)
+			p[n + i] = t[reorder24_map[i]];
+	}
+}
+
 class WriterPCM : public Writer
 {
 	private:
 		unsigned int SubFrameLen;
 		unsigned int SubFramesPerPES;
 		uint8_t lpcm_prv[14];
-		uint8_t injectBuffer[2048];
-		uint8_t breakBuffer[sizeof(injectBuffer)];
-		uint8_t *output;
-		uint8_t out_samples_max;
+		uint8_t breakBuffer[2048];	// a subframe that spans two calls of writePCM
+		std::vector<uint8_t> headers;	// PES header and lpcm_prv of each subframe
+		std::vector<struct iovec> iov;
+		AVBufferRef *output;	// resampler output, kept as long as it's large enough
 		unsigned int breakBufferFillSize;
 		int uNoOfChannels;
 		int uSampleRate;
@@ -130,7 +196,7 @@ bool WriterPCM::prepareClipPlay()
 	SubFrameLen *= uBitsPerSample / 8;
 
 	//rewrite PES size to have as many complete subframes per PES as we can
-	SubFramesPerPES = ((sizeof(injectBuffer) - 14) - sizeof(lpcm_prv)) / SubFrameLen;
+	SubFramesPerPES = ((sizeof(breakBuffer) - 14) - sizeof(lpcm_prv)) / SubFrameLen;
 	SubFrameLen *= SubFramesPerPES;
 
 	//set number of channels
@@ -151,70 +217,53 @@ bool WriterPCM::prepareClipPlay()
 
 bool WriterPCM::writePCM(int64_t Pts, uint8_t *data, unsigned int size)
 {
-	bool res = true;
-	uint8_t PesHeader[PES_MAX_HEADER_SIZE];
-
 	if (initialHeader) {
 		initialHeader = false;
 		prepareClipPlay();
 		ioctl(fd, AUDIO_CLEAR_BUFFER, NULL);
 	}
-
-	size += breakBufferFillSize;
-
-	while (size >= SubFrameLen) {
-		if (breakBufferFillSize)
-			memcpy(injectBuffer, breakBuffer, breakBufferFillSize);
-		memcpy(injectBuffer + breakBufferFillSize, data, SubFrameLen - breakBufferFillSize);
-		size -= SubFrameLen;
-		data += SubFrameLen - breakBufferFillSize;
-		breakBufferFillSize = 0;
-
-		//write the PCM data
-		if (uBitsPerSample == 16) {
-			for (unsigned int n = 0; n < SubFrameLen; n += 2) {
-				uint8_t tmp = injectBuffer[n];
-				injectBuffer[n] = injectBuffer[n + 1];
-				injectBuffer[n + 1] = tmp;
-			}
-		} else {
-			//      0   1   2   3   4   5   6   7   8   9  10  11
-			//    A1c A1b A1a B1c B1b B1a A2c A2b A2a B2c B2b B2a
-			// to A1a A1b B1a B1b A2a A2b B2a B2b A1c B1c A2c B2c
-			for (unsigned int n = 0; n < SubFrameLen; n += 12) {
-				uint8_t t, *p = injectBuffer + n;
-				t = p[0];
-				p[0] = p[2];
-				p[2] = p[5];
-				p[5] = p[7];
-				p[7] = p[11];
-				p[11] = p[9];
-				p[9] = p[3];
-				p[3] = p[4];
-				p[4] = p[8];
-				p[8] = t;
-			}
+	if (!SubFrameLen)
+		return false;
+
+	// Complete subframes are converted in place and written straight from
+	// data. Only a subframe that started in the previous call is assembled
+	// in breakBuffer.
+	unsigned int count = (breakBufferFillSize + size) / SubFrameLen;
+	headers.resize(count * PES_MAX_HEADER_SIZE);
+	iov.resize(count * 2);
+	for (unsigned int i = 0; i < count; i++) {
+		uint8_t *pcm = data;
+		unsigned int len = SubFrameLen;
+		if (breakBufferFillSize) {
+			len -= breakBufferFillSize;
+			memcpy(breakBuffer + breakBufferFillSize, data, len);
+			breakBufferFillSize = 0;
+			pcm = breakBuffer;
 		}
+		data += len;
+		size -= len;
+
+		if (uBitsPerSample == 16)
+			swap16(pcm, SubFrameLen);
+		else
+			reorder24(pcm, SubFrameLen);
 
 		//increment err... subframe count?
 		lpcm_prv[1] = ((lpcm_prv[1] + SubFramesPerPES) & 0x1F);
 
-		struct iovec iov[3];
-		iov[0].iov_base = PesHeader;
-		iov[1].iov_base = lpcm_prv;
-		iov[1].iov_len = sizeof(lpcm_prv);
-		iov[2].iov_base = injectBuffer;
-		iov[2].iov_len = SubFrameLen;
-		iov[0].iov_len = InsertPesHeader(PesHeader, iov[1].iov_len + iov[2].iov_len, PCM_PES_START_CODE, Pts, 0);
-		int len = writev(fd, iov, 3);
-		if (len < 0) {
-			res = false;
-			break;
-		}
+		uint8_t *PesHeader = &headers[i * PES_MAX_HEADER_SIZE];
+		int HeaderLength = InsertPesHeader(PesHeader, sizeof(lpcm_prv) + SubFrameLen, PCM_PES_START_CODE, Pts, 0);
+		memcpy(PesHeader + HeaderLength, lpcm_prv, sizeof(lpcm_prv));
+		iov[2 * i].iov_base = PesHeader;
+		iov[2 * i].iov_len = HeaderLength + sizeof(lpcm_prv);
+		iov[2 * i + 1].iov_base = pcm;
+		iov[2 * i + 1].iov_len = SubFrameLen;
 	}
+
+	bool res = !count || WriteV(fd, &iov[0], iov.size());
 	if (size && res) {
-		breakBufferFillSize = size;
-		memcpy(breakBuffer, data, size);
+		memcpy(breakBuffer + breakBufferFillSize, data, size);
+		breakBufferFillSize += size;
 	}
 
 	return res;
@@ -326,20 +375,23 @@ bool WriterPCM::Write(AVPacket *packet, int64_t pts)
 
 		int in_samples = decoded_frame->nb_samples;
 		int out_samples = av_rescale_rnd(swr_get_delay(swr, c->sample_rate) + in_samples, out_sample_rate, c->sample_rate, AV_ROUND_UP);
-		if (out_samples > out_samples_max) {
-			if (output)
-				av_freep(&output);
-			int e = av_samples_alloc(&output, NULL, out_channels, out_samples, AV_SAMPLE_FMT_S16, 1);
-			if (e < 0) {
-				fprintf(stderr, "av_samples_alloc: %d\n", -e);
+		int out_size = av_samples_get_buffer_size(NULL, out_channels, out_samples, AV_SAMPLE_FMT_S16, 1);
+		if (out_size < 0) {
+			fprintf(stderr, "av_samples_get_buffer_size: %d\n", -out_size);
+			break;
+		}
+		if (!output || output->size < out_size) {
+			av_buffer_unref(&output);
+			output = BufferPool::Get(out_size);
+			if (!output) {
+				fprintf(stderr, "%s %d: out of memory\n", __func__, __LINE__);
 				break;
 			}
-			out_samples_max = out_samples;
 		}
 
-		out_samples = swr_convert(swr, &output, out_samples, (const uint8_t **) &decoded_frame->data[0], in_samples);
+		out_samples = swr_convert(swr, &output->data, out_samples, (const uint8_t **) &decoded_frame->data[0], in_samples);
 
-		if (!writePCM(pts, output, out_samples * sizeof(short) * out_channels)) {
+		if (!writePCM(pts, output->data, out_samples * sizeof(short) * out_channels)) {
 			restart_audio_resampling = true;
 			break;
 		}
@@ -351,7 +403,6 @@ WriterPCM::WriterPCM()
 {
 	swr = NULL;
 	output = NULL;
-	out_samples_max = 0;
 	decoded_frame = av_frame_alloc();
 
 	Register(this, AV_CODEC_ID_INJECTPCM, AUDIO_ENCODING_LPCMA);
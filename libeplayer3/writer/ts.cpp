@@ -0,0 +1,78 @@
+/*
+ * PES to transport stream packetizer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "ts.h"
+
+size_t TsPacketizer::Packetize(const struct iovec *iov, int iovcnt, uint8_t *out)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	uint8_t *o = out;
+	size_t off = 0;		/* in the current iovec */
+	bool first = true;
+	while (total) {
+		size_t len = (total < TS_PAYLOAD_SIZE) ? total : TS_PAYLOAD_SIZE;
+		o[0] = 0x47;	// sync byte
+		o[1] = (first ? 0x40 : 0x00) | (pid >> 8);	// payload_unit_start_indicator
+		o[2] = pid & 0xff;
+		if (len < TS_PAYLOAD_SIZE) {
+			/* adaptation field with stuffing fills the rest of the last packet */
+			size_t af = TS_PAYLOAD_SIZE - len - 1;
+			o[3] = 0x30 | cc;
+			o[4] = af;
+			if (af) {
+				o[5] = 0x00;	// no flags
+				memset(o + 6, 0xff, af - 1);
+			}
+			o += TS_PACKET_SIZE - len;
+		} else {
+			o[3] = 0x10 | cc;
+			o += TS_HEADER_SIZE;
+		}
+		cc = (cc + 1) & 0x0f;
+		first = false;
+		total -= len;
+
+		while (len) {
+			size_t n = iov->iov_len - off;
+			if (n > len)
+				n = len;
+			memcpy(o, (const uint8_t *) iov->iov_base + off, n);
+			o += n;
+			off += n;
+			len -= n;
+			if (off == iov->iov_len) {
+				iov++;
+				off = 0;
+			}
+		}
+	}
+	return o - out;
+}
+
+size_t TsPacketizer::Packetize(const uint8_t *pes, size_t pes_len, uint8_t *out)
+{
+	struct iovec iov;
+	iov.iov_base = (void *) pes;
+	iov.iov_len = pes_len;
+	return Packetize(&iov, 1, out);
+}
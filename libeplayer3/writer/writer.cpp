@@ -22,6 +22,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include <string>
 #include <map>
@@ -63,6 +66,37 @@ bool Writer::Write(AVPacket * /* packet */, int64_t /* pts */)
 	return false;
 }
 
+/* writev() everything, in batches of IOV_MAX and continuing after partial writes.
+   The iovecs are modified. */
+bool Writer::WriteV(int fd, struct iovec *iov, int iovcnt)
+{
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+	while (iovcnt > 0) {
+		int n = (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt;
+		ssize_t l = writev(fd, iov, n);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (!l && iov->iov_len)
+			return false;
+		while (n && l >= (ssize_t) iov->iov_len) {
+			l -= iov->iov_len;
+			iov++;
+			iovcnt--;
+			n--;
+		}
+		if (l) {
+			iov->iov_base = (uint8_t *) iov->iov_base + l;
+			iov->iov_len -= l;
+		}
+	}
+	return true;
+}
+
 static Writer writer __attribute__ ((init_priority (300)));
 
 Writer *Writer::GetWriter(enum AVCodecID id, enum AVMediaType codec_type)
@@ -84,6 +84,8 @@ bool cPlayback::Start(char *filename, int vpid, int vtype, int apid, int ac3, in
 			int selected_program = 0;
 			if (vpid || apid) {
 				;
+			} else if (player->IsAdaptive()) {
+				;	/* started with the lowest variant, switched by libeplayer3 */
 			} else if (GetPrograms(keys, values) && (keys.size() > 1) && ProgramSelectionCallback) {
 				const char *key = ProgramSelectionCallback(ProgramSelectionCallbackData, keys, values);
 				if (!key) {
@@ -111,6 +113,19 @@ bool cPlayback::Start(char *filename, int vpid, int vtype, int apid, int ac3, in
 	return ret;
 }
 
+/* prepares the next playlist item while the current one plays, Start()
+   with the same filename then skips connecting and probing */
+bool cPlayback::Preload(char *filename)
+{
+	std::string file;
+	if (*filename == '/')
+		file = "file://";
+	file += filename;
+
+	bool noprobe = file.substr(0, 7) == "file://" && file.length() > 10 && file.substr(file.length() - 3) == ".ts";
+	return player->Preload(file.c_str(), noprobe);
+}
+
 bool cPlayback::Stop(void)
 {
 	printf("%s:%s playing %d\n", __FILE__, __func__, playing);
@@ -278,8 +293,8 @@ void cPlayback::FindAllPids(int *pids, unsigned int *ac3flags, unsigned int *num
 {
 	unsigned int i = 0;
 
-	std::vector<Track> tracks = player->manager.getAudioTracks();
-	for (std::vector<Track>::iterator it = tracks.begin(); it != tracks.end() && i < *numpids; ++it) {
+	const std::vector<Track> &tracks = player->manager.getAudioTracks();
+	for (std::vector<Track>::const_iterator it = tracks.begin(); it != tracks.end() && i < *numpids; ++it) {
 		pids[i] = it->pid;
 		ac3flags[i] = it->ac3flags;
 		language[i] = it->title;
@@ -293,8 +308,8 @@ void cPlayback::FindAllSubtitlePids(int *pids, unsigned int *numpids, std::strin
 {
 	unsigned int i = 0;
 
-	std::vector<Track> tracks = player->manager.getSubtitleTracks();
-	for (std::vector<Track>::iterator it = tracks.begin(); it != tracks.end() && i < *numpids; ++it) {
+	const std::vector<Track> &tracks = player->manager.getSubtitleTracks();
+	for (std::vector<Track>::const_iterator it = tracks.begin(); it != tracks.end() && i < *numpids; ++it) {
 		pids[i] = it->pid;
 		language[i] = it->title;
 		i++;
@@ -307,8 +322,8 @@ void cPlayback::FindAllTeletextsubtitlePids(int *pids, unsigned int *numpids, st
 {
 	unsigned int i = 0;
 
-	std::vector<Track> tracks = player->manager.getTeletextTracks();
-	for (std::vector<Track>::iterator it = tracks.begin(); it != tracks.end() && i < *numpids; ++it) {
+	const std::vector<Track> &tracks = player->manager.getTeletextTracks();
+	for (std::vector<Track>::const_iterator it = tracks.begin(); it != tracks.end() && i < *numpids; ++it) {
 		if (it->type != 2 && it->type != 5) // return subtitles only
 			continue;
 		pids[i] = it->pid;
@@ -323,8 +338,8 @@ void cPlayback::FindAllTeletextsubtitlePids(int *pids, unsigned int *numpids, st
 
 int cPlayback::GetFirstTeletextPid(void)
 {
-	std::vector<Track> tracks = player->manager.getTeletextTracks();
-	for (std::vector<Track>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+	const std::vector<Track> &tracks = player->manager.getTeletextTracks();
+	for (std::vector<Track>::const_iterator it = tracks.begin(); it != tracks.end(); ++it) {
 		if (it->type == 1)
 			return it->pid;
 	}
@@ -622,7 +622,7 @@ void cDemux::getSTC(int64_t * STC)
 	lt_debug("%s #%d\n", __FUNCTION__, num);
 	/* this is a guess, but seems to work... int32_t gives errno 515... */
 #define STC_TYPE uint64_t
-	STC_TYPE stc;
+	STC_TYPE stc = 0;
 	if (ioctl(fd, DEMUX_GET_CURRENT_STC, &stc))
 		perror("cDemux::getSTC DEMUX_GET_CURRENT_STC");
 	*STC = (stc >> 32);
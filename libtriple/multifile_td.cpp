@@ -0,0 +1,399 @@
+/*
+ * cMultiFile: multiple recording parts presented as one
+ * continuous memory mapped file
+ *
+ * License: GPL v2 or later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "multifile_td.h"
+#include "lt_debug.h"
+#define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_PLAYBACK, this, args)
+#define lt_info(args...)  _lt_info(TRIPLE_DEBUG_PLAYBACK, this, args)
+
+/* f_type of the network and user space file systems */
+static const long remote_fs[] = {
+	0x6969,		/* NFS */
+	0x517b,		/* SMB */
+	0xff534d42,	/* CIFS */
+	0xfe534d42,	/* SMB2 */
+	0x65735546,	/* FUSE */
+	0
+};
+
+/* A page of a mapping that can't be read (bad sector, unplugged disk,
+   truncated file) raises SIGBUS instead of failing a read(). Span() touches
+   the pages it hands out with the handler armed, a fault there jumps back
+   and fails the span. A fault while the caller reads a span later on gets
+   a page of zeros mapped over the bad one, and the window's next Span()
+   fails. Other faults go to the previous handler */
+#define MF_MAX_MAPS 16
+static uint8_t *volatile maps[MF_MAX_MAPS];
+static volatile size_t map_lens[MF_MAX_MAPS];
+static volatile int map_failed[MF_MAX_MAPS];
+static __thread sigjmp_buf *volatile fault_jmp;
+static __thread const uint8_t *fault_start, *fault_end;
+static struct sigaction prev_sigbus;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+static long page_size;
+
+static void sigbus_handler(int sig, siginfo_t *si, void *ctx)
+{
+	uint8_t *addr = (uint8_t *)si->si_addr;
+	if (fault_jmp && addr >= fault_start && addr < fault_end)
+		siglongjmp(*fault_jmp, 1);
+	for (int i = 0; i < MF_MAX_MAPS; i++)
+	{
+		uint8_t *m = maps[i];
+		if (!m || addr < m || addr >= m + map_lens[i])
+			continue;
+		void *page = (void *)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+		if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+		{
+			map_failed[i] = 1;
+			return;
+		}
+	}
+	if (prev_sigbus.sa_flags & SA_SIGINFO)
+		prev_sigbus.sa_sigaction(sig, si, ctx);
+	else if (prev_sigbus.sa_handler != SIG_DFL && prev_sigbus.sa_handler != SIG_IGN)
+		prev_sigbus.sa_handler(sig);
+	else
+		/* the fault recurs on return, with the default action */
+		sigaction(SIGBUS, &prev_sigbus, NULL);
+}
+
+static void install_sigbus_handler(void)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		page_size = 4096;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sigbus_handler;
+	/* not blocked in the handler, so siglongjmp() needn't restore the mask */
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &prev_sigbus);
+}
+
+static int register_map(uint8_t *map, size_t len)
+{
+	for (int i = 0; i < MF_MAX_MAPS; i++)
+		if (__sync_bool_compare_and_swap(&maps[i], (uint8_t *)NULL, map))
+		{
+			map_failed[i] = 0;
+			map_lens[i] = len;
+			return i;
+		}
+	return -1;	/* the pages are still checked by Span() */
+}
+
+static void unregister_map(int slot)
+{
+	if (slot < 0)
+		return;
+	map_lens[slot] = 0;
+	maps[slot] = NULL;
+}
+
+/* reads a byte of every page of the span with the handler armed */
+static bool readable(const uint8_t *p, size_t len)
+{
+	sigjmp_buf env;
+	if (sigsetjmp(env, 0))
+	{
+		fault_jmp = NULL;
+		return false;
+	}
+	fault_start = p;
+	fault_end = p + len;
+	fault_jmp = &env;
+	/* the reads must not be moved out of the guarded section */
+	__asm__ __volatile__("" ::: "memory");
+	if (len)
+		(void)*(volatile const uint8_t *)p;
+	for (size_t off = page_size - ((uintptr_t)p & (page_size - 1)); off < len; off += page_size)
+		(void)*(volatile const uint8_t *)(p + off);
+	__asm__ __volatile__("" ::: "memory");
+	fault_jmp = NULL;
+	return true;
+}
+
+cMultiFile::cMultiFile()
+{
+	pthread_once(&sigbus_once, install_sigbus_handler);
+	pthread_mutex_init(&mutex, NULL);
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize <= 0)
+		pagesize = 4096;
+}
+
+cMultiFile::~cMultiFile()
+{
+	Close();
+	pthread_mutex_destroy(&mutex);
+}
+
+bool cMultiFile::Add(const char *name, off_t size)
+{
+	part p;
+	p.name = std::string(name);
+	p.fd = -1;
+	p.size = size;
+	p.remote = false;
+	pthread_mutex_lock(&mutex);
+	p.start = 0;
+	if (!parts.empty())
+		p.start = parts.back().start + parts.back().size;
+	parts.push_back(p);
+	/* the first part is always opened, so that the caller notices problems early */
+	bool ret = (parts.size() > 1 || open_part(0));
+	if (!ret)
+		parts.pop_back();
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void cMultiFile::Close(void)
+{
+	pthread_mutex_lock(&mutex);
+	for (unsigned int i = 0; i < parts.size(); i++)
+		if (parts[i].fd != -1)
+			close(parts[i].fd);
+	parts.clear();
+	pthread_mutex_unlock(&mutex);
+}
+
+void cMultiFile::Unmap(mf_window_t &w)
+{
+	unregister_map(w.slot);
+	w.slot = -1;
+	if (w.map)
+		munmap(w.map, w.map_len);
+	w.map = NULL;
+	w.map_len = 0;
+	w.start = 0;
+	free(w.bounce);
+	w.bounce = NULL;
+}
+
+/* needs to be called with mutex locked */
+bool cMultiFile::open_part(int n)
+{
+	if (parts[n].fd != -1)
+		return true;
+	parts[n].fd = open(parts[n].name.c_str(), O_RDONLY);
+	if (parts[n].fd < 0)
+	{
+		lt_info("%s cannot open '%s' (%m)\n", __func__, parts[n].name.c_str());
+		return false;
+	}
+	fcntl(parts[n].fd, F_SETFD, FD_CLOEXEC);
+	struct statfs sfs;
+	if (!fstatfs(parts[n].fd, &sfs))
+		for (int i = 0; remote_fs[i]; i++)
+			if ((unsigned long)sfs.f_type == (unsigned long)remote_fs[i])
+				parts[n].remote = true;
+	return true;
+}
+
+/* needs to be called with mutex locked. For timeshift, the last
+   part might be still growing, so refresh its size */
+off_t cMultiFile::update_size(void)
+{
+	if (parts.empty())
+		return 0;
+	part &p = parts.back();
+	struct stat st;
+	if (p.fd != -1 && fstat(p.fd, &st) == 0)
+		p.size = st.st_size;
+	return p.start + p.size;
+}
+
+/* needs to be called with mutex locked, returns -1 on EOF */
+int cMultiFile::find_part(off_t pos)
+{
+	if (parts.empty() || pos < 0)
+		return -1;
+	if (pos >= parts.back().start + parts.back().size && pos >= update_size())
+		return -1;
+	/* binary search, the parts are sorted by start offset */
+	int lo = 0, hi = parts.size() - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (parts[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+off_t cMultiFile::Size(void)
+{
+	pthread_mutex_lock(&mutex);
+	off_t ret = update_size();
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+off_t cMultiFile::PartStart(int n)
+{
+	off_t ret = -1;
+	pthread_mutex_lock(&mutex);
+	if (n >= 0 && n < (int)parts.size())
+		ret = parts[n].start;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+/* needs to be called with mutex locked. The rare case of a span that
+   crosses the boundary between two parts and the parts on network file
+   systems are served from a copy */
+const uint8_t *cMultiFile::stitch(mf_window_t &w, int n, off_t pos, size_t *len)
+{
+	if (!w.bounce)
+		w.bounce = (uint8_t *)malloc(MF_SPAN_MAX);
+	if (!w.bounce)
+	{
+		lt_info("%s allocating bounce buffer failed (%m)\n", __func__);
+		*len = 0;
+		return NULL;
+	}
+	size_t done = 0;
+	while (done < *len && n < (int)parts.size())
+	{
+		if (!open_part(n))
+			break;
+		off_t lpos = pos + done - parts[n].start;
+		size_t todo = *len - done;
+		if ((off_t)todo > parts[n].size - lpos)
+			todo = parts[n].size - lpos;
+		ssize_t r = pread(parts[n].fd, w.bounce + done, todo, lpos);
+		if (r <= 0)
+			break;
+		done += r;
+		if (pos + (off_t)done >= parts[n].start + parts[n].size)
+			n++;
+	}
+	lt_debug("%s stitched %zd bytes at %lld\n", __func__, done, (long long)pos);
+	*len = done;
+	return done ? w.bounce : NULL;
+}
+
+/* returns a pointer to up to *len bytes at virtual offset pos, *len is
+   updated with the number of bytes that are actually available. The data
+   is served directly from the mapping, no copy is made unless the span
+   crosses a part boundary or the part is on a network file system.
+   Returns NULL on EOF or error. */
+const uint8_t *cMultiFile::Span(mf_window_t &w, off_t pos, size_t *len)
+{
+	if (w.slot > -1 && map_failed[w.slot])
+	{
+		lt_info("%s read error in the window at %lld\n", __func__, (long long)w.start);
+		Unmap(w);
+		*len = 0;
+		return NULL;
+	}
+	const uint8_t *ret = map_span(w, pos, len);
+	if (ret && !readable(ret, *len))
+	{
+		lt_info("%s read error at %lld\n", __func__, (long long)pos);
+		Unmap(w);
+		*len = 0;
+		return NULL;
+	}
+	return ret;
+}
+
+const uint8_t *cMultiFile::map_span(mf_window_t &w, off_t pos, size_t *len)
+{
+	size_t want = *len;
+	if (want > MF_SPAN_MAX)
+		want = MF_SPAN_MAX;
+
+	/* fast path: still inside the current window */
+	if (w.map && pos >= w.start && pos + (off_t)want <= w.start + (off_t)w.map_len)
+	{
+		*len = want;
+		return w.map + (pos - w.start);
+	}
+
+	const uint8_t *ret = NULL;
+	pthread_mutex_lock(&mutex);
+	int n = find_part(pos);
+	if (n < 0)
+	{
+		*len = 0;
+		goto out;
+	}
+	{
+		off_t end = parts[n].start + parts[n].size;
+		if (n == (int)parts.size() - 1 && pos + (off_t)want > end)
+			end = update_size();
+		if (pos + (off_t)want > end)
+		{
+			if (n < (int)parts.size() - 1)
+			{
+				*len = want;
+				ret = stitch(w, n, pos, len);
+				goto out;
+			}
+			want = end - pos;
+		}
+		if (!open_part(n))
+		{
+			*len = 0;
+			goto out;
+		}
+		if (parts[n].remote)
+		{
+			/* a mapping can't report the errors of a network file system */
+			*len = want;
+			ret = stitch(w, n, pos, len);
+			goto out;
+		}
+		/* map a new window, starting at the page containing pos */
+		off_t lpos = pos - parts[n].start;
+		off_t moff = lpos & ~((off_t)pagesize - 1);
+		size_t mlen = MF_WINDOW_SIZE;
+		if (moff + (off_t)mlen > end - parts[n].start)
+			mlen = end - parts[n].start - moff;
+		unregister_map(w.slot);
+		w.slot = -1;
+		if (w.map)
+			munmap(w.map, w.map_len);
+		w.map = (uint8_t *)mmap(NULL, mlen, PROT_READ, MAP_SHARED, parts[n].fd, moff);
+		if (w.map == MAP_FAILED)
+		{
+			lt_info("%s mmap part %d offset %lld len %zd failed (%m)\n",
+				__func__, n, (long long)moff, mlen);
+			w.map = NULL;
+			w.map_len = 0;
+			*len = 0;
+			goto out;
+		}
+		madvise(w.map, mlen, MADV_SEQUENTIAL);
+		w.map_len = mlen;
+		w.slot = register_map(w.map, mlen);
+		w.start = parts[n].start + moff;
+		*len = want;
+		ret = w.map + (pos - w.start);
+	}
+ out:
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
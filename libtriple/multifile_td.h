@@ -0,0 +1,62 @@
+#ifndef __MULTIFILE_TD_H
+#define __MULTIFILE_TD_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/* mappings are done in windows of MF_WINDOW_SIZE, a single span is never
+   longer than MF_SPAN_MAX, so that it always fits into a fresh window */
+#define MF_WINDOW_SIZE (2 * 1024 * 1024)
+#define MF_SPAN_MAX (512 * 1024)
+
+/* a mapped window into one part of a cMultiFile. Every user of the
+   file (play thread, position probing, ...) needs its own window,
+   the pointers returned by cMultiFile::Span() stay valid until the
+   next call with the same window */
+typedef struct mf_window {
+	uint8_t *map;
+	size_t map_len;
+	off_t start;		/* virtual offset of map[0] */
+	uint8_t *bounce;	/* spans crossing a part boundary are stitched here */
+	int slot;		/* of map in the SIGBUS handler's table, -1 if none */
+	mf_window() : map(NULL), map_len(0), start(0), bounce(NULL), slot(-1) {}
+} mf_window_t;
+
+/* presents a list of files (001.vdr, 002.vdr... or foo.001.ts, foo.002.ts...)
+   as one continuous, memory mapped, read-only file. The last part may grow
+   (timeshift), its size is refreshed by Size() and on access beyond the
+   known end. Parts on network file systems are read with pread() instead,
+   a page of a mapping that can't be read fails the span (see Span()) */
+class cMultiFile
+{
+	private:
+		struct part {
+			std::string name;
+			int fd;
+			off_t start;
+			off_t size;
+			bool remote;	/* on a network file system, not mapped */
+		};
+		std::vector<part> parts;
+		pthread_mutex_t mutex;
+		long pagesize;
+		int find_part(off_t pos);
+		bool open_part(int n);
+		off_t update_size(void);
+		const uint8_t *stitch(mf_window_t &w, int n, off_t pos, size_t *len);
+		const uint8_t *map_span(mf_window_t &w, off_t pos, size_t *len);
+	public:
+		cMultiFile();
+		~cMultiFile();
+		bool Add(const char *name, off_t size);
+		void Close(void);
+		void Unmap(mf_window_t &w);
+		off_t Size(void);
+		int Parts(void) { return parts.size(); };
+		off_t PartStart(int n);
+		const uint8_t *Span(mf_window_t &w, off_t pos, size_t *len);
+};
+#endif
@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <cstring>
 #include "playback_td.h"
@@ -18,16 +20,39 @@
 #include <tddevices.h>
 #define DVR	"/dev/" DEVICE_NAME_PVR
 
-static int mp_syncPES(uint8_t *, int, bool quiet = false);
-static int sync_ts(uint8_t *, int);
-static inline uint16_t get_pid(uint8_t *buf);
+/* trick mode: time between two I-frames on screen, maximum speed and
+   how far to look for the next I-frame before giving up */
+#define TRICK_INTERVAL	250
+#define TRICK_SPEED_MAX	64
+#define TRICK_SCAN_MAX	(8 * 1024 * 1024)
+
+/* PTS based pacing: default lead in ms (TRIPLE_PLAYBACK_LEAD overrides,
+   0 disables it) and how often the lead statistics are logged */
+#define INJECT_LEAD	1000
+#define LEAD_STATS	10000
+
+/* seeking: stop when closer than about one GOP to the target */
+#define SEEK_TOLERANCE	45000
+#define SEEK_MAX_READS	12
+
+/* files modified less than this many seconds before Start() are followed
+   by the tracker thread */
+#define GROWING_AGE	10
+
+/* ms to wait for more data at the end of the file */
+#define EOF_WAIT	100
+
+static int mp_syncPES(const uint8_t *, int, bool quiet = false);
+static int sync_ts(const uint8_t *, int);
+static inline uint16_t get_pid(const uint8_t *buf);
 static void *start_playthread(void *c);
+static void *start_trackthread(void *c);
 static void playthread_cleanup_handler(void *);
+static int64_t monotonic_ms(void);
 
 static pthread_cond_t playback_ready_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t playback_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static pthread_mutex_t currpos_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t inbufpos_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int dvrfd = -1;
@@ -49,18 +74,30 @@ cPlayback::cPlayback(int)
 {
 	lt_debug("%s\n", __FUNCTION__);
 	thread_started = false;
+	track_started = false;
+	track_seq = 0;
 	inbuf = NULL;
-	pesbuf = NULL;
+	outbuf = NULL;
+	outbuf_len = 0;
 	filelist.clear();
-	curr_fileno = -1;
-	in_fd = -1;
 	streamtype = 0;
+	playstate = STATE_STOP;
+	playback_speed = 0;
+	state_time = 0;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&state_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&state_mutex, NULL);
 }
 
 cPlayback::~cPlayback()
 {
 	lt_debug("%s\n", __FUNCTION__);
 	Close();
+	pthread_cond_destroy(&state_cond);
+	pthread_mutex_destroy(&state_mutex);
 }
 
 
@@ -76,8 +113,14 @@ bool cPlayback::Open(playmode_t mode)
 	playMode = mode;
 	filetype = FILETYPE_TS;
 	playback_speed = 0;
-	last_size = 0;
-	_pts_end = 0;
+	can_trick = false;
+	have_psi = false;
+	inject_lead = INJECT_LEAD;
+	const char *tmp = getenv("TRIPLE_PLAYBACK_LEAD");
+	if (tmp)
+		inject_lead = atoi(tmp);
+	lead_cnt = 0;
+	lead_time = 0;
 	astreams.clear();
 	memset(&cc, 0, 256);
 	return true;
@@ -87,23 +130,40 @@ bool cPlayback::Open(playmode_t mode)
 void cPlayback::Close(void)
 {
 	lt_info("%s\n", __FUNCTION__);
-	playstate = STATE_STOP;
+	set_state(STATE_STOP, playback_speed);
 	if (thread_started)
 	{
 		lt_info("%s: before pthread_join\n", __FUNCTION__);
 		pthread_join(thread, NULL);
 	}
 	thread_started = false;
-	lt_info("%s: after pthread_join\n", __FUNCTION__);
-	mf_close();
+	if (track_started)
+		pthread_join(track_thread, NULL);
+	track_started = false;
+	lt_info("%s: after pthread_join (%lld ms)\n", __FUNCTION__, monotonic_ms() - state_time);
+	if (!ptsmap_name.empty())
+	{
+		/* don't leave a map next to a timeshift file that was still growing */
+		off_t size = 0;
+		for (unsigned int i = 0; i < filelist.size(); i++)
+			size += filelist[i].Size;
+		if (pts_start > -1 && size == mf.Size())
+			ptsmap.Save(ptsmap_name.c_str(), pts_start, size);
+	}
+	ptsmap.Clear();
+	ptsmap_name.clear();
+	vdrindex.Close();
+	mf.Unmap(rwin);
+	mf.Unmap(pwin);
+	mf.Close();
 	filelist.clear();
+	iframes.clear();
 
 	if (inbuf)
 		free(inbuf);
 	inbuf = NULL;
-	if (pesbuf)
-		free(pesbuf);
-	pesbuf = NULL;
+	outbuf = NULL;
+	outbuf_len = 0;
 
 	/* don't crash */
 	if (audioDecoder)
@@ -136,13 +196,6 @@ bool cPlayback::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 		lt_info("allocating input buffer failed (%m)\n");
 		return false;
 	}
-	if (!pesbuf)
-		pesbuf = (uint8_t *)malloc(PESBUF_SIZE); /* 128 k */
-	if (!pesbuf)
-	{
-		lt_info("allocating PES buffer failed (%m)\n");
-		return false;
-	}
 	filelist_t file;
 	file.Name = std::string(filename);
 	file.Size = s.st_size;
@@ -178,60 +231,80 @@ bool cPlayback::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 
 	filelist.push_back(file);
 	filelist_auto_add();
-	if (mf_open(0) < 0)
-		return false;
+	for (unsigned int i = 0; i < filelist.size(); i++)
+	{
+		if (!mf.Add(filelist[i].Name.c_str(), filelist[i].Size))
+		{
+			mf.Close();
+			filelist.clear();
+			return false;
+		}
+	}
+
+	if (filetype == FILETYPE_VDR)
+	{
+		std::string::size_type p = filelist[0].Name.rfind('/');
+		std::string index = "index.vdr";
+		if (p != std::string::npos)
+			index = filelist[0].Name.substr(0, p + 1) + index;
+		vdrindex.Open(index.c_str(), &mf);
+	}
+	can_trick = (filetype == FILETYPE_TS || vdrindex.Frames() > 0);
 
 	pts_start = pts_end = pts_curr = -1;
-	pesbuf_pos = 0;
 	curr_pos = 0;
+	trick_pos = -1;
+	trick_time = 0;
 	inbuf_pos = 0;
-	inbuf_sync = 0;
-	r = mf_getsize();
+	outbuf_len = 0;
+	r = mf.Size();
 
 	if (r > INBUF_SIZE)
-	{
-		if (mp_seekSync(r - INBUF_SIZE) < 0)
-			return false;
-		while(true) {
-			if (inbuf_read() <= 0)
-				break; // EOF
-			if (curr_pos >= r) //just to make sure...
-				break;
-		}
-		if (filetype == FILETYPE_TS)
-			for (r = (inbuf_pos / 188) * 188; r > 0; r -= 188)
-			{
-				pts_end = get_pts(inbuf + r, false, inbuf_pos - r);
-				if (pts_end > -1)
-					break;
-			}
-		else
-			pts_end = pts_curr;
-	}
+		pts_end = get_end_pts(r);
 	else
 		pts_end = -1; /* unknown */
 
 	if (mp_seekSync(0) < 0)
 		return false;
 
-	pesbuf_pos = 0;
-	inbuf_pos = 0;
-	inbuf_sync = 0;
-	while (inbuf_pos < INBUF_SIZE / 2 && inbuf_read() > 0) {};
-	for (r = 0; r < inbuf_pos - 188; r += 188)
+	if (filetype == FILETYPE_TS)
 	{
-		pts_start = get_pts(inbuf + r, false, inbuf_pos - r);
-		if (pts_start > -1)
-			break;
+		have_psi = probe_psi();
+		/* look for the start PTS (and PIDs if there is no PMT) without consuming the data */
+		size_t len = INBUF_SIZE / 2;
+		const uint8_t *p = mf.Span(rwin, curr_pos, &len);
+		if (p)
+			scan_ts(p, len / 188 * 188, curr_pos);
+		if (have_psi && apid == 0 && !astreams.empty())
+		{
+			/* select the audio stream now, the play thread starts with it */
+			std::map<uint16_t, AStream>::iterator aI = astreams.begin();
+			while (aI != astreams.end() && aI->second.ac3)
+				aI++;
+			if (aI == astreams.end())
+				aI = astreams.begin();
+			apid = aI->first;
+			ac3 = aI->second.ac3;
+			lt_info("%s selecting audio pid 0x%04hx ac3:%d\n", __FUNCTION__, apid, ac3);
+		}
 	}
+	else
+		while (inbuf_pos < INBUF_SIZE / 2 && inbuf_read() > 0) {};
+	/* after the scan, which may have found the video pid. Once playback
+	   runs, only the tracker thread changes pts_start, pts_end and
+	   bytes_per_second */
+	pts_start = get_start_pts();
 	pts_curr = pts_start;
 	bytes_per_second = -1;
 	if (pts_end != -1 && pts_start > pts_end) /* PTS overflow during this file */
 		pts_end += 0x200000000ULL;
 	int duration = (pts_end - pts_start) / 90000;
 	if (duration > 0)
-		bytes_per_second = mf_getsize() / duration;
+		bytes_per_second = mf.Size() / duration;
 	lt_info("start: %lld end %lld duration %d bps %lld\n", pts_start, pts_end, duration, bytes_per_second);
+	ptsmap_name = filelist[0].Name + ".ptsmap";
+	if (pts_start > -1)
+		ptsmap.Load(ptsmap_name.c_str(), pts_start, mf.Size());
 	/* yes, we start in pause mode... */
 	playback_speed = 0;
 	if (pts_start == -1)
@@ -244,6 +317,15 @@ bool cPlayback::Start(char *filename, unsigned short vp, int vtype, unsigned sho
 	else
 		pthread_cond_wait(&playback_ready_cond, &playback_ready_mutex);
 	pthread_mutex_unlock(&playback_ready_mutex);
+	/* a timeshift file that is still empty or being written */
+	if (pts_start == -1 || pts_end == -1 ||
+	    (!stat(filelist.back().Name.c_str(), &s) && time(NULL) - s.st_mtime < GROWING_AGE))
+	{
+		if (pthread_create(&track_thread, 0, start_trackthread, this) != 0)
+			lt_info("pthread_create (tracker) failed\n");
+		else
+			track_started = true;
+	}
 	return true;
 }
 
@@ -254,10 +336,19 @@ static void *start_playthread(void *c)
 	return NULL;
 }
 
+static void *start_trackthread(void *c)
+{
+	cPlayback *obj = (cPlayback *)c;
+	obj->trackthread();
+	return NULL;
+}
+
 void cPlayback::playthread(void)
 {
 	thread_started = true;
 	int ret, towrite;
+	int64_t start, end;
+	off_t bps;
 	dvrfd = open(DVR, O_WRONLY);
 	if (dvrfd < 0)
 	{
@@ -295,30 +386,61 @@ void cPlayback::playthread(void)
 
 	while (playstate != STATE_STOP)
 	{
-		if (playstate == STATE_INIT)
+		if (playback_speed == 0)
 		{
-			/* hack for timeshift to determine start PTS */
-			pthread_mutex_lock(&inbufpos_mutex);
-			ret = inbuf_read();
-			pthread_mutex_unlock(&inbufpos_mutex);
-			if (ret < 0)
-				break;
-			usleep(100000);
-			if (pts_start == -1)
-				continue;
+			/* acknowledge the pause and sleep until the next state change */
+			pthread_mutex_lock(&state_mutex);
+			if (playstate != STATE_STOP && playstate != STATE_PAUSE)
+			{
+				lt_debug("%s pause acknowledged after %lld ms\n", __FUNCTION__, monotonic_ms() - state_time);
+				playstate = STATE_PAUSE;
+				pthread_cond_broadcast(&state_cond);
+			}
+			while (playback_speed == 0 && playstate != STATE_STOP)
+				pthread_cond_wait(&state_cond, &state_mutex);
+			if (playstate != STATE_STOP)
+				lt_debug("%s resumed after %lld ms\n", __FUNCTION__, monotonic_ms() - state_time);
+			pthread_mutex_unlock(&state_mutex);
+			continue;
 		}
-
-		if (playback_speed == 0)
+		snapshot(start, end, bps);
+		if (start == -1)
 		{
-			playstate = STATE_PAUSE;
-			usleep(1);
+			/* timeshift: the tracker wakes us up when it has found the start PTS */
+			state_wait(1000);
 			continue;
 		}
+		if (can_trick && playback_speed != 1 && outbuf_len == 0)
+		{
+			/* trick mode: wait until the last I-frame has been on screen long enough */
+			int64_t wait = trick_time + TRICK_INTERVAL - monotonic_ms();
+			if (wait > 0)
+			{
+				state_wait(wait);
+				continue;
+			}
+		}
+		if (playback_speed == 1 && outbuf_len == 0 && inject_wait())
+			continue;
 		pthread_mutex_lock(&inbufpos_mutex);
-		ret = inbuf_read();
+		ret = 0;
+		off_t last_pos = curr_pos;
+		bool starved = false;
+		if (outbuf_len == 0)
+		{
+			ret = inbuf_read();
+			/* at the end of the file, or at the live end of a timeshift */
+			starved = (ret == 0 && outbuf_len == 0 && curr_pos == last_pos);
+		}
 		pthread_mutex_unlock(&inbufpos_mutex);
 		if (ret < 0)
 			break;
+		if (starved)
+		{
+			/* the tracker wakes us up when the file grows */
+			state_wait(EOF_WAIT);
+			continue;
+		}
 
 		/* autoselect PID for PLAYMODE_FILE */
 		if (apid == 0 && astreams.size() > 0)
@@ -336,26 +458,35 @@ void cPlayback::playthread(void)
 		}
 
 		pthread_mutex_lock(&inbufpos_mutex);
-		towrite = inbuf_pos / 188 * 188; /* TODO: smaller chunks? */
+		towrite = outbuf_len; /* TODO: smaller chunks? */
 		if (towrite == 0)
 		{
 			pthread_mutex_unlock(&inbufpos_mutex);
 			continue;
 		}
  retry:
-		ret = write(dvrfd, inbuf, towrite);
+		ret = write(dvrfd, outbuf, towrite);
 		if (ret < 0)
 		{
 			if (errno == EAGAIN && playstate != STATE_STOP)
 				goto retry;
+			pthread_mutex_unlock(&inbufpos_mutex);
 			lt_info("%s write dvr failed: %m\n", __FUNCTION__);
 			break;
 		}
-		memmove(inbuf, inbuf + ret, inbuf_pos - ret);
-		inbuf_pos -= ret;
+		outbuf += ret;
+		outbuf_len -= ret;
+		if (outbuf_len == 0)
+			inbuf_pos = 0;
 		pthread_mutex_unlock(&inbufpos_mutex);
 	}
 
+	/* nobody must wait for a play thread that is gone */
+	pthread_mutex_lock(&state_mutex);
+	playstate = STATE_STOP;
+	pthread_cond_broadcast(&state_cond);
+	pthread_mutex_unlock(&state_mutex);
+
 	pthread_cleanup_pop(1);
 	pthread_exit(NULL);
 }
@@ -404,8 +535,13 @@ bool cPlayback::SetAPid(unsigned short pid, int _ac3)
 bool cPlayback::SetSpeed(int speed)
 {
 	lt_info("%s speed = %d\n", __FUNCTION__, speed);
-	if (speed < 0)
-		speed = 1; /* fast rewind not yet implemented... */
+	if (speed < 0 && !can_trick)
+		speed = 1; /* fast rewind needs TS or an index... */
+	if (speed > TRICK_SPEED_MAX)
+		speed = TRICK_SPEED_MAX;
+	if (speed < -TRICK_SPEED_MAX)
+		speed = -TRICK_SPEED_MAX;
+	playstate_t state = playstate;
 	if (speed == 1 && playback_speed != 1)
 	{
 		if (playback_speed == 0)
@@ -421,16 +557,29 @@ bool cPlayback::SetSpeed(int speed)
 		}
 		audioDecoder->Start();
 		videoDecoder->Start();
-		playstate = STATE_PLAY;
+		state = STATE_PLAY;
 		/* cPlayback is a friend of cAudio and can use private methods */
 		audioDecoder->do_mute(audioDecoder->Muted, false);
 	}
-	if (playback_speed == 1 && speed > 1)
+	if ((playback_speed == 0 || playback_speed == 1) && (speed > 1 || speed < 0))
 	{
+		if (playback_speed == 0)
+		{
+			videoDemux->Stop();
+			videoDemux->Start();
+			videoDecoder->Start();
+		}
 		audioDecoder->mute(false);
 		videoDecoder->FastForwardMode();
 	}
-	playback_speed = speed;
+	if (speed != playback_speed)
+		trick_pos = -1;	/* restart the trick mode at the current position */
+	if (speed > 1)
+		state = STATE_FF;
+	else if (speed < 0)
+		state = STATE_REW;
+	/* a pause is acknowledged by the play thread, see SetPosition() */
+	set_state(state, speed);
 	if (playback_speed == 0)
 	{
 		audioDecoder->Stop();
@@ -450,73 +599,21 @@ bool cPlayback::GetSpeed(int &speed) const
 // in milliseconds
 bool cPlayback::GetPosition(int &position, int &duration)
 {
-	int64_t tmppts;
+	int64_t start, end, curr;
+	off_t bps;
 	lt_debug("%s\n", __FUNCTION__);
-	off_t currsize = mf_getsize();
-	bool update = false;
-	/* handle a growing file, e.g. for timeshift.
-	   this might be pretty expensive... */
-	if (filetype == FILETYPE_TS && filelist.size() == 1)
-	{
-		off_t tmppos = currsize - PESBUF_SIZE;
-		if (currsize > last_size && (currsize - last_size) < 10485760 &&
-		    bytes_per_second > 0 && _pts_end > 0)
-		{
-			/* guess the current endpts... */
-			tmppts = (currsize - last_size) * 90000 / bytes_per_second;
-			pts_end = _pts_end + tmppts;
-		}
-		else if (currsize != last_size && tmppos > 0)
-		{
-			pthread_mutex_lock(&currpos_mutex);
-			off_t oldpos = curr_pos;
-			ssize_t n, r;
-			int s;
-			mf_lseek(tmppos);
-			n = read(in_fd, pesbuf, PESBUF_SIZE); /* abuse the pesbuf... */
-			s = sync_ts(pesbuf, n);
-			if (s >= 0)
-			{
-				n -= s;
-				for (r = (n / 188) * 188; r > 0; r -= 188)
-				{
-					tmppts = get_pts(pesbuf + r + s, false, n - r);
-					if (tmppts > -1)
-					{
-						lt_debug("n: %d s: %d endpts %lld size: %lld\n", n, s, tmppts, currsize);
-						pts_end = tmppts;
-						_pts_end = tmppts;
-						update = true;
-						/* file size has changed => update endpts */
-						last_size = currsize;
-						break;
-					}
-				}
-			}
-			mf_lseek(oldpos);
-			pthread_mutex_unlock(&currpos_mutex);
-		}
-	}
-	if (pts_end != -1 && pts_start > pts_end) /* should trigger only once ;) */
-	{
-		pts_end += 0x200000000ULL;
-		update = true;
-	}
-
-	if (pts_curr != -1 && pts_curr < pts_start)
-		tmppts = pts_curr + 0x200000000ULL - pts_start;
-	else
-		tmppts = pts_curr - pts_start;
-	if (pts_end != -1 && pts_curr != -1)
+	/* for a growing file, the end PTS is kept up to date by the tracker thread */
+	snapshot(start, end, bps);
+	curr = pts_curr;
+	if (start != -1 && curr != -1 && (end != -1 || vdrindex.Frames() > 0))
 	{
-		position = tmppts / 90;
-		duration = (pts_end - pts_start) / 90;
-		if (update && duration >= 4000)
-		{
-			bytes_per_second = currsize / (duration / 1000);
-			lt_debug("%s: updated bps: %lld size: %lld duration %d\n",
-					__FUNCTION__, bytes_per_second, currsize, duration);
-		}
+		if (curr < start)
+			curr += 0x200000000ULL;
+		position = (curr - start) / 90;
+		if (vdrindex.Frames() > 0)
+			duration = (int64_t)vdrindex.Frames() * 1000 / VDR_FRAMESPERSEC;
+		else
+			duration = (end - start) / 90;
 		return true;
 	}
 	position = 0;
@@ -543,12 +640,18 @@ bool cPlayback::SetPosition(int position, bool absolute)
 //	if (oldspeed != 0)
 		SetSpeed(0);		/* request pause */
 
-	while (playstate == STATE_PLAY)	/* playthread did not acknowledge pause */
-		usleep(1);
-	if (playstate == STATE_STOP)	/* we did get stopped by someone else */
+	/* wait until the playthread has acknowledged the pause */
+	int64_t t = monotonic_ms();
+	pthread_mutex_lock(&state_mutex);
+	while (playstate == STATE_PLAY || playstate == STATE_FF || playstate == STATE_REW)
+		pthread_cond_wait(&state_cond, &state_mutex);
+	ret = (playstate != STATE_STOP);
+	pthread_mutex_unlock(&state_mutex);
+	if (!ret)	/* we did get stopped by someone else */
 		return false;
+	lt_debug("%s pause took %lld ms\n", __FUNCTION__, monotonic_ms() - t);
 
-	ret = (seek_to_pts(target * 90) > 0);
+	ret = (seek_to_pts(target * 90LL) >= 0);
 
 	if (oldspeed != 0)
 	{
@@ -594,15 +697,23 @@ void cPlayback::GetChapters(std::vector<int> &positions, std::vector<std::string
 	titles.clear();
 }
 
+/* seek to pts, which is relative to the start of the file. The nearest known
+   sample points around the target are taken from ptsmap, the position is
+   interpolated between them and the PTS found there becomes a new sample
+   point. If interpolation does not converge (VBR...), bisection takes over.
+   With a filled map, this usually needs one or two reads */
 off_t cPlayback::seek_to_pts(int64_t pts)
 {
-	off_t newpos = curr_pos;
-	int64_t tmppts, ptsdiff;
-	int count = 0;
-	if (pts_start < 0 || pts_end < 0 || bytes_per_second < 0)
+	off_t newpos, lo, hi, pos, ppos;
+	int64_t lo_pts, hi_pts, ppts, start, end;
+	off_t bps;
+	int reads;
+	int64_t t = monotonic_ms();
+	snapshot(start, end, bps);
+	if (start < 0 || end < 0)
 	{
-		lt_info("%s pts_start (%lld) or pts_end (%lld) or bytes_per_second (%lld) not initialized\n",
-			__FUNCTION__, pts_start, pts_end, bytes_per_second);
+		lt_info("%s pts_start (%lld) or pts_end (%lld) not initialized\n",
+			__FUNCTION__, start, end);
 		return -1;
 	}
 	/* sanity check: buffer is without locking, so we must only seek while in pause mode */
@@ -611,41 +722,160 @@ off_t cPlayback::seek_to_pts(int64_t pts)
 		lt_info("%s playstate (%d) != STATE_PAUSE, not seeking\n", __FUNCTION__, playstate);
 		return -1;
 	}
+	if (pts < 0)
+		pts = 0;
+	if (pts > end - start)
+		pts = end - start;
 
-	/* tmppts is normalized current pts */
-	if (pts_curr < pts_start)
-		tmppts = pts_curr + 0x200000000ULL - pts_start;
-	else
-		tmppts = pts_curr - pts_start;
-	while (abs(pts - tmppts) > 90000LL && count < 10)
+	if (vdrindex.Frames() > 0)
 	{
-		count++;
-		ptsdiff = pts - tmppts;
-		newpos += ptsdiff * bytes_per_second / 90000;
-		lt_info("%s try #%d seek from %lldms to %lldms dt %lldms pos %lldk newpos %lldk kB/s %lld\n",
-			__FUNCTION__, count, tmppts / 90, pts / 90, ptsdiff / 90, curr_pos / 1024, newpos / 1024, bytes_per_second / 1024);
-		if (newpos < 0)
-			newpos = 0;
-		newpos = mp_seekSync(newpos);
-		if (newpos < 0)
-			return newpos;
-		pthread_mutex_lock(&inbufpos_mutex);
-		inbuf_pos = 0;
-		inbuf_sync = 0;
-		while (inbuf_pos < INBUF_SIZE * 8 / 10) {
-			if (inbuf_read() <= 0)
-				break; // EOF
+		/* the index knows every frame, start at the I-frame before the target */
+		int frame = vdrindex.IFrame(pts * VDR_FRAMESPERSEC / 90000, -1);
+		if (frame >= 0)
+		{
+			pthread_mutex_lock(&inbufpos_mutex);
+			curr_pos = vdrindex.Pos(frame);
+			pts_curr = (start + (int64_t)frame * 90000 / VDR_FRAMESPERSEC) % 0x200000000LL;
+			inbuf_pos = 0;
+			outbuf_len = 0;
+			pthread_mutex_unlock(&inbufpos_mutex);
+			lt_info("%s to %lldms: frame %d pos %lld (index)\n", __FUNCTION__,
+				pts / 90, frame, (long long)curr_pos);
+			return curr_pos;
 		}
+	}
+
+	lo = 0;
+	lo_pts = 0;
+	hi = mf.Size();
+	hi_pts = end - start;
+	newpos = -1;
+	ptsmap.Bracket(pts, lo, lo_pts, hi, hi_pts);
+	pthread_mutex_lock(&inbufpos_mutex);
+	for (reads = 0; reads < SEEK_MAX_READS; reads++)
+	{
+		if (pts - lo_pts < SEEK_TOLERANCE)
+		{
+			newpos = lo;
+			break;
+		}
+		if (hi - lo < INBUF_SIZE)
+			break;
+		if (reads < 2 && hi_pts > lo_pts)
+			pos = lo + (off_t)((double)(hi - lo) * (pts - lo_pts) / (hi_pts - lo_pts));
+		else
+			pos = lo + (hi - lo) / 2;
+		ppts = probe_pts(pos, ppos);
+		lt_debug("%s #%d [%lld %lld] -> %lld: pts %lld at %lld\n", __FUNCTION__, reads,
+			(long long)lo, (long long)hi, (long long)pos, ppts / 90, (long long)ppos);
+		if (ppts < 0 || ppos >= hi)
+		{
+			/* nothing useful there, don't look again. The PTS at the new
+			   end is unknown, bisect until a probe finds one */
+			hi = pos;
+			hi_pts = lo_pts;
+			continue;
+		}
+		if (ppts <= pts)
+		{
+			lo = ppos;
+			lo_pts = ppts;
+		}
+		else
+		{
+			hi = ppos;
+			hi_pts = ppts;
+		}
+	}
+	if (newpos < 0)
+		newpos = lo;
+
+	newpos = mp_seekSync(newpos);
+	if (newpos < 0)
+	{
 		pthread_mutex_unlock(&inbufpos_mutex);
-		if (pts_curr < pts_start)
-			tmppts = pts_curr + 0x200000000ULL - pts_start;
+		return newpos;
+	}
+	if (filetype == FILETYPE_TS)
+	{
+		/* start at the next I-frame, the decoder would drop everything before anyway */
+		ppos = find_iframe(newpos, ppts);
+		if (ppos >= 0 && ppts >= 0)
+		{
+			newpos = curr_pos = ppos;
+			pts_curr = ppts;
+		}
 		else
-			tmppts = pts_curr - pts_start;
+			pts_curr = lo_pts + start;
 	}
-	lt_info("%s end after %d tries, ptsdiff now %lld sec\n", __FUNCTION__, count, (pts - tmppts) / 90000);
+	else
+		pts_curr = lo_pts + start;
+	inbuf_pos = 0;
+	outbuf_len = 0;
+	pthread_mutex_unlock(&inbufpos_mutex);
+	lt_info("%s to %lldms: pos %lld after %d reads, %lldms, %d sample points\n", __FUNCTION__,
+		pts / 90, (long long)newpos, reads, monotonic_ms() - t, ptsmap.Count());
 	return newpos;
 }
 
+/* look for the first video PTS at or after pos. Returns the PTS relative to
+   the start of the file and its position in ppos */
+int64_t cPlayback::probe_pts(off_t pos, off_t &ppos)
+{
+	int64_t pts = -1, start, end;
+	off_t bps;
+	size_t len = INBUF_SIZE;
+	const uint8_t *p = mf.Span(rwin, pos, &len);
+	ppos = pos;
+	if (!p)
+		return -1;
+	if (filetype == FILETYPE_TS)
+	{
+		int s = sync_ts(p, len);
+		if (s < 0)
+			return -1;
+		for (size_t r = s; r + 188 <= len; r += 188)
+		{
+			pts = get_pts(p + r, false, len - r);
+			if (pts > -1)
+			{
+				ppos = pos + r;
+				break;
+			}
+		}
+	}
+	else
+	{
+		int s = mp_syncPES(p, len, true);
+		if (s < 0)
+			return -1;
+		ppos = pos + s;
+		pts = get_PES_PTS(p + s, len - s, false);
+	}
+	if (pts < 0)
+		return -1;
+	map_pts(ppos, pts);
+	snapshot(start, end, bps);
+	pts -= start;
+	if (pts < 0)
+		pts += 0x200000000ULL;
+	return pts;
+}
+
+/* remember a sample point for seeking */
+void cPlayback::map_pts(off_t pos, int64_t pts)
+{
+	int64_t start, end;
+	off_t bps;
+	snapshot(start, end, bps);
+	if (start < 0)
+		return;
+	pts -= start;
+	if (pts < 0)	/* PTS wraparound */
+		pts += 0x200000000ULL;
+	ptsmap.Add(pos, pts);
+}
+
 bool cPlayback::filelist_auto_add()
 {
 	if (filelist.size() != 1)
@@ -683,103 +913,145 @@ bool cPlayback::filelist_auto_add()
 	return (filelist.size() > 1);
 }
 
-/* the mf_* functions are wrappers for multiple-file I/O */
-int cPlayback::mf_open(int fileno)
+/* find the last video PTS by looking at the end of the file.
+   Uses its own window, so it can be called while the play thread runs */
+int64_t cPlayback::get_end_pts(off_t size, off_t from)
 {
-	if (filelist.empty())
+	int64_t pts = -1;
+	off_t pos = size - INBUF_SIZE;
+	if (pos < from)
+		pos = from;
+	if (pos < 0)
+		pos = 0;
+	size_t len = size - pos;
+	const uint8_t *p = mf.Span(pwin, pos, &len);
+	if (!p)
 		return -1;
+	if (filetype != FILETYPE_TS)
+		return get_PES_PTS(p, len, true);
 
-	if (fileno >= (int)filelist.size())
+	int s = sync_ts(p, len);
+	if (s < 0)
 		return -1;
-
-	mf_close();
-
-	in_fd = open(filelist[fileno].Name.c_str(), O_RDONLY);
-	fcntl(in_fd, F_SETFD, FD_CLOEXEC);
-	if (in_fd != -1)
-		curr_fileno = fileno;
-
-	return in_fd;
+	p += s;
+	len -= s;
+	for (ssize_t r = (len / 188 - 1) * 188; r >= 0; r -= 188)
+	{
+		pts = get_pts(p + r, false, len - r);
+		if (pts > -1)
+			break;
+	}
+	return pts;
 }
 
-int cPlayback::mf_close(void)
+/* find the first video PTS of the file, for a timeshift file that was
+   still empty when playback started */
+int64_t cPlayback::get_start_pts(void)
 {
-	int ret = 0;
-	lt_info("%s in_fd = %d curr_fileno = %d\n", __FUNCTION__, in_fd, curr_fileno);
-	if (in_fd != -1)
-		ret = close(in_fd);
-	in_fd = curr_fileno = -1;
-
-	return ret;
-}
+	size_t len = INBUF_SIZE;
+	const uint8_t *p = mf.Span(pwin, 0, &len);
+	if (!p)
+		return -1;
+	if (filetype != FILETYPE_TS)
+		return get_PES_PTS(p, len, false);
 
-off_t cPlayback::mf_getsize(void)
-{
-	off_t ret = 0;
-	if (filelist.size() == 1 && in_fd != -1)
+	int s = sync_ts(p, len);
+	if (s < 0)
+		return -1;
+	for (size_t r = s; r + 188 <= len; r += 188)
 	{
-		/* for timeshift, we need to deal with a growing file... */
-		struct stat st;
-		if (fstat(in_fd, &st) == 0)
-			return st.st_size;
-		/* else, fallback to filelist.size() */
+		int64_t pts = get_pts(p + r, false, len - r);
+		if (pts > -1)
+			return pts;
 	}
-	for (unsigned int i = 0; i < filelist.size(); i++)
-		ret += filelist[i].Size;
-	return ret;
+	return -1;
 }
 
-off_t cPlayback::mf_lseek(off_t pos)
+/* follow a growing file, e.g. for timeshift. The size is polled, which works
+   on every filesystem (inotify does not see writes done by another host to
+   a network share), and only the newly appended data is looked at */
+void cPlayback::trackthread(void)
 {
-	off_t offset = 0, lpos = pos, ret;
-	unsigned int fileno;
-	/* this is basically needed for timeshifting - to allow
-	   growing files to be handled... */
-	if (filelist.size() == 1 && filetype == FILETYPE_TS)
-	{
-		if (lpos > mf_getsize())
-			return -2;
-		fileno = 0;
-	}
-	else
+	int64_t start, end, pts;
+	off_t bps, size;
+	snapshot(start, end, bps);
+	off_t last = (end == -1) ? 0 : mf.Size(); /* end PTS is known up to here */
+	lt_info("%s starting at %lld\n", __FUNCTION__, (long long)last);
+	while (playstate != STATE_STOP)
 	{
-		for (fileno = 0; fileno < filelist.size(); fileno++)
+		state_wait(1000);
+		size = mf.Size();
+		if (size <= last)
+			continue;
+		snapshot(start, end, bps);
+		if (start == -1)
 		{
-			if (lpos < filelist[fileno].Size)
-				break;
-			offset += filelist[fileno].Size;
-			lpos   -= filelist[fileno].Size;
+			start = get_start_pts();
+			if (start == -1)
+				continue;
+			lt_info("%s found start pts %lld\n", __FUNCTION__, start);
+			publish(start, end, bps);
+			/* the play thread is waiting for it */
+			pthread_mutex_lock(&state_mutex);
+			pthread_cond_broadcast(&state_cond);
+			pthread_mutex_unlock(&state_mutex);
 		}
-		if (fileno == filelist.size())
-			return -2;	// EOF
-	}
-
-	if ((int)fileno != curr_fileno)
-	{
-		lt_info("%s old fileno: %d new fileno: %d, offset: %lld\n", __FUNCTION__, curr_fileno, fileno, (long long)lpos);
-		in_fd = mf_open(fileno);
-		if (in_fd < 0)
+		pts = get_end_pts(size, last);
+		if (pts > -1)
 		{
-			lt_info("cannot open file %d:%s (%m)\n", fileno, filelist[fileno].Name.c_str());
-			return -1;
+			if (pts < start)	/* PTS overflow during this file */
+				pts += 0x200000000ULL;
+			end = pts;
+			last = size;
+			int duration = (end - start) / 90000;
+			if (duration >= 4)
+				bps = size / duration;
+			lt_debug("%s size %lld end %lld duration %ds bps %lld\n",
+				__FUNCTION__, (long long)size, end, duration, (long long)bps);
 		}
+		publish(start, end, bps);
+		/* the play thread may be waiting at the end of the file */
+		pthread_mutex_lock(&state_mutex);
+		pthread_cond_broadcast(&state_cond);
+		pthread_mutex_unlock(&state_mutex);
 	}
+	mf.Unmap(pwin);
+}
 
-	ret = lseek(in_fd, lpos, SEEK_SET);
-	if (ret < 0)
-		return ret;
+/* once playback runs, the tracker thread is the only writer, so a sequence
+   counter is enough to give the readers a consistent view of the 64 bit
+   values without a lock */
+void cPlayback::publish(int64_t start, int64_t end, off_t bps)
+{
+	track_seq++;
+	__sync_synchronize();
+	pts_start = start;
+	pts_end = end;
+	bytes_per_second = bps;
+	__sync_synchronize();
+	track_seq++;
+}
 
-	curr_pos = offset + ret;
-	return curr_pos;
+void cPlayback::snapshot(int64_t &start, int64_t &end, off_t &bps)
+{
+	unsigned int seq;
+	do {
+		while ((seq = track_seq) & 1)
+			usleep(1);
+		__sync_synchronize();
+		start = pts_start;
+		end = pts_end;
+		bps = bytes_per_second;
+		__sync_synchronize();
+	} while (seq != track_seq);
 }
 
-/* gets the PTS at a specific file position from a PES
-   ATTENTION! resets buf!  */
-int64_t cPlayback::get_PES_PTS(uint8_t *buf, int len, bool last)
+/* gets the PTS at a specific file position from a PES */
+int64_t cPlayback::get_PES_PTS(const uint8_t *buf, int len, bool last)
 {
 	int64_t pts = -1;
 	int off, plen;
-	uint8_t *p;
+	const uint8_t *p;
 
 	off = mp_syncPES(buf, len);
 
@@ -826,152 +1098,68 @@ ssize_t cPlayback::inbuf_read()
 	if (filetype == FILETYPE_UNKNOWN)
 		return -1;
 	if (filetype == FILETYPE_TS)
+	{
+		if (playback_speed > 1 || playback_speed < 0)
+			return read_trick();
 		return read_ts();
+	}
 	/* FILETYPE_MPG or FILETYPE_VDR */
-	return read_mpeg();
+	if (can_trick && (playback_speed > 1 || playback_speed < 0))
+		return read_trick();
+	/* a PES packet can be up to 64kB, it needs to fit completely. Without
+	   pacing, experiments found that 80kB is the best buffer size, otherwise
+	   a/v sync seems to suffer and / or audio stutters */
+	return read_mpeg(inject_chunk(80 * 1024, 80 * 1024));
 }
 
 ssize_t cPlayback::read_ts()
 {
-	ssize_t toread, ret = 0, sync, off;
-	toread = INBUF_SIZE - inbuf_pos;
-	bool retry = true;
-	uint8_t *buf;
-	/* fprintf(stderr, "%s:%d curr_pos %lld, inbuf_pos: %ld, toread: %ld\n",
-		__FUNCTION__, __LINE__, (long long)curr_pos, (long)inbuf_pos, (long)toread); */
-
-	if (playback_speed > 1)
+	ssize_t sync;
+	size_t len = inject_chunk(32 * 188, INBUF_SIZE);
+	const uint8_t *buf = mf.Span(rwin, curr_pos, &len);
+	/* fprintf(stderr, "%s:%d curr_pos %lld, len: %ld\n",
+		__FUNCTION__, __LINE__, (long long)curr_pos, (long)len); */
+	if (!buf)
+		return 0; /* EOF */
+
+	sync = sync_ts(buf, len);
+	if (sync < 0)
 	{
-		sync = 0;
-		ssize_t tmpread = PESBUF_SIZE / 188 * 188;
-		int n, skipped = 0;
-		bool skip = false;
-		bool eof = true;
-		pthread_mutex_lock(&currpos_mutex);
-		while (toread > 0)
-		{
-			ssize_t done = 0;
-			while (done < tmpread)
-			{
-				ret = read(in_fd, pesbuf, tmpread - done);
-				if (ret == 0 && retry) /* EOF */
-				{
-					mf_lseek(curr_pos);
-					retry = false;
-					continue;
-				}
-				if (ret < 0)
-				{
-					lt_info("%s failed1: %m\n", __FUNCTION__);
-					pthread_mutex_unlock(&currpos_mutex);
-					return ret;
-				}
-				if (ret == 0 && eof)
-					goto out;
-				eof = false;
-				done += ret;
-				curr_pos += ret;
-			}
-			sync = sync_ts(pesbuf, ret);
-			if (sync != 0)
-			{
-				lt_info("%s out of sync: %d\n", __FUNCTION__, sync);
-				if (sync < 0)
-				{
-					pthread_mutex_unlock(&currpos_mutex);
-					return -1;
-				}
-				memmove(pesbuf, pesbuf + sync, ret - sync);
-				if (pesbuf[0] != 0x47)
-					lt_info("%s:%d??????????????????????????????\n", __FUNCTION__, __LINE__);
-			}
-			for (n = 0; n < done / 188 * 188; n += 188)
-			{
-				buf = pesbuf + n;
-				if (buf[1] & 0x40) // PUSI
-				{
-					/* only video packets... */
-					int of = 4;
-					if (buf[3] & 0x20) // adaptation field
-						of += buf[4] + 1;
-					if ((buf[of + 3] & 0xF0) == 0xE0 && // Video stream
-					    buf[of + 2] == 0x01 && buf[of + 1] == 0x00 && buf[of] == 0x00) // PES
-					{
-						skip = true;
-						skipped++;
-						if (skipped >= playback_speed)
-						{
-							skipped = 0;
-							skip = false;
-						}
-					}
-				}
-				if (! skip)
-				{
-					memcpy(inbuf + inbuf_pos, buf, 188);
-					inbuf_pos += 188;
-					toread -= 188;
-					if (toread <= 0)
-					{
-						/* the output buffer is full, discard the input :-( */
-						if (done - n > 0)
-						{
-							lt_debug("%s not done: %d, resetting filepos\n",
-								__FUNCTION__, done - n);
-							mf_lseek(curr_pos - (done - n));
-						}
-						break;
-					}
-				}
-			}
-		}
- out:
-		pthread_mutex_unlock(&currpos_mutex);
-		if (eof)
-			return 0;
+		lt_info("%s cannot sync\n", __FUNCTION__);
+		/* skip the garbage, but keep a possible start of a packet */
+		if (len > 188)
+			curr_pos += len - 188;
+		return 0;
 	}
-	else
+	if (sync != 0)
 	{
-		pthread_mutex_lock(&currpos_mutex);
-		while(true)
-		{
-			ret = read(in_fd, inbuf + inbuf_pos, toread);
-			if (ret == 0 && retry) /* EOF */
-			{
-				mf_lseek(curr_pos);
-				retry = false;
-				continue;
-			}
-			break;
-		}
-		if (ret <= 0)
-		{
-			pthread_mutex_unlock(&currpos_mutex);
-			if (ret < 0)
-				lt_info("%s failed2: %m\n", __FUNCTION__);
-			return ret;
-		}
-		inbuf_pos += ret;
-		curr_pos += ret;
-		pthread_mutex_unlock(&currpos_mutex);
-
-		sync = sync_ts(inbuf + inbuf_sync, INBUF_SIZE - inbuf_sync);
-		if (sync < 0)
-		{
-			lt_info("%s cannot sync\n", __FUNCTION__);
-			return ret;
-		}
-		inbuf_sync += sync;
+		lt_info("%s out of sync: %zd\n", __FUNCTION__, sync);
+		buf += sync;
+		len -= sync;
+		curr_pos += sync;
 	}
-	/* check for A/V PIDs */
+	len = len / 188 * 188;
+
+	/* the data is written to the DVR straight from the mapping */
+	curr_pos += len;
+	outbuf = buf;
+	outbuf_len = len;
+	scan_ts(buf, len, curr_pos - len);
+	return len;
+}
+
+/* check for A/V PIDs and PTS in a buffer of TS packets */
+void cPlayback::scan_ts(const uint8_t *buf, ssize_t len, off_t pos)
+{
 	uint16_t pid;
-	int i;
+	int i, off;
 	int64_t pts;
-	//fprintf(stderr, "inbuf_pos: %ld - sync: %ld, inbuf_syc: %ld\n", (long)inbuf_pos, (long)sync, (long)inbuf_sync);
+	const uint8_t *p;
 	int synccnt = 0;
-	for (i = 0; i < inbuf_pos - inbuf_sync - 13;) {
-		buf = inbuf + inbuf_sync + i;
-		if (*buf != 0x47)
+	bool mapped = false;
+	for (i = 0; i < len - 13;) {
+		p = buf + i;
+		if (*p != 0x47)
 		{
 			synccnt++;
 			i++;
@@ -980,55 +1168,44 @@ ssize_t cPlayback::read_ts()
 		if (synccnt)
 			lt_info("%s TS went out of sync %d\n", __FUNCTION__, synccnt);
 		synccnt = 0;
-		if (!(buf[1] & 0x40))	/* PUSI */
+		if (!(p[1] & 0x40))	/* PUSI */
 		{
 			i += 188;
 			continue;
 		}
 		off = 0;
-		if (buf[3] & 0x20)	/* adaptation field? */
-			off = buf[4] + 1;
-		pid = get_pid(buf + 1);
-		/* PES signature is at buf + 4, streamtype is after 00 00 01 */
-		switch (buf[4 + 3 + off])
+		if (p[3] & 0x20)	/* adaptation field? */
+			off = p[4] + 1;
+		if (off > 176)
+		{
+			i += 188;
+			continue;
+		}
+		pid = get_pid(p + 1);
+		/* PES signature is at p + 4, streamtype is after 00 00 01 */
+		switch (p[4 + 3 + off])
 		{
 		case 0xe0 ... 0xef:	/* video stream */
 			if (vpid == 0)
 				vpid = pid;
-			pts = get_pts(buf + 4 + off, true, inbuf_pos - inbuf_sync - i - off - 4);
+			pts = get_pts(p + 4 + off, true, len - i - off - 4);
 			if (pts < 0)
 				break;
 			pts_curr = pts;
-			if (pts_start < 0)
+			if (!mapped)
 			{
-				lt_info("%s updating pts_start to %lld ", __FUNCTION__, pts);
-				pts_start = pts;
-				if (pts_end > -1)
-				{
-					if (pts_end < pts_start)
-					{
-						pts_end += 0x200000000ULL;
-						fprintf(stderr, "pts_end to %lld ", pts_end);
-					}
-					int duration = (pts_end - pts_start) / 90000;
-					if (duration > 0)
-					{
-						bytes_per_second = (mf_getsize() - curr_pos) / duration;
-						fprintf(stderr, "bytes_per_second to %lldk duration to %ds at %lldk",
-						bytes_per_second / 1024, duration, curr_pos / 1024);
-					}
-				}
-				fprintf(stderr, "\n");
+				map_pts(pos + i, pts);
+				mapped = true;
 			}
 			break;
 		case 0xbd:		/* private stream 1 - ac3 */
 		case 0xc0 ... 0xdf:	/* audio stream */
-			if (astreams.find(pid) != astreams.end())
+			if (have_psi || astreams.find(pid) != astreams.end())
 				break;
 			AStream tmp;
-			if (buf[7 + off] == 0xbd)
+			if (p[7 + off] == 0xbd)
 			{
-				if (buf[12 + off] == 0x24)	/* 0x24 == TTX */
+				if (p[12 + off] == 0x24)	/* 0x24 == TTX */
 					break;
 				tmp.ac3 = true;
 			}
@@ -1041,46 +1218,440 @@ ssize_t cPlayback::read_ts()
 		}
 		i += 188;
 	}
+}
 
-	// fprintf(stderr, "%s:%d ret %ld\n", __FUNCTION__, __LINE__, (long long)ret);
+/* PTS based pacing for normal playback. Instead of writing as much as the
+   DVR takes, the play thread waits while the last video PTS written is more
+   than inject_lead ms ahead of the decoder clock. Returns true if the play
+   thread should wait and look again */
+bool cPlayback::inject_wait(void)
+{
+	int64_t stc = 0;
+	if (inject_lead <= 0 || pts_curr < 0)
+		return false;
+	videoDemux->getSTC(&stc);
+	if (stc == 0)	/* decoder is not running (yet) */
+		return false;
+	/* the STC is only 32 bits wide */
+	int lead = (int32_t)((uint32_t)pts_curr - (uint32_t)stc) / 90;
+	if (lead < -10000 || lead > 60000)
+	{
+		/* the clock is not related to this stream (yet), just fill the buffers */
+		lt_debug("%s ignoring lead %dms (pts %lld stc %lld)\n", __FUNCTION__, lead, pts_curr, stc);
+		return false;
+	}
+
+	int64_t now = monotonic_ms();
+	if (lead_cnt == 0 || lead < lead_min)
+		lead_min = lead;
+	if (lead_cnt == 0 || lead > lead_max)
+		lead_max = lead;
+	if (lead_cnt == 0)
+		lead_sum = 0;
+	lead_sum += lead;
+	lead_cnt++;
+	if (now - lead_time > LEAD_STATS)
+	{
+		lt_debug("%s decoder lead min %d avg %lld max %d ms (target %d)\n", __FUNCTION__,
+			lead_min, lead_sum / lead_cnt, lead_max, inject_lead);
+		lead_time = now;
+		lead_cnt = 0;
+	}
+
+	if (lead <= inject_lead)
+		return false;
+	lead -= inject_lead;
+	if (lead > 100)	/* look at the clock again at least every 100ms */
+		lead = 100;
+	state_wait(lead);
+	return true;
+}
+
+/* how much to read at once: about a quarter of the lead, so that the
+   decoder buffer is topped up in small steps, at least min bytes.
+   def is used if there is no pacing or the bitrate is unknown */
+size_t cPlayback::inject_chunk(size_t min, size_t def)
+{
+	int64_t start, end;
+	off_t bps;
+	size_t ret = def;
+	snapshot(start, end, bps);
+	if (inject_lead > 0 && bps > 0)
+		ret = bps * inject_lead / 4000;
+	if (ret < min)
+		ret = min;
+	if (ret > INBUF_SIZE)
+		ret = INBUF_SIZE;
 	return ret;
 }
 
-ssize_t cPlayback::read_mpeg()
+/* trick mode: instead of reading the whole file, jump from I-frame to
+   I-frame and only send those to the decoder. Every I-frame stays on screen
+   for TRICK_INTERVAL, the jump in the file is chosen so that the resulting
+   speed matches playback_speed. Works in both directions. */
+ssize_t cPlayback::read_trick()
 {
-	ssize_t toread, ret, sync;
-	//toread = PESBUF_SIZE - pesbuf_pos;
-	/* experiments found, that 80kB is the best buffer size, otherwise a/v sync seems
-	   to suffer and / or audio stutters */
-	toread = 80 * 1024 - pesbuf_pos;
-	bool retry = true;
-
-	if (INBUF_SIZE - inbuf_pos < toread)
+	int64_t pts = -1, start, end;
+	off_t step, pos, bps;
+
+	snapshot(start, end, bps);
+	trick_time = monotonic_ms();
+	if (trick_pos < 0)
+		trick_pos = curr_pos;
+	if (bps > 0)
+		step = bps * playback_speed * TRICK_INTERVAL / 1000;
+	else
+		step = (off_t)playback_speed * 128 * 1024; /* unknown bitrate, guess ~4MBit/s */
+
+	trick_pos += step;
+	if (trick_pos < 0)
+		trick_pos = 0;
+	pos = find_iframe(trick_pos, pts);
+	if (pos < 0)
 	{
-		lt_info("%s inbuf full, setting toread to %d (old: %zd)\n", __FUNCTION__, INBUF_SIZE - inbuf_pos, toread);
-		toread = INBUF_SIZE - inbuf_pos;
+		/* EOF (or no more I-frames), stay here */
+		lt_debug("%s no I-frame after %lld\n", __FUNCTION__, (long long)trick_pos);
+		trick_pos -= step;
+		return 0;
 	}
-	pthread_mutex_lock(&currpos_mutex);
-	while(true)
+	/* the current one is still the nearest I-frame in this direction,
+	   leave it on screen for another interval */
+	if (pos == curr_pos || (playback_speed < 0 && pos > curr_pos))
+		return 0;
+
+	curr_pos = pos;
+	if (pts > -1)
+		pts_curr = pts;
+	if (filetype == FILETYPE_TS)
+		return inject_iframe(pos);
+
+	/* PES with index: convert only the video of this frame to TS. read_mpeg()
+	   needs to see the start of the next packet to know that this one is complete */
+	int frame = vdrindex.Find(pos);
+	size_t len = vdrindex.Pos(frame + 1) - pos + 16;
+	if (frame + 1 >= vdrindex.Frames())
+		len = INBUF_SIZE;
+	inbuf_pos = 0;
+	ssize_t ret = read_mpeg(len, true);
+	curr_pos = pos;
+	return ret;
+}
+
+/* check if the TS packet p starts a video PES that contains an I-frame.
+   The TripleDragon can only decode MPEG-2 video, so only this is handled */
+bool cPlayback::is_iframe(const uint8_t *p, int64_t &pts)
+{
+	if (!(p[1] & 0x40) || !(p[3] & 0x10) || get_pid(p + 1) != vpid)
+		return false;
+	int off = 4;
+	if (p[3] & 0x20)	/* adaptation field */
+		off += p[4] + 1;
+	if (off + 9 > 188)
+		return false;
+	const uint8_t *pes = p + off;
+	if (pes[0] || pes[1] || pes[2] != 0x01 || (pes[3] & 0xf0) != 0xe0)
+		return false;
+	/* look at the start codes in the first packet of the PES */
+	bool found = false;
+	for (int i = off + 9 + pes[8]; i < 188 - 5; i++)
+	{
+		if (p[i] || p[i + 1] || p[i + 2] != 0x01)
+			continue;
+		if (p[i + 3] == 0xb3 || p[i + 3] == 0xb8)	/* sequence or GOP header */
+			found = true;
+		else if (p[i + 3] == 0x00)			/* picture header */
+			found = (((p[i + 5] >> 3) & 0x07) == 1);/* picture_coding_type I */
+		else
+			continue;
+		break;
+	}
+	if (!found)
+		return false;
+	pts = get_pts(pes, true, 188 - off);
+	return true;
+}
+
+/* returns the position of the first I-frame at or after from, -1 if there
+   is none. Everything that is scanned is remembered in iframes, so that
+   going back and forth over the same part of the file is cheap */
+off_t cPlayback::find_iframe(off_t from, int64_t &pts)
+{
+	std::map<off_t, IFrame>::iterator it;
+	off_t pos = from;
+	off_t last = from;	/* no I-frame between last and pos */
+
+	if (vdrindex.Frames() > 0)
+	{
+		/* no need to scan, the index has all I-frames */
+		int frame = vdrindex.Find(from);
+		if (vdrindex.Pos(frame) < from)
+			frame++;
+		if (frame >= vdrindex.Frames())
+			return -1;
+		frame = vdrindex.IFrame(frame, 1);
+		pts = -1;
+		return vdrindex.Pos(frame);
+	}
+	while (pos - from < TRICK_SCAN_MAX)
 	{
-		ret = read(in_fd, pesbuf + pesbuf_pos, toread);
-		if (ret == 0 && retry) /* EOF */
+		it = iframes.lower_bound(pos);
+		if (it != iframes.end() && it->second.from <= pos)
 		{
-			mf_lseek(curr_pos);
-			retry = false;
+			/* the rest is already known */
+			if (it->second.from > last)
+				it->second.from = last;
+			pts = it->second.pts;
+			return it->first;
+		}
+		size_t len = MF_SPAN_MAX;
+		/* don't scan what is already known */
+		if (it != iframes.end() && (off_t)len > it->second.from - pos + 188)
+			len = it->second.from - pos + 188;
+		const uint8_t *p = mf.Span(rwin, pos, &len);
+		if (!p || len < 188)
+			break;	/* EOF */
+		int s = sync_ts(p, len);
+		if (s < 0)
+		{
+			if (len <= 189)
+				break;
+			pos += len - 188;
 			continue;
 		}
-		break;
+		p += s;
+		len -= s;
+		pos += s;
+		size_t n;
+		for (n = 0; n + 188 <= len; n += 188)
+		{
+			int64_t ipts = -1;
+			if (!is_iframe(p + n, ipts))
+				continue;
+			IFrame f;
+			f.pts = ipts;
+			f.from = last;
+			iframes[pos + n] = f;
+			map_pts(pos + n, ipts);
+			pts = ipts;
+			return pos + n;
+		}
+		if (n == 0)
+			break;
+		pos += n;
+	}
+	lt_info("%s no I-frame found between %lld and %lld\n", __FUNCTION__, (long long)from, (long long)pos);
+	return -1;
+}
+
+/* copy the video packets of the I-frame at pos into inbuf. The decoder
+   gets nothing else in trick mode, so the CC discontinuities don't matter */
+ssize_t cPlayback::inject_iframe(off_t pos)
+{
+	bool started = false;
+	inbuf_pos = 0;
+	while (inbuf_pos < INBUF_SIZE)
+	{
+		size_t len = MF_SPAN_MAX;
+		const uint8_t *p = mf.Span(rwin, pos, &len);
+		if (!p || len < 188)
+			break;
+		size_t n;
+		for (n = 0; n + 188 <= len && inbuf_pos < INBUF_SIZE; n += 188)
+		{
+			const uint8_t *ts = p + n;
+			if (ts[0] != 0x47)
+			{
+				lt_info("%s lost sync at %lld\n", __FUNCTION__, (long long)(pos + n));
+				goto out;
+			}
+			if (get_pid(ts + 1) != vpid)
+				continue;
+			if (ts[1] & 0x40)	/* the next PES starts, the I-frame is complete */
+			{
+				if (started)
+					goto out;
+				started = true;
+			}
+			memcpy(inbuf + inbuf_pos, ts, 188);
+			inbuf_pos += 188;
+		}
+		pos += n;
 	}
-	if (ret < 0)
+ out:
+	lt_debug("%s %zd bytes at %lld\n", __FUNCTION__, inbuf_pos, (long long)pos);
+	outbuf = inbuf;
+	outbuf_len = inbuf_pos;
+	return inbuf_pos;
+}
+
+/* read PAT and PMT at the start of a TS file, so that all streams (with their
+   language) are known before the play thread starts. Returns false if there
+   is no PSI, the streams are then found while playing */
+bool cPlayback::probe_psi(void)
+{
+	uint8_t sec[1024 + 3];
+	int sec_len = 0;
+	int sec_pid = -1;
+	int pmt_pid = -1;
+	size_t len = MF_SPAN_MAX;
+	const uint8_t *buf = mf.Span(rwin, curr_pos, &len);
+	if (!buf)
+		return false;
+	int s = sync_ts(buf, len);
+	if (s < 0)
+		return false;
+	for (size_t i = s; i + 188 <= len; i += 188)
 	{
-		pthread_mutex_unlock(&currpos_mutex);
-		lt_info("%s failed: %m, pesbuf_pos: %zd, toread: %zd\n", __FUNCTION__, pesbuf_pos, toread);
-		return ret;
+		const uint8_t *p = buf + i;
+		if (p[0] != 0x47)
+			continue;
+		int pid = get_pid(p + 1);
+		if ((pid != 0 && pid != pmt_pid) || !(p[3] & 0x10))
+			continue;
+		int off = 4;
+		if (p[3] & 0x20)	/* adaptation field */
+			off += p[4] + 1;
+		if (p[1] & 0x40)	/* PUSI: a section starts after the pointer field */
+		{
+			if (off < 188)
+				off += p[off] + 1;
+			sec_len = 0;
+			sec_pid = pid;
+		}
+		else if (sec_pid != pid || sec_len == 0)
+			continue;
+		if (off >= 188)
+			continue;
+		int n = 188 - off;
+		if (sec_len + n > (int)sizeof(sec))
+			n = sizeof(sec) - sec_len;
+		memcpy(sec + sec_len, p + off, n);
+		sec_len += n;
+		if (sec_len < 3)
+			continue;
+		int slen = (((sec[1] & 0x0f) << 8) | sec[2]) + 3;
+		if (slen < 16 || slen > (int)sizeof(sec))
+		{
+			sec_len = 0;
+			continue;
+		}
+		if (sec_len < slen)
+			continue;
+		sec_len = 0;
+		if (pid == 0 && sec[0] == 0x00)
+			pmt_pid = parse_pat(sec, slen);
+		else if (pid == pmt_pid && sec[0] == 0x02)
+		{
+			parse_pmt(sec, slen);
+			return true;
+		}
 	}
-	pesbuf_pos += ret;
-	curr_pos += ret;
-	pthread_mutex_unlock(&currpos_mutex);
+	lt_info("%s no PMT found (PMT pid %d)\n", __FUNCTION__, pmt_pid);
+	return false;
+}
+
+/* returns the PMT pid of the first program */
+int cPlayback::parse_pat(const uint8_t *sec, int len)
+{
+	/* 8 bytes header, 4 bytes CRC */
+	for (int i = 8; i + 4 <= len - 4; i += 4)
+	{
+		int prog = (sec[i] << 8) | sec[i + 1];
+		if (prog == 0)	/* network PID */
+			continue;
+		int pid = ((sec[i + 2] & 0x1f) << 8) | sec[i + 3];
+		lt_info("%s program %d PMT pid 0x%04x\n", __FUNCTION__, prog, pid);
+		return pid;
+	}
+	return -1;
+}
+
+void cPlayback::parse_pmt(const uint8_t *sec, int len)
+{
+	int i = 12 + (((sec[10] & 0x0f) << 8) | sec[11]);	/* skip program info */
+	while (i + 5 <= len - 4)
+	{
+		int type = sec[i];
+		uint16_t pid = ((sec[i + 1] & 0x1f) << 8) | sec[i + 2];
+		int dlen = ((sec[i + 3] & 0x0f) << 8) | sec[i + 4];
+		const uint8_t *d = sec + i + 5;
+		const uint8_t *end = d + dlen;
+		i += 5 + dlen;
+		if (i > len - 4)
+			break;
+		/* the TripleDragon can only decode MPEG audio and AC3 */
+		bool audio = false, is_ac3 = false, unsupported = false;
+		std::string lang;
+		switch (type)
+		{
+		case 0x01:	/* MPEG-1 video */
+		case 0x02:	/* MPEG-2 video */
+			if (vpid == 0)
+				vpid = pid;
+			lt_info("%s video pid 0x%04hx type 0x%02x\n", __FUNCTION__, pid, type);
+			continue;
+		case 0x03:	/* MPEG-1 audio */
+		case 0x04:	/* MPEG-2 audio */
+			audio = true;
+			break;
+		case 0x81:	/* AC3 (ATSC) */
+			audio = is_ac3 = true;
+			break;
+		case 0x0f:	/* AAC */
+		case 0x11:	/* AAC LATM */
+			unsupported = true;
+			break;
+		}
+		for (; d + 2 <= end && d + 2 + d[1] <= end; d += 2 + d[1])
+		{
+			switch (d[0])
+			{
+			case 0x0a:	/* ISO 639 language */
+				if (d[1] >= 3)
+					lang = std::string((const char *)d + 2, 3);
+				break;
+			case 0x6a:	/* AC3 */
+				if (type == 0x06)
+					audio = is_ac3 = true;
+				break;
+			case 0x7a:	/* E-AC3 */
+				unsupported = true;
+				break;
+			}
+		}
+		if (unsupported)
+		{
+			lt_info("%s ignoring unsupported audio pid 0x%04hx type 0x%02x\n", __FUNCTION__, pid, type);
+			continue;
+		}
+		if (!audio || astreams.find(pid) != astreams.end())
+			continue;
+		AStream tmp;
+		tmp.ac3 = is_ac3;
+		tmp.lang = lang;
+		astreams.insert(std::make_pair(pid, tmp));
+		lt_info("%s found apid #%d 0x%04hx ac3:%d lang:%s\n", __func__, astreams.size(), pid, is_ac3, lang.c_str());
+	}
+}
+
+/* reads up to toread bytes of PES and converts them to TS in inbuf. In trick
+   mode, only one frame is read and only the video is converted */
+ssize_t cPlayback::read_mpeg(size_t toread, bool video_only)
+{
+	ssize_t sync;
+
+	if ((size_t)(INBUF_SIZE - inbuf_pos) < toread)
+	{
+		lt_info("%s inbuf full, setting toread to %d (old: %zd)\n", __FUNCTION__, INBUF_SIZE - inbuf_pos, toread);
+		toread = INBUF_SIZE - inbuf_pos;
+	}
+	if (toread == 0)
+		return 0;
+	/* the PES packets are parsed directly in the mapped file */
+	const uint8_t *pesbuf = mf.Span(rwin, curr_pos, &toread);
+	if (!pesbuf)
+		return 0; /* EOF */
+	ssize_t pesbuf_pos = toread;
 
 	int count = 0;
 	uint16_t pid = 0;
@@ -1101,7 +1672,7 @@ ssize_t cPlayback::read_mpeg()
 				lt_info("%s needed sync %zd\n", __FUNCTION__, sync);
 			count += sync;
 		}
-		uint8_t *ppes = pesbuf + count;
+		const uint8_t *ppes = pesbuf + count;
 		int av = 0; // 1 = video, 2 = audio
 		int64_t pts;
 		switch(ppes[3])
@@ -1183,8 +1754,7 @@ ssize_t cPlayback::read_mpeg()
 				if (pts < 0)
 					break;
 				pts_curr = pts;
-				if (pts_start < 0)
-					pts_start = pts;
+				map_pts(curr_pos + count, pts);
 				break;
 			case 0xb9:
 			case 0xbc:
@@ -1215,7 +1785,7 @@ ssize_t cPlayback::read_mpeg()
 			break;
 		}
 
-		if (av)
+		if (av == 1 || (av && !video_only))
 		{
 			int rest = pesPacketLen % 184;
 
@@ -1256,9 +1826,10 @@ ssize_t cPlayback::read_mpeg()
 
 		count += pesPacketLen;
 	}
-	memmove(pesbuf, pesbuf + count, pesbuf_pos - count);
-	pesbuf_pos -= count;
-	return ret;
+	curr_pos += count;
+	outbuf = inbuf;
+	outbuf_len = inbuf_pos;
+	return count;
 }
 
 //== seek to pos with sync to next proper TS packet ==
@@ -1267,109 +1838,46 @@ ssize_t cPlayback::read_mpeg()
 //====================================================
 off_t cPlayback::mp_seekSync(off_t pos)
 {
-	off_t npos = pos;
-	off_t ret;
-	uint8_t pkt[1024];
-
-	pthread_mutex_lock(&currpos_mutex);
-	ret = mf_lseek(npos);
-	if (ret < 0)
-		lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
+	size_t len;
+	int s;
+	const uint8_t *p;
 
 	if (filetype != FILETYPE_TS)
-	{
-		int offset = 0;
-		int s;
-		ssize_t r;
-		bool retry = false;
-		while (true)
-		{
-			r = read(in_fd, &pkt[offset], 1024 - offset);
-			if (r < 0)
-			{
-				lt_info("%s read failed: %m\n", __FUNCTION__);
-				break;
-			}
-			if (r == 0) // EOF?
-			{
-				if (retry)
-					break;
-				if (mf_lseek(npos) < 0) /* next file in list? */
-				{
-					lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-					break;
-				}
-				retry = true;
-				continue;
-			}
-			s = mp_syncPES(pkt, r + offset, true);
-			if (s < 0)
-			{
-				/* if the last 3 bytes of the buffer were 00 00 01, then
-				   mp_sync_PES would not find it. So keep them and check
-				   again in the next iteration */
-				memmove(pkt, &pkt[r + offset - 3], 3);
-				npos += r;
-				offset = 3;
-			}
-			else
-			{
-				npos += s;
-				lt_info("%s sync after %lld\n", __FUNCTION__, npos - pos);
-				ret = mf_lseek(npos);
-				pthread_mutex_unlock(&currpos_mutex);
-				if (ret < 0)
-					lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-				return ret;
-			}
-			if (npos > (pos + 0x20000)) /* 128k enough? */
-				break;
-		}
-		lt_info("%s could not sync to PES offset: %d r: %zd\n", __FUNCTION__, offset, r);
-		ret = mf_lseek(pos);
-		pthread_mutex_unlock(&currpos_mutex);
-		return ret;
-	}
+		len = 0x20000; /* 128k enough? */
+	else
+		len = 100 * 188 + 189;
 
-	/* TODO: use bigger buffer here, too and handle EOF / next splitfile */
-	while (read(in_fd, pkt, 1) > 0)
+	p = mf.Span(rwin, pos, &len);
+	if (!p)
 	{
-		//-- check every byte until sync word reached --
-		npos++;
-		if (*pkt == 0x47)
+		/* a (still) empty timeshift file is fine, everything else is EOF */
+		if (pos > mf.Size())
 		{
-			//-- if found double check for next sync word --
-			if (read(in_fd, pkt, 188) == 188)
-			{
-				if(pkt[188-1] == 0x47)
-				{
-					ret = mf_lseek(npos - 1); // assume sync ok
-					pthread_mutex_unlock(&currpos_mutex);
-					if (ret < 0)
-						lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-					return ret;
-				}
-				else
-				{
-					ret = mf_lseek(npos); // oops, next pkt doesn't start with sync
-					if (ret < 0)
-						lt_info("%s:%d lseek ret < 0 (%m)\n", __FUNCTION__, __LINE__);
-				}
-			}
+			lt_info("%s:%d pos %lld is beyond EOF\n", __FUNCTION__, __LINE__, (long long)pos);
+			return -2;
 		}
-
-		//-- check probe limits --
-		if (npos > (pos + 100 * 188))
-			break;
+		curr_pos = pos;
+		return curr_pos;
 	}
 
+	if (filetype != FILETYPE_TS)
+		s = mp_syncPES(p, len, true);
+	else
+		s = sync_ts(p, len);
+
 	//-- on error stay on actual position --
-	ret = mf_lseek(pos);
-	pthread_mutex_unlock(&currpos_mutex);
-	return ret;
+	if (s < 0)
+	{
+		lt_info("%s could not sync at %lld (len %zd)\n", __FUNCTION__, (long long)pos, len);
+		s = 0;
+	}
+	else if (s > 0)
+		lt_info("%s sync after %d\n", __FUNCTION__, s);
+	curr_pos = pos + s;
+	return curr_pos;
 }
 
-static int sync_ts(uint8_t *p, int len)
+static int sync_ts(const uint8_t *p, int len)
 {
 	int count;
 	if (len < 189)
@@ -1388,7 +1896,7 @@ static int sync_ts(uint8_t *p, int len)
 
 /* get the pts value from a TS or PES packet
    pes == true selects PES mode. */
-int64_t cPlayback::get_pts(uint8_t *p, bool pes, int bufsize)
+int64_t cPlayback::get_pts(const uint8_t *p, bool pes, int bufsize)
 {
 	const uint8_t *end = p + bufsize; /* check for overflow */
 	if (bufsize < 14)
@@ -1458,7 +1966,7 @@ int64_t cPlayback::get_pts(uint8_t *p, bool pes, int bufsize)
 }
 
 /* returns: 0 == was already synchronous, > 0 == is now synchronous, -1 == could not sync */
-static int mp_syncPES(uint8_t *buf, int len, bool quiet)
+static int mp_syncPES(const uint8_t *buf, int len, bool quiet)
 {
 	int ret = 0;
 	while (ret < len - 4)
@@ -1494,8 +2002,43 @@ static int mp_syncPES(uint8_t *buf, int len, bool quiet)
 	return -1;
 }
 
-static inline uint16_t get_pid(uint8_t *buf)
+static inline uint16_t get_pid(const uint8_t *buf)
 {
 	return (*buf & 0x1f) << 8 | *(buf + 1);
 }
 
+/* change the state and wake up everybody who is waiting for a change */
+void cPlayback::set_state(playstate_t state, int speed)
+{
+	pthread_mutex_lock(&state_mutex);
+	playstate = state;
+	playback_speed = speed;
+	state_time = monotonic_ms();
+	pthread_cond_broadcast(&state_cond);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+/* sleep for up to ms milliseconds, a state change ends the wait early */
+void cPlayback::state_wait(int ms)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (ms % 1000) * 1000000;
+	if (t.tv_nsec >= 1000000000)
+	{
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&state_mutex);
+	if (playstate != STATE_STOP)
+		pthread_cond_timedwait(&state_cond, &state_mutex, &t);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+static int64_t monotonic_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
@@ -6,9 +6,12 @@
 #include <map>
 #include <vector>
 
+#include "multifile_td.h"
+#include "ptsmap_td.h"
+#include "vdrindex_td.h"
+
 /* almost 256kB */
 #define INBUF_SIZE (1394 * 188)
-#define PESBUF_SIZE (128 * 1024)
 
 typedef enum {
 	PLAYMODE_TS = 0,
@@ -41,17 +44,16 @@ class cPlayback
 	private:
 		uint8_t *inbuf;
 		ssize_t inbuf_pos;
-		ssize_t inbuf_sync;
-		uint8_t *pesbuf;
-		ssize_t pesbuf_pos;
+		const uint8_t *outbuf;	/* data to be written to the DVR, either inbuf or mapped file */
+		ssize_t outbuf_len;
 		ssize_t inbuf_read(void);
 		ssize_t read_ts(void);
-		ssize_t read_mpeg(void);
+		ssize_t read_mpeg(size_t toread, bool video_only = false);
+		ssize_t read_trick(void);
+		void scan_ts(const uint8_t *buf, ssize_t len, off_t pos);
 
 		uint8_t cc[256];
 
-		int in_fd;
-
 		int video_type;
 		int playback_speed;
 		int mSpeed;
@@ -59,15 +61,33 @@ class cPlayback
 		std::vector<filelist_t> filelist; /* for multi-file playback */
 
 		bool filelist_auto_add(void);
-		int mf_open(int fileno);
-		int mf_close(void);
-		off_t mf_lseek(off_t pos);
-		off_t mf_getsize(void);
-		int curr_fileno;
+		cMultiFile mf;
+		mf_window_t rwin;	/* used by the play thread */
+		mf_window_t pwin;	/* used by the tracker thread */
 		off_t curr_pos;
-		off_t last_size;
 		off_t bytes_per_second;
 
+		/* trick mode (fast forward and rewind) only sends I-frames */
+		bool can_trick;		/* TS, or PES with an index */
+		struct IFrame {
+			int64_t pts;
+			off_t from;	/* there is no other I-frame between from and this one */
+		};
+		std::map<off_t, IFrame> iframes;	/* I-frames found so far, sorted by position */
+		off_t trick_pos;	/* nominal position, advances by exactly speed * time */
+		int64_t trick_time;	/* when the last I-frame was sent, for pacing */
+
+		/* normal playback is paced by PTS: the data written to the DVR is
+		   kept inject_lead ms ahead of the decoder clock */
+		int inject_lead;
+		int lead_min, lead_max, lead_cnt;
+		int64_t lead_sum, lead_time;
+		bool inject_wait(void);
+		size_t inject_chunk(size_t min, size_t def);
+		bool is_iframe(const uint8_t *p, int64_t &pts);
+		off_t find_iframe(off_t from, int64_t &pts);
+		ssize_t inject_iframe(off_t pos);
+
 		uint16_t vpid;
 		uint16_t apid;
 		bool ac3;
@@ -77,27 +97,59 @@ class cPlayback
 			std::string lang; /* not yet really used */
 		};
 		std::map<uint16_t, AStream> astreams; /* stores AStream sorted by pid */
+		bool have_psi;	/* streams are known from the PMT, no need to guess */
+		bool probe_psi(void);
+		int parse_pat(const uint8_t *sec, int len);
+		void parse_pmt(const uint8_t *sec, int len);
 
 		int64_t pts_start;
 		int64_t pts_end;
-		int64_t _pts_end; /* last good endpts */
 		int64_t pts_curr;
-		int64_t get_pts(uint8_t *p, bool pes, int bufsize);
+		int64_t get_pts(const uint8_t *p, bool pes, int bufsize);
+		int64_t get_start_pts(void);
+		int64_t get_end_pts(off_t size, off_t from = 0);
+
+		/* sample points for seeking, see seek_to_pts() */
+		cPtsMap ptsmap;
+		std::string ptsmap_name;
+		void map_pts(off_t pos, int64_t pts);
+		int64_t probe_pts(off_t pos, off_t &ppos);
+		cVdrIndex vdrindex;
+
+		/* the tracker thread follows a growing (timeshift) file. It is the
+		   only writer of pts_start, pts_end and bytes_per_second while it
+		   runs, readers take a consistent snapshot without locking */
+		volatile unsigned int track_seq;
+		void publish(int64_t start, int64_t end, off_t bps);
+		void snapshot(int64_t &start, int64_t &end, off_t &bps);
+		pthread_t track_thread;
+		bool track_started;
 
 		filetype_t filetype;
 		playstate_t playstate;
 
 		off_t seek_to_pts(int64_t pts);
 		off_t mp_seekSync(off_t pos);
-		int64_t get_PES_PTS(uint8_t *buf, int len, bool until_eof);
+		int64_t get_PES_PTS(const uint8_t *buf, int len, bool until_eof);
 
 		pthread_t thread;
 		bool thread_started;
+
+		/* playstate and playback_speed are changed under state_mutex and
+		   every change is broadcast on state_cond: the play thread sleeps
+		   there while paused, SetPosition() waits for the pause to be
+		   acknowledged and the other waits can be interrupted */
+		pthread_mutex_t state_mutex;
+		pthread_cond_t state_cond;
+		int64_t state_time;	/* when the last change was requested */
+		void set_state(playstate_t state, int speed);
+		void state_wait(int ms);
 	public:
 		cPlayback(int num = 0);
 		~cPlayback();
 
 		void playthread();
+		void trackthread();
 
 		bool Open(playmode_t PlayMode);
 		void Close(void);
@@ -0,0 +1,203 @@
+/*
+ * cPtsMap: sparse, persistent map of file offsets to PTS values
+ * for seeking in recordings
+ *
+ * License: GPL v2 or later
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "ptsmap_td.h"
+#include "lt_debug.h"
+#define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_PLAYBACK, this, args)
+#define lt_info(args...)  _lt_info(TRIPLE_DEBUG_PLAYBACK, this, args)
+
+static const char PTSMAP_MAGIC[8] = { 'P', 'T', 'S', 'M', 'A', 'P', '0', '1' };
+
+cPtsMap::cPtsMap()
+{
+	pthread_mutex_init(&mutex, NULL);
+	dirty = false;
+}
+
+cPtsMap::~cPtsMap()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void cPtsMap::Clear(void)
+{
+	pthread_mutex_lock(&mutex);
+	points.clear();
+	dirty = false;
+	pthread_mutex_unlock(&mutex);
+}
+
+int cPtsMap::Count(void)
+{
+	pthread_mutex_lock(&mutex);
+	int ret = points.size();
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void cPtsMap::Add(off_t pos, int64_t pts)
+{
+	if (pos < 0 || pts < 0)
+		return;
+	pthread_mutex_lock(&mutex);
+	/* binary search for the first point after pos */
+	int lo = 0, hi = points.size();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (points[mid].pos <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* keep the map sparse */
+	if ((lo > 0 && pos - points[lo - 1].pos < PTSMAP_SPACING) ||
+	    (lo < (int)points.size() && points[lo].pos - pos < PTSMAP_SPACING))
+		goto out;
+	point p;
+	p.pos = pos;
+	p.pts = pts;
+	points.insert(points.begin() + lo, p);
+	dirty = true;
+ out:
+	pthread_mutex_unlock(&mutex);
+}
+
+/* narrow the range [lo, hi] down to the nearest known points around pts */
+void cPtsMap::Bracket(int64_t pts, off_t &lo, int64_t &lo_pts, off_t &hi, int64_t &hi_pts)
+{
+	pthread_mutex_lock(&mutex);
+	int l = 0, h = points.size();
+	while (l < h)
+	{
+		int mid = (l + h) / 2;
+		if (points[mid].pts <= pts)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	if (l < (int)points.size() && points[l].pos < hi && points[l].pos > lo)
+	{
+		hi = points[l].pos;
+		hi_pts = points[l].pts;
+	}
+	if (l > 0 && points[l - 1].pos > lo && points[l - 1].pos < hi)
+	{
+		lo = points[l - 1].pos;
+		lo_pts = points[l - 1].pts;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/* the map is only valid for the same recording: the start PTS and the
+   size are stored in the header and need to match */
+bool cPtsMap::Load(const char *name, int64_t start, off_t size)
+{
+	char magic[8];
+	int64_t hdr[2];
+	uint32_t count;
+	struct stat st;
+	long at;
+	bool ret = false;
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return false;
+	pthread_mutex_lock(&mutex);
+	points.clear();
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, PTSMAP_MAGIC, sizeof(magic)) ||
+	    fread(hdr, sizeof(hdr), 1, f) != 1 || fread(&count, sizeof(count), 1, f) != 1)
+	{
+		lt_info("%s %s: invalid header\n", __func__, name);
+		goto out;
+	}
+	if (hdr[0] != start || hdr[1] != (int64_t)size)
+	{
+		lt_info("%s %s: does not match the recording\n", __func__, name);
+		goto out;
+	}
+	/* the entries must be there before they are allocated */
+	if (fstat(fileno(f), &st) || (at = ftell(f)) < 0 ||
+	    (uint64_t)count * 2 * sizeof(int64_t) != (uint64_t)(st.st_size - at))
+	{
+		lt_info("%s %s: size does not match %u entries\n", __func__, name, count);
+		goto out;
+	}
+	points.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		int64_t e[2];
+		if (fread(e, sizeof(e), 1, f) != 1 || e[0] < 0 || e[0] > size ||
+		    (i > 0 && e[0] <= points[i - 1].pos))
+		{
+			lt_info("%s %s: invalid entry %u\n", __func__, name, i);
+			points.clear();
+			goto out;
+		}
+		points[i].pos = e[0];
+		points[i].pts = e[1];
+	}
+	lt_info("%s loaded %u points from %s\n", __func__, count, name);
+	ret = true;
+ out:
+	dirty = false;
+	pthread_mutex_unlock(&mutex);
+	fclose(f);
+	return ret;
+}
+
+/* only writes the file if something was added */
+bool cPtsMap::Save(const char *name, int64_t start, off_t size)
+{
+	bool ret = false;
+	pthread_mutex_lock(&mutex);
+	if (!dirty || points.empty())
+	{
+		pthread_mutex_unlock(&mutex);
+		return true;
+	}
+	std::string tmp = std::string(name) + ".tmp";
+	int64_t hdr[2] = { start, size };
+	uint32_t count = points.size();
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f)
+	{
+		lt_info("%s cannot open %s (%m)\n", __func__, tmp.c_str());
+		goto out;
+	}
+	fwrite(PTSMAP_MAGIC, sizeof(PTSMAP_MAGIC), 1, f);
+	fwrite(hdr, sizeof(hdr), 1, f);
+	fwrite(&count, sizeof(count), 1, f);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		int64_t e[2] = { points[i].pos, points[i].pts };
+		fwrite(e, sizeof(e), 1, f);
+	}
+	if (ferror(f) | fclose(f))
+	{
+		lt_info("%s writing %s failed\n", __func__, tmp.c_str());
+		unlink(tmp.c_str());
+		goto out;
+	}
+	if (rename(tmp.c_str(), name))
+	{
+		lt_info("%s rename %s failed (%m)\n", __func__, tmp.c_str());
+		unlink(tmp.c_str());
+		goto out;
+	}
+	lt_debug("%s saved %u points to %s\n", __func__, count, name);
+	dirty = false;
+	ret = true;
+ out:
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
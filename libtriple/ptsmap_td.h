@@ -0,0 +1,36 @@
+#ifndef __PTSMAP_TD_H
+#define __PTSMAP_TD_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <vector>
+
+/* sample points closer than this are not stored */
+#define PTSMAP_SPACING (512 * 1024)
+
+/* sparse map of (file offset, PTS) sample points, collected during playback
+   and while seeking, and saved next to the recording. The PTS are stored
+   relative to the start PTS of the file, so that a PTS wraparound in the
+   middle of a recording does not break the ordering */
+class cPtsMap
+{
+	private:
+		struct point {
+			off_t pos;
+			int64_t pts;
+		};
+		std::vector<point> points;	/* sorted by pos (and thus by pts) */
+		pthread_mutex_t mutex;
+		bool dirty;
+	public:
+		cPtsMap();
+		~cPtsMap();
+		void Clear(void);
+		void Add(off_t pos, int64_t pts);
+		void Bracket(int64_t pts, off_t &lo, int64_t &lo_pts, off_t &hi, int64_t &hi_pts);
+		int Count(void);
+		bool Load(const char *name, int64_t start, off_t size);
+		bool Save(const char *name, int64_t start, off_t size);
+};
+#endif
@@ -0,0 +1,162 @@
+/*
+ * cVdrIndex: access to the index.vdr file of VDR recordings
+ *
+ * License: GPL v2 or later
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vdrindex_td.h"
+#include "lt_debug.h"
+#define lt_debug(args...) _lt_debug(TRIPLE_DEBUG_PLAYBACK, this, args)
+#define lt_info(args...)  _lt_info(TRIPLE_DEBUG_PLAYBACK, this, args)
+
+/* struct tIndex { int offset; uchar type; uchar number; short reserved; }; */
+#define ENTRY_SIZE 8
+
+cVdrIndex::cVdrIndex()
+{
+	map = NULL;
+	map_len = 0;
+	frames = 0;
+	swap = false;
+	mf = NULL;
+}
+
+cVdrIndex::~cVdrIndex()
+{
+	Close();
+}
+
+void cVdrIndex::Close(void)
+{
+	if (map)
+		munmap(map, map_len);
+	map = NULL;
+	map_len = 0;
+	frames = 0;
+	mf = NULL;
+}
+
+off_t cVdrIndex::entry_offset(int frame, bool s)
+{
+	const uint8_t *e = map + frame * ENTRY_SIZE;
+	if (s)
+		return (e[0] << 24) | (e[1] << 16) | (e[2] << 8) | e[3];
+	return e[0] | (e[1] << 8) | (e[2] << 16) | (e[3] << 24);
+}
+
+/* plausibility check of the first entries with the given byte order */
+bool cVdrIndex::check(bool s)
+{
+	off_t last = -1;
+	int lastnum = 0;
+	for (int i = 0; i < frames && i < 100; i++)
+	{
+		int num = map[i * ENTRY_SIZE + 5];
+		off_t off = entry_offset(i, s);
+		off_t start = mf->PartStart(num - 1);
+		off_t end = (num < mf->Parts()) ? mf->PartStart(num) : mf->Size();
+		if (start < 0 || off < 0 || off > end - start)
+			return false;
+		if (num == lastnum && off <= last)
+			return false;
+		last = off;
+		lastnum = num;
+	}
+	return true;
+}
+
+bool cVdrIndex::Open(const char *name, cMultiFile *file)
+{
+	struct stat st;
+	Close();
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) || st.st_size < ENTRY_SIZE)
+	{
+		close(fd);
+		return false;
+	}
+	map_len = st.st_size;
+	map = (uint8_t *)mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		lt_info("%s mmap %s failed (%m)\n", __func__, name);
+		map = NULL;
+		map_len = 0;
+		return false;
+	}
+	mf = file;
+	frames = map_len / ENTRY_SIZE;
+	/* VDR writes the index in host byte order, most recordings come from x86 */
+	swap = false;
+	if (!check(false))
+	{
+		swap = true;
+		if (!check(true))
+		{
+			lt_info("%s %s does not match the recording\n", __func__, name);
+			Close();
+			return false;
+		}
+	}
+	lt_info("%s %s: %d frames (%d:%02d)%s\n", __func__, name, frames,
+		frames / VDR_FRAMESPERSEC / 60, frames / VDR_FRAMESPERSEC % 60, swap ? ", byte swapped" : "");
+	return true;
+}
+
+int cVdrIndex::Type(int frame)
+{
+	if (frame < 0 || frame >= frames)
+		return -1;
+	return map[frame * ENTRY_SIZE + 4];
+}
+
+/* position of the frame in the cMultiFile, -1 if invalid */
+off_t cVdrIndex::Pos(int frame)
+{
+	if (frame < 0 || frame >= frames)
+		return -1;
+	off_t start = mf->PartStart(map[frame * ENTRY_SIZE + 5] - 1);
+	if (start < 0)
+		return -1;
+	return start + entry_offset(frame, swap);
+}
+
+/* the last frame that starts at or before pos */
+int cVdrIndex::Find(off_t pos)
+{
+	int lo = 0, hi = frames - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (Pos(mid) <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/* the nearest I-frame at or after (dir > 0) or at or before (dir < 0) frame */
+int cVdrIndex::IFrame(int frame, int dir)
+{
+	if (frame < 0)
+		frame = 0;
+	if (frame >= frames)
+		frame = frames - 1;
+	while (frame >= 0 && frame < frames)
+	{
+		if (Type(frame) == VDR_I_FRAME)
+			return frame;
+		frame += (dir < 0) ? -1 : 1;
+	}
+	return -1;
+}
@@ -0,0 +1,38 @@
+#ifndef __VDRINDEX_TD_H
+#define __VDRINDEX_TD_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "multifile_td.h"
+
+/* VDR recordings don't store the frame rate, VDR itself assumes PAL */
+#define VDR_FRAMESPERSEC 25
+
+#define VDR_I_FRAME 1
+
+/* the index.vdr file of a VDR (PES) recording: one entry per video frame
+   with the file number, the offset of the PES packet that starts the frame
+   and the frame type. The file is memory mapped, nothing is copied */
+class cVdrIndex
+{
+	private:
+		uint8_t *map;
+		size_t map_len;
+		int frames;
+		bool swap;		/* the index was written on a host with different byte order */
+		cMultiFile *mf;
+		off_t entry_offset(int frame, bool s);
+		bool check(bool s);
+	public:
+		cVdrIndex();
+		~cVdrIndex();
+		bool Open(const char *name, cMultiFile *file);
+		void Close(void);
+		int Frames(void) { return frames; };
+		int Type(int frame);
+		off_t Pos(int frame);
+		int Find(off_t pos);
+		int IFrame(int frame, int dir);
+};
+#endif